@@ -0,0 +1,261 @@
+svn = require "svn"
+
+-- Microbenchmarks of LuaSVN. Run it like test.lua:
+--   lua bench.lua [iterations]
+
+n = tonumber (arg and arg[1]) or 1000
+
+repo_path = "bench_repo"
+repo_url = "file://"..os.getenv("PWD").."/bench_repo"
+wc_path = "bench_wc"
+
+-- live memory held by the result of f
+function memory (name, f)
+	collectgarbage ()
+	local before = collectgarbage ("count")
+	local result = f ()
+	collectgarbage ()
+	print (string.format ("%-48s %12.1f KB", name, collectgarbage ("count") - before))
+	return result
+end
+
+-- wall clock time: os.clock only counts the CPU time of this process, so
+-- it misses network and disk latency, and adds up the time of threads.
+-- Without LuaSocket, os.time has a resolution of a second, so n must be
+-- large enough for every benchmark to last several seconds
+has_socket, socket = pcall (require, "socket")
+now = has_socket and socket.gettime or os.time
+
+function bench (name, f, count)
+	count = count or n
+	local t = now ()
+	for i = 1, count do
+		f (i)
+	end
+	t = now () - t
+	print (string.format ("%-48s %12.1f us/call", name, t * 1e6 / count))
+end
+
+svn.repos_create (repo_path)
+assert (svn.checkout (repo_url, wc_path), "unable to checkout")
+
+-- per-call setup: the default session is built once, while a new
+-- session per call pays for the configuration and auth baton again
+bench ("cleanup, default session", function ()
+	svn.cleanup (wc_path)
+end)
+
+bench ("cleanup, new session per call", function ()
+	local s = svn.session ()
+	s:cleanup (wc_path)
+	s:close ()
+end)
+
+-- one-time initialization of APR and svn, paid when the module is loaded:
+-- a new interpreter that loads it and runs a cleanup, against one that
+-- does nothing
+interpreter = arg and arg[-1] or "lua"
+
+bench ("cleanup in a new process, cold init", function ()
+	os.execute (interpreter.." -e 'require \"svn\".cleanup (\""..wc_path.."\")'")
+end, math.ceil (n / 50))
+
+bench ("empty new process", function ()
+	os.execute (interpreter.." -e ''")
+end, math.ceil (n / 50))
+
+-- cat to a file: through a Lua string and io.write, or straight to the file
+f = io.open (wc_path.."/big.bin", "wb")
+for i = 1, 4096 do
+	f:write (string.rep (string.char (i % 256), 1024))
+end
+f:close ()
+svn.add (wc_path.."/big.bin")
+svn.commit (wc_path, "big file")
+big_url = repo_url.."/big.bin"
+
+bench ("cat 4MB file, then io.write", function ()
+	local f = io.open ("bench_output.bin", "wb")
+	f:write (svn.cat (big_url))
+	f:close ()
+end, math.ceil (n / 50))
+
+bench ("cat 4MB file to a path", function ()
+	svn.cat (big_url, nil, "bench_output.bin")
+end, math.ceil (n / 50))
+
+os.remove ("bench_output.bin")
+
+-- many small files at one revision: a loop of cat against cat_many
+small_urls = {}
+for i = 1, 100 do
+	local name = "small"..i..".txt"
+	local f = io.open (wc_path.."/"..name, "w")
+	f:write (string.rep ("line "..i.."\n", 20))
+	f:close ()
+	svn.add (wc_path.."/"..name)
+	small_urls[i] = repo_url.."/"..name
+end
+small_rev = svn.commit (wc_path, "small files")
+
+bench ("cat of 100 files in a loop", function ()
+	for _, url in ipairs (small_urls) do
+		svn.cat (url, small_rev)
+	end
+end, math.ceil (n / 50))
+
+bench ("cat_many of 100 files", function ()
+	svn.cat_many (small_urls, small_rev)
+end, math.ceil (n / 50))
+
+-- status of every file of the working copy: svn status lines or records
+bench ("verbose status, strings", function ()
+	svn.status (wc_path, nil, {verbose = true})
+end, math.ceil (n / 10))
+
+bench ("verbose status, structured", function ()
+	svn.status (wc_path, nil, {verbose = true, structured = true})
+end, math.ceil (n / 10))
+
+-- history of a file: log and a cat per revision, against file_revisions
+history_file = wc_path.."/history.txt"
+for i = 1, 50 do
+	local f = io.open (history_file, "a")
+	f:write (string.rep ("revision "..i.."\n", 100))
+	f:close ()
+	if i == 1 then
+		svn.add (history_file)
+	end
+	svn.commit (history_file, "history "..i)
+end
+history_url = repo_url.."/history.txt"
+
+bench ("log and cat of 50 revisions", function ()
+	for rev in pairs (svn.log (history_url)) do
+		svn.cat (history_url, rev)
+	end
+end, math.ceil (n / 50))
+
+bench ("file_revisions of 50 revisions", function ()
+	svn.file_revisions (history_url, nil, nil, function () end)
+end, math.ceil (n / 50))
+
+-- log of revisions with large messages: every revprop against the author only
+message = string.rep ("generated log line\n", 50000)
+for i = 1, 20 do
+	local f = io.open (history_file, "a")
+	f:write ("large message "..i.."\n")
+	f:close ()
+	svn.commit (history_file, message)
+end
+
+bench ("log of 20 revisions with 1MB messages", function ()
+	svn.log (history_url)
+end, math.ceil (n / 50))
+
+bench ("log of 20 revisions, author only", function ()
+	svn.log (history_url, nil, nil, nil, {revprops = {"svn:author"}})
+end, math.ceil (n / 50))
+
+-- table of tables against parallel arrays
+bench ("log of the repository, tables", function ()
+	svn.log (repo_url)
+end, math.ceil (n / 10))
+
+bench ("log of the repository, columnar", function ()
+	svn.log (repo_url, nil, nil, nil, {columnar = true})
+end, math.ceil (n / 10))
+
+bench ("list of the repository, tables", function ()
+	svn.list (repo_url)
+end, math.ceil (n / 10))
+
+bench ("list of the repository, columnar", function ()
+	svn.list (repo_url, nil, {columnar = true})
+end, math.ceil (n / 10))
+
+bench ("list of the repository, kind only", function ()
+	svn.list (repo_url, nil, {fields = {"kind"}})
+end, math.ceil (n / 10))
+
+-- the same directory listed again: from the repository or from the cache
+bench ("list of the repository, no cache", function ()
+	svn.list (repo_url, nil, {recursive = true})
+end, math.ceil (n / 10))
+
+svn.list_cache ({max_bytes = 16 * 1024 * 1024, head_ttl = 60})
+bench ("list of the repository, cached", function ()
+	svn.list (repo_url, nil, {recursive = true})
+end, math.ceil (n / 10))
+svn.list_cache ({reset = true, max_bytes = 0, head_ttl = 0})
+
+memory ("log of the repository, tables", function ()
+	return svn.log (repo_url, nil, nil, nil, {revprops = {"author", "date"}})
+end)
+
+memory ("log of the repository, columnar", function ()
+	return svn.log (repo_url, nil, nil, nil, {revprops = {"author", "date"}, columnar = true})
+end)
+
+memory ("list of the repository, tables", function ()
+	return svn.list (repo_url)
+end)
+
+memory ("list of the repository, columnar", function ()
+	return svn.list (repo_url, nil, {columnar = true})
+end)
+
+-- recursive listing: one connection against a walk on several threads.
+-- A local repository answers faster than the threads can share the work,
+-- so this shows their overhead rather than the time they save on a
+-- remote server
+bench ("recursive list_iter of the repository", function ()
+	for name in svn.list_iter (repo_url, nil, {recursive = true}) do end
+end, math.ceil (n / 10))
+
+for _, threads in ipairs {1, 4} do
+	bench ("walk of the repository, "..threads.." threads", function ()
+		for name in svn.walk (repo_url, nil, {threads = threads}) do end
+	end, math.ceil (n / 10))
+end
+
+-- several working copies: one after the other, or on a pool of threads
+wc_paths = {}
+for i = 1, 4 do
+	wc_paths[i] = wc_path.."_"..i
+	svn.checkout (repo_url, wc_paths[i])
+end
+
+bench ("status of 4 working copies in a loop", function ()
+	for _, path in ipairs (wc_paths) do
+		svn.status (path, nil, {verbose = true})
+	end
+end, math.ceil (n / 50))
+
+bench ("status_all of 4 working copies", function ()
+	svn.status_all (wc_paths, nil, {verbose = true})
+end, math.ceil (n / 50))
+
+for _, path in ipairs (wc_paths) do
+	os.execute ("rm -rf "..path)
+end
+
+-- diff of the repository: through a file read back, or kept in memory
+bench ("diff to a file, then read it", function ()
+	svn.diff (repo_url, 1, nil, nil, "bench_output.diff")
+	local f = io.open ("bench_output.diff", "rb")
+	f:read ("*a")
+	f:close ()
+	os.remove ("bench_output.diff")
+end, math.ceil (n / 50))
+
+bench ("diff as a string", function ()
+	svn.diff (repo_url, 1, nil, nil, nil, nil, {as_string = true})
+end, math.ceil (n / 50))
+
+bench ("diff_summary of the repository", function ()
+	svn.diff_summary (repo_url, 1)
+end, math.ceil (n / 50))
+
+svn.repos_delete (repo_path)
+os.execute ("rm -rf "..wc_path)
@@ -2,6 +2,7 @@
 #include <svn_pools.h>
 #include <svn_error.h>
 #include <svn_client.h>
+#include <svn_ra.h>
 #include <svn_dso.h>
 #include <svn_path.h>
 #include <svn_config.h>
@@ -9,8 +10,24 @@
 #include <svn_subst.h>
 #include <svn_time.h>
 #include <svn_utf.h>
+#include <svn_version.h>
+#include <svn_md5.h>
+#include <svn_sorts.h>
 
 #include <apr_xlate.h>
+#include <apr_md5.h>
+#include <apr_portable.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+#include <apr_thread_proc.h>
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define HAVE_INOTIFY 1
+#endif
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -47,1636 +64,8407 @@ send_error (lua_State *L, const char *message) {
 }
 
 
-/* Initializes the memory pool */
-static int
-init_pool (apr_pool_t **pool) {
-	
-	if (apr_initialize () != APR_SUCCESS) {
-		return 1;
-	}
-
-	svn_dso_initialize ();
+#define LIBRARY_MT "svn.library"
 
-    *pool = svn_pool_create (NULL);
 
-	return 0;
-}
+/* Parent of every pool of the module, shared by all the Lua states
+   that loaded it, and the number of those states */
+static apr_pool_t *root_pool = NULL;
+static int root_refs = 0;
 
 
-/* Indicates that an error occurred during the pool initialization */
-static int
-init_pool_error (lua_State *L) {
-	return send_error (L, "Error initializing the memory pool\n");
-}
+/* Guards root_pool and root_refs, for Lua states loading the module from
+   different threads. This can not be an APR mutex, since APR is not
+   initialized yet. Without pthreads, only one thread at a time may load
+   the module or close a Lua state that loaded it */
+#if APR_HAS_THREADS && !defined(WIN32)
+#include <pthread.h>
+static pthread_mutex_t root_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define ROOT_LOCK() pthread_mutex_lock (&root_mutex)
+#define ROOT_UNLOCK() pthread_mutex_unlock (&root_mutex)
+#else
+#define ROOT_LOCK()
+#define ROOT_UNLOCK()
+#endif
 
 
-static int
-init_function (svn_client_ctx_t **ctx, apr_pool_t **pool, lua_State *L) {
+/* Initializes APR, svn and the RA layer, and creates the root pool.
+   This is done only once per process. Returns an error message, or NULL */
+static const char *
+init_root (void) {
 	apr_allocator_t *allocator;
-	svn_auth_baton_t *ab;
-	svn_config_t *cfg;
 	svn_error_t *err;
+#if APR_HAS_THREADS
+	apr_thread_mutex_t *mutex;
+#endif
+
+	if (root_pool != NULL) {
+		root_refs++;
+		return NULL;
+	}
 
 	if (svn_cmdline_init("svn", NULL) != EXIT_SUCCESS) {
-		return send_error (L, "Error initializing svn\n");
+		return "Error initializing svn\n";
 	}
-	
+
+	svn_dso_initialize ();
+
 	if (apr_allocator_create(&allocator)) {
-		return send_error (L, "Error creating allocator\n");
+		return "Error creating allocator\n";
 	}
 
 	apr_allocator_max_free_set(allocator, SVN_ALLOCATOR_RECOMMENDED_MAX_FREE);
 
-  	*pool = svn_pool_create_ex(NULL, allocator);
-	apr_allocator_owner_set(allocator, *pool);
+	root_pool = svn_pool_create_ex(NULL, allocator);
+	apr_allocator_owner_set(allocator, root_pool);
 
-  	err = svn_ra_initialize(*pool);
-	IF_ERROR_RETURN (err, *pool, L);
+#if APR_HAS_THREADS
+	/* pools of different Lua states or threads are created from it */
+	if (apr_thread_mutex_create (&mutex, APR_THREAD_MUTEX_DEFAULT, root_pool) == APR_SUCCESS) {
+		apr_allocator_mutex_set (allocator, mutex);
+	}
+#endif
 
-	err = svn_client_create_context (ctx, *pool);
-	IF_ERROR_RETURN (err, *pool, L);
+	err = svn_ra_initialize(root_pool);
+	if (err) {
+		svn_error_clear (err);
+		svn_pool_destroy (root_pool);
+		root_pool = NULL;
+		return "Error initializing the RA layer\n";
+	}
 
-	err = svn_config_get_config(&((*ctx)->config),	NULL, *pool);
-	IF_ERROR_RETURN (err, *pool, L);
+	root_refs = 1;
 
-	cfg = apr_hash_get((*ctx)->config, SVN_CONFIG_CATEGORY_CONFIG,
-			APR_HASH_KEY_STRING);
+	return NULL;
+}
 
-	err = svn_cmdline_setup_auth_baton(&ab,
-			FALSE,
-			NULL,
-			NULL,
-			NULL,
-			FALSE,
-			cfg,
-			(*ctx)->cancel_func,
-			(*ctx)->cancel_baton,
-			*pool);
-	IF_ERROR_RETURN (err, *pool, L);
 
-	(*ctx)->auth_baton = ab;
+static int
+init_library (lua_State *L) {
+	const char *message;
+
+	ROOT_LOCK ();
+	message = init_root ();
+	ROOT_UNLOCK ();
+
+	if (message != NULL) {
+		return send_error (L, message);
+	}
 
 	return 0;
 }
 
 
-struct log_msg_baton
-{
-  const char *editor_cmd;  /* editor specified via --editor-cmd, else NULL */
-  const char *message;  /* the message. */
-  const char *message_encoding; /* the locale/encoding of the message. */
-  const char *base_dir; /* the base directory for an external edit. UTF-8! */
-  const char *tmpfile_left; /* the tmpfile left by an external edit. UTF-8! */
-  svn_boolean_t non_interactive; /* if true, don't pop up an editor */
-  apr_hash_t *config; /* client configuration hash */
-  svn_boolean_t keep_locks; /* Keep repository locks? */
-  apr_pool_t *pool; /* a pool. */
-  lua_State *L;
-};
-
+/* Keeps the root pool alive for a thread that may outlive the Lua state */
+static void
+root_retain (void) {
+	ROOT_LOCK ();
+	root_refs++;
+	ROOT_UNLOCK ();
+}
 
-svn_error_t *
-make_log_msg_baton(void **baton,
-		const char *message,
-		const char *base_dir /* UTF-8! */,
-		apr_hash_t *config,
-		apr_pool_t *pool,
-		lua_State *L)
-{
-  struct log_msg_baton *lmb = apr_palloc(pool, sizeof(*lmb));
 
-  lmb->message = message;
+/* Releases the root pool when its last user is gone */
+static void
+root_release (void) {
+	ROOT_LOCK ();
 
-  lmb->editor_cmd = NULL;;
-  
-  if (config)
-  {
- 	  svn_config_t *cfg = apr_hash_get(config, SVN_CONFIG_CATEGORY_CONFIG, 
-                                       APR_HASH_KEY_STRING);
-      svn_config_get(cfg, &(lmb->message_encoding),
-                     SVN_CONFIG_SECTION_MISCELLANY,
-                     SVN_CONFIG_OPTION_LOG_ENCODING,
-                     NULL);
-  } else 
-  {
-	  lmb->message_encoding = APR_LOCALE_CHARSET;
-  }
+	if (root_pool != NULL && --root_refs == 0) {
+		svn_pool_destroy (root_pool);
+		root_pool = NULL;
+	}
 
-  lmb->base_dir = base_dir ? base_dir : "";
-  lmb->tmpfile_left = NULL;
-  lmb->config = config;
-  lmb->keep_locks = FALSE;
-  lmb->non_interactive = TRUE;
-  lmb->pool = pool;
-  lmb->L = L;
-  *baton = lmb;
-  return SVN_NO_ERROR;
+	ROOT_UNLOCK ();
 }
 
-static svn_error_t *
-log_msg_func2 (const char **log_msg,
-		       const char **tmp_file,
-			   const apr_array_header_t *commit_items,
-			   void *baton,
-			   apr_pool_t *pool)
-{
-	struct log_msg_baton *lmb = baton;
-
-	svn_error_t *err = svn_utf_cstring_to_utf8 (log_msg, lmb->message, pool);
-	
-	if (err) {     
-	  return err;
-	} 
 
-	*tmp_file = NULL;
+/* Releases the root pool when the last Lua state using it is closed */
+static int
+library_gc (lua_State *L) {
+	root_release ();
 
-	return SVN_NO_ERROR;
+	return 0;
 }
 
 
-static enum svn_opt_revision_kind
-get_revision_kind (const char *path) {
-	if (svn_path_is_url (path))
-		return svn_opt_revision_head;
-	return svn_opt_revision_base;
+/* An entry of a lru_t, allocated with malloc */
+typedef struct lru_entry_t {
+	char *key;
+	char *data;
+	apr_size_t len;
+	struct lru_entry_t *prev;
+	struct lru_entry_t *next;
+} lru_entry_t;
+
+
+/* A cache of byte strings keyed by C strings. The least recently used
+   entries are evicted when the cache grows past its limits, and written
+   to SPILL_DIR, if there is one */
+typedef struct lru_t {
+	apr_hash_t *index;
+	lru_entry_t *head; /* most recently used */
+	lru_entry_t *tail;
+	apr_size_t bytes;
+	apr_size_t max_bytes; /* 0 disables the cache */
+	int entries;
+	int max_entries; /* 0 for no limit */
+	const char *spill_dir;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long spill_hits;
+} lru_t;
+
+
+/* Name of the file in which the entry KEY of LRU is spilled */
+static const char *
+lru_spill_path (lru_t *lru, const char *key, apr_pool_t *pool) {
+	unsigned char digest[APR_MD5_DIGESTSIZE];
+
+	apr_md5 (digest, key, strlen (key));
+
+	return svn_path_join (lru->spill_dir,
+			svn_md5_digest_to_cstring_display (digest, pool), pool);
 }
 
 
-static int
-l_add (lua_State *L) {
-	apr_pool_t *pool;
+/* Writes an entry to the spill directory of LRU. Since the cached data
+   never changes, an existing file is kept */
+static void
+lru_spill (lru_t *lru, const char *key, const char *data, apr_size_t len,
+           apr_pool_t *pool) {
+	const char *path;
+	const char *tmp_path;
+	apr_file_t *file;
+	svn_node_kind_t kind;
 	svn_error_t *err;
-	svn_client_ctx_t *ctx;
-	
-	const char *path = luaL_checkstring (L, 1);
-	int itable = 2;
-	svn_boolean_t recursive = TRUE;
-	svn_boolean_t force = FALSE;
-	svn_boolean_t no_ignore = FALSE;
 
-	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
-		lua_getfield (L, itable, "recursive");
-		if (lua_isboolean (L, -1)) {
-			recursive = lua_toboolean (L, -1);
+	if (lru->spill_dir == NULL) {
+		return;
+	}
+
+	path = lru_spill_path (lru, key, pool);
+
+	err = svn_io_check_path (path, &kind, pool);
+	if (err || kind != svn_node_none) {
+		svn_error_clear (err);
+		return;
+	}
+
+	/* written to a temporary file first, so readers never see it partially */
+	err = svn_io_open_unique_file2 (&file, &tmp_path, path, ".tmp",
+			svn_io_file_del_none, pool);
+
+	if (!err) {
+		err = svn_io_file_write_full (file, data, len, NULL, pool);
+
+		if (!err) {
+			err = svn_io_file_close (file, pool);
+		} else {
+			svn_error_clear (svn_io_file_close (file, pool));
 		}
 
-		lua_getfield (L, itable, "force");
-		if (lua_isboolean (L, -1)) {
-			force = lua_toboolean (L, -1);
+		if (!err) {
+			err = svn_io_file_rename (tmp_path, path, pool);
 		}
-	
-		lua_getfield (L, itable, "no_ignore");
-		if (lua_isboolean (L, -1)) {
-			no_ignore = lua_toboolean (L, -1);
+
+		if (err) {
+			svn_error_clear (svn_io_remove_file (tmp_path, pool));
 		}
-	} 
+	}
 
-	init_function (&ctx, &pool, L);
+	svn_error_clear (err);
+}
 
-	path = svn_path_canonicalize (path, pool);
 
-	err = svn_client_add3 (path, recursive, force, no_ignore, ctx, pool);
-	IF_ERROR_RETURN (err, pool, L);
+static void
+lru_unlink (lru_t *lru, lru_entry_t *entry) {
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		lru->head = entry->next;
+	}
 
-	svn_pool_destroy (pool);
-	
-	return 0;
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		lru->tail = entry->prev;
+	}
 }
 
 
-static svn_error_t *
-write_fn (void *baton, const char *data, apr_size_t *len) {
+static void
+lru_link (lru_t *lru, lru_entry_t *entry) {
+	entry->prev = NULL;
+	entry->next = lru->head;
 
-	svn_stringbuf_appendbytes (baton, data, *len);
+	if (lru->head) {
+		lru->head->prev = entry;
+	} else {
+		lru->tail = entry;
+	}
 
-	return SVN_NO_ERROR;
+	lru->head = entry;
 }
 
 
-static int
-l_cat (lua_State *L) {
-	apr_pool_t *pool;
-	svn_error_t *err;
-	svn_client_ctx_t *ctx;
-	
-	svn_stream_t *stream;
-	svn_stringbuf_t *buffer;
-	svn_opt_revision_t peg_revision;
-	svn_opt_revision_t revision;
+/* Removes ENTRY from LRU, spilling it when SPILL is set */
+static void
+lru_evict (lru_t *lru, lru_entry_t *entry, svn_boolean_t spill, apr_pool_t *pool) {
+	if (spill) {
+		lru_spill (lru, entry->key, entry->data, entry->len, pool);
+	}
 
-	const char *path = luaL_checkstring (L, 1);
-	peg_revision.kind = svn_opt_revision_unspecified;
+	lru_unlink (lru, entry);
+	apr_hash_set (lru->index, entry->key, APR_HASH_KEY_STRING, NULL);
 
-	if (lua_gettop (L) < 2 || lua_isnil (L, 2)) {
-		revision.kind = get_revision_kind (path);
-	} else {
-		revision.kind = svn_opt_revision_number;
-		revision.value.number = lua_tointeger (L, 2);
+	lru->bytes -= entry->len;
+	lru->entries--;
+
+	free (entry->key);
+	free (entry->data);
+	free (entry);
+}
+
+
+/* Evicts entries until LRU has room for LEN more bytes in ENTRIES more entries */
+static void
+lru_trim (lru_t *lru, apr_size_t len, int entries, apr_pool_t *pool) {
+	while (lru->tail != NULL
+			&& (lru->bytes + len > lru->max_bytes
+				|| (lru->max_entries > 0 && lru->entries + entries > lru->max_entries))) {
+		lru_evict (lru, lru->tail, TRUE, pool);
+	}
+}
+
+
+/* Stores a copy of DATA in LRU. Data that does not fit in the cache
+   goes straight to the spill directory */
+static void
+lru_put (lru_t *lru, const char *key, const char *data, apr_size_t len,
+         apr_pool_t *pool) {
+	lru_entry_t *entry;
+
+	if (lru->max_bytes == 0) {
+		return;
 	}
 
-	init_function (&ctx, &pool, L);
+	entry = apr_hash_get (lru->index, key, APR_HASH_KEY_STRING);
+	if (entry != NULL) {
+		lru_evict (lru, entry, FALSE, pool);
+	}
 
-	path = svn_path_canonicalize (path, pool);
+	if (len > lru->max_bytes) {
+		lru_spill (lru, key, data, len, pool);
+		return;
+	}
 
-	stream = svn_stream_empty (pool);
-	svn_stream_set_write (stream, write_fn);
+	lru_trim (lru, len, 1, pool);
 
-	buffer = svn_stringbuf_create ("\0", pool);
+	entry = malloc (sizeof (lru_entry_t));
+	if (entry == NULL) {
+		return;
+	}
 
-	svn_stream_set_baton (stream, buffer);
+	entry->key = strdup (key);
+	entry->data = malloc (len + 1);
 
-	err = svn_client_cat2 (stream, path, &peg_revision, &revision, ctx, pool);
-	IF_ERROR_RETURN (err, pool, L);
+	if (entry->key == NULL || entry->data == NULL) {
+		free (entry->key);
+		free (entry->data);
+		free (entry);
+		return;
+	}
 
-	lua_pushstring (L, buffer->data);
+	memcpy (entry->data, data, len);
+	entry->data[len] = '\0';
+	entry->len = len;
 
-	svn_pool_destroy (pool);
+	lru_link (lru, entry);
+	apr_hash_set (lru->index, entry->key, APR_HASH_KEY_STRING, entry);
 
-	return 1;
+	lru->bytes += len;
+	lru->entries++;
 }
 
 
-static int
-l_checkout (lua_State *L) {
-	apr_pool_t *pool;
+/* Looks KEY up in LRU, and then in its spill directory. The data returned
+   is valid until the next change of LRU or until POOL is destroyed */
+static svn_boolean_t
+lru_get (lru_t *lru, const char *key, const char **data, apr_size_t *len,
+         apr_pool_t *pool) {
+	lru_entry_t *entry;
+	svn_stringbuf_t *buffer;
 	svn_error_t *err;
-	svn_client_ctx_t *ctx;
 
-	svn_opt_revision_t revision;
-	svn_opt_revision_t peg_revision;
-	svn_revnum_t rev;
+	entry = apr_hash_get (lru->index, key, APR_HASH_KEY_STRING);
 
-	const char *path = luaL_checkstring (L, 1);
-	const char *dir = luaL_checkstring (L, 2);
-	int itable = 4;
-	svn_boolean_t recursive = TRUE;
-	svn_boolean_t ignore_externals = FALSE;
-	peg_revision.kind = svn_opt_revision_unspecified;
+	if (entry != NULL) {
+		lru_unlink (lru, entry);
+		lru_link (lru, entry);
 
-	if (lua_gettop (L) < 3 || lua_isnil (L, 3)) {
-		revision.kind = svn_opt_revision_head;	
-	} else {
-		revision.kind = svn_opt_revision_number;
-		revision.value.number = lua_tointeger (L, 3);
+		*data = entry->data;
+		*len = entry->len;
+
+		lru->hits++;
+		return TRUE;
 	}
-	
-	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
-		lua_getfield (L, itable, "recursive");
-		if (lua_isboolean (L, -1)) {
-			recursive = lua_toboolean (L, -1);
-		}
 
-		lua_getfield (L, itable, "ignore_externals");
-		if (lua_isboolean (L, -1)) {
-			ignore_externals = lua_toboolean (L, -1);
-		}
-	} 
+	if (lru->spill_dir != NULL) {
+		err = svn_stringbuf_from_file (&buffer, lru_spill_path (lru, key, pool), pool);
 
-	init_function (&ctx, &pool, L);
+		if (!err) {
+			*data = buffer->data;
+			*len = buffer->len;
 
-	path = svn_path_canonicalize (path, pool);
-	dir = svn_path_canonicalize (dir, pool);
-	
-	err = svn_client_checkout2 (&rev, path, dir, &peg_revision, &revision, recursive, ignore_externals, ctx, pool);
-	IF_ERROR_RETURN (err, pool, L);
-	
-	lua_pushinteger (L, rev);
+			lru_put (lru, key, buffer->data, buffer->len, pool);
 
-	svn_pool_destroy (pool);
+			lru->hits++;
+			lru->spill_hits++;
+			return TRUE;
+		}
 
-	return 1;
+		svn_error_clear (err);
+	}
+
+	lru->misses++;
+	return FALSE;
 }
 
 
-static int
-l_cleanup (lua_State *L) {
-	apr_pool_t *pool;
-	svn_error_t *err;
-	svn_client_ctx_t *ctx;
+/* Frees all the entries of LRU, without spilling them */
+static apr_status_t
+lru_cleanup (void *data) {
+	lru_t *lru = data;
 
-	const char *path = (lua_gettop (L) < 1 || lua_isnil (L, 1)) ? "" : luaL_checkstring (L, 1);
+	while (lru->head != NULL) {
+		lru_entry_t *entry = lru->head;
 
-	init_function (&ctx, &pool, L);
-	
-	path = svn_path_canonicalize (path, pool);
+		lru->head = entry->next;
 
-	err = svn_client_cleanup (path, ctx, pool);
-	IF_ERROR_RETURN (err, pool, L);
-	
-	svn_pool_destroy (pool);
+		free (entry->key);
+		free (entry->data);
+		free (entry);
+	}
 
-	return 0;
-}
+	lru->tail = NULL;
+	lru->bytes = 0;
+	lru->entries = 0;
 
+	return APR_SUCCESS;
+}
 
-static int
-l_commit (lua_State *L) {
-	apr_pool_t *pool;
-	svn_error_t *err;
-	svn_client_ctx_t *ctx;
 
-	apr_array_header_t *array;
+/* Configures LRU from the table at index ITABLE, and pushes a table
+   with its statistics */
+static void
+lru_config (lru_t *lru, int itable, lua_State *L, apr_pool_t *pool) {
 
-	const char *path = (lua_gettop (L) < 1 || lua_isnil (L, 1)) ? "" : luaL_checkstring (L, 1);
-	const char *message = (lua_gettop (L) < 2 || lua_isnil (L, 2)) ? "" : luaL_checkstring (L, 2);
-	int itable = 3;
-	svn_boolean_t recursive = TRUE;
-	svn_boolean_t keep_locks = FALSE;
-	svn_commit_info_t *commit_info = NULL;
-	
-	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
-		lua_getfield (L, itable, "recursive");
-		if (lua_isboolean (L, -1)) {
-			recursive = lua_toboolean (L, -1);
+	if (lua_istable (L, itable)) {
+		lua_getfield (L, itable, "max_bytes");
+		if (lua_isnumber (L, -1)) {
+			lru->max_bytes = (apr_size_t) lua_tonumber (L, -1);
 		}
 
-		lua_getfield (L, itable, "keep_locks");
-		if (lua_isboolean (L, -1)) {
-			keep_locks = lua_toboolean (L, -1);
+		lua_getfield (L, itable, "max_entries");
+		if (lua_isnumber (L, -1)) {
+			lru->max_entries = lua_tointeger (L, -1);
 		}
-	} 
 
-	init_function (&ctx, &pool, L);
+		lua_getfield (L, itable, "spill_dir");
+		if (lua_isstring (L, -1)) {
+			lru->spill_dir = apr_pstrdup (apr_hash_pool_get (lru->index),
+					svn_path_canonicalize (lua_tostring (L, -1), pool));
+			svn_error_clear (svn_io_make_dir_recursively (lru->spill_dir, pool));
+		} else if (lua_isboolean (L, -1) && !lua_toboolean (L, -1)) {
+			lru->spill_dir = NULL;
+		}
 
-	path = svn_path_canonicalize (path, pool);
+		lua_getfield (L, itable, "reset");
+		if (lua_toboolean (L, -1)) {
+			while (lru->tail != NULL) {
+				lru_evict (lru, lru->tail, FALSE, pool);
+			}
+			lru->hits = lru->misses = lru->spill_hits = 0;
+		}
 
-	array = apr_array_make (pool, 1, sizeof (const char *));
-	(*((const char **) apr_array_push (array))) = path;
+		lua_pop (L, 4);
 
-	make_log_msg_baton (&(ctx->log_msg_baton2), message, path, ctx->config, pool, L);
-	
-	ctx->log_msg_func2 = log_msg_func2;
+		lru_trim (lru, 0, 0, pool);
+	}
 
-	err = svn_client_commit3 (&commit_info, array, recursive, keep_locks, ctx, pool);
-	IF_ERROR_RETURN (err, pool, L);	
+	lua_newtable (L);
 
-	if (commit_info == NULL) {
-		lua_pushnil (L);
-	} else {
-		lua_pushinteger (L, commit_info->revision);
-	}
+	lua_pushnumber (L, lru->hits);
+	lua_setfield (L, -2, "hits");
 
-	svn_pool_destroy (pool);
+	lua_pushnumber (L, lru->misses);
+	lua_setfield (L, -2, "misses");
 
-	return 1;
-}
+	lua_pushnumber (L, lru->spill_hits);
+	lua_setfield (L, -2, "spill_hits");
 
+	lua_pushnumber (L, lru->bytes);
+	lua_setfield (L, -2, "bytes");
 
-static int
-l_copy (lua_State *L) {
-	apr_pool_t *pool;
-	svn_error_t *err;
-	svn_client_ctx_t *ctx;
+	lua_pushinteger (L, lru->entries);
+	lua_setfield (L, -2, "entries");
 
-	svn_opt_revision_t revision;
+	lua_pushnumber (L, lru->max_bytes);
+	lua_setfield (L, -2, "max_bytes");
 
-	const char *src_path = luaL_checkstring (L, 1);
-	const char *dest_path = luaL_checkstring (L, 2);
-	const char *message = NULL;
-	svn_commit_info_t *commit_info = NULL;
+	lua_pushinteger (L, lru->max_entries);
+	lua_setfield (L, -2, "max_entries");
 
-	if (lua_gettop (L) < 3 || lua_isnil (L, 3)) {
-		revision.kind = svn_opt_revision_unspecified;
-	} else {
-		revision.kind = svn_opt_revision_number;
-		revision.value.number = lua_tointeger (L, 3);
+	if (lru->spill_dir) {
+		lua_pushstring (L, lru->spill_dir);
+		lua_setfield (L, -2, "spill_dir");
 	}
+}
 
-	message = (lua_gettop (L) < 4 || lua_isnil (L, 4)) ? "" : luaL_checkstring (L, 4);
 
-	init_function (&ctx, &pool, L);
+#define SESSION_MT "svn.session"
+#define SESSION_DEFAULT "svn.default_session"
+#define SESSION_CURRENT "svn.current_session"
+#define SESSION_ALL "svn.sessions"
+#define SESSION_WORKERS_MAX 8
 
-	src_path = svn_path_canonicalize (src_path, pool);
-	dest_path = svn_path_canonicalize (dest_path, pool);
+#define RA_POOL_MAX 4
+#define RA_POOL_IDLE 60
+#define RA_HEAD_TTL 5
+#define RA_LOCATIONS_MAX 1024
 
-	if (svn_path_is_url (dest_path)) {
-		make_log_msg_baton (&(ctx->log_msg_baton2), message, NULL, ctx->config, pool, L);
-		ctx->log_msg_func2 = log_msg_func2;
-	}
 
-	err = svn_client_copy3 (&commit_info, src_path, &revision, dest_path, ctx, pool);
-	IF_ERROR_RETURN (err, pool, L);	
+/* Client state shared by every call made through a session */
+typedef struct session_t {
+	apr_pool_t *pool;
+	svn_client_ctx_t *ctx;
+	const char *config_dir;
+	const char *username;
+	const char *password;
+	svn_boolean_t non_interactive;
+	svn_boolean_t no_auth_cache;
+	apr_hash_t *ra_pool; /* repository root -> list of idle ra_conn_t */
+	apr_hash_t *ra_roots; /* repository roots seen, used as keys of ra_pool */
+	int ra_max; /* idle connections kept per repository root */
+	apr_interval_time_t ra_idle; /* idle time after which a connection is closed */
+	apr_hash_t *ra_heads; /* repository root -> ra_head_t */
+	apr_interval_time_t head_ttl; /* age of HEAD after which URLs are traced from a new one */
+	apr_pool_t *ra_locations_pool;
+	apr_hash_t *ra_locations; /* peg, revision and URL -> location, see ra_locate */
+	lru_t cat_cache; /* contents of files at numeric revisions */
+	lru_t list_cache; /* listings of directories at numeric revisions */
+	apr_interval_time_t list_head_ttl; /* 0 to resolve HEAD on every list */
+	const char *log_cache_dir; /* NULL when the log cache is disabled */
+	apr_pool_t *log_cache_pool;
+	apr_hash_t *log_caches; /* URL -> log_cache_t */
+	unsigned long log_hits; /* log entries read from the cache */
+	unsigned long log_fetched; /* log entries fetched into the cache */
+	struct session_t *workers; /* idle worker sessions, see session_take_worker */
+	int idle_workers;
+	struct session_t *next; /* next idle worker session */
+} session_t;
+
+
+/* An open RA session, owned by the pool of connections of a session_t */
+typedef struct ra_conn_t {
+	apr_pool_t *pool;
+	svn_ra_session_t *ra;
+	const char *root;
+	apr_time_t last_used;
+	struct ra_conn_t *next;
+} ra_conn_t;
 
-	if (commit_info == NULL) {
-		lua_pushnil (L);
-	} else {
-		lua_pushinteger (L, commit_info->revision);
-	}
 
-	svn_pool_destroy (pool);
+/* Creates a client context, reading the configuration and
+   building the auth baton according to the options of SESSION */
+static svn_error_t *
+create_context (svn_client_ctx_t **ctx, session_t *session, apr_pool_t *pool) {
+	svn_auth_baton_t *ab;
+	svn_config_t *cfg;
 
-	return 1;
-}
+	SVN_ERR (svn_client_create_context (ctx, pool));
 
+	SVN_ERR (svn_config_get_config (&((*ctx)->config), session->config_dir, pool));
 
-static int
-l_delete (lua_State *L) {
-	apr_pool_t *pool;
-	svn_error_t *err;
-	svn_client_ctx_t *ctx;
+	cfg = apr_hash_get((*ctx)->config, SVN_CONFIG_CATEGORY_CONFIG,
+			APR_HASH_KEY_STRING);
 
-	apr_array_header_t *array;
-	
-	const char *path = luaL_checkstring (L, 1);
-	const char *message = (lua_gettop (L) < 2 || lua_isnil (L, 2)) ? "" : luaL_checkstring (L, 2);
-	int itable = 3;
-	svn_boolean_t force = FALSE;
-	svn_commit_info_t *commit_info = NULL;
+	SVN_ERR (svn_cmdline_setup_auth_baton(&ab,
+			session->non_interactive,
+			session->username,
+			session->password,
+			session->config_dir,
+			session->no_auth_cache,
+			cfg,
+			(*ctx)->cancel_func,
+			(*ctx)->cancel_baton,
+			pool));
 
-	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
-		lua_getfield (L, itable, "force");
-		if (lua_isboolean (L, -1)) {
-			force = lua_toboolean (L, -1);
-		}
-	} 
+	(*ctx)->auth_baton = ab;
 
-	init_function (&ctx, &pool, L);
+	return SVN_NO_ERROR;
+}
 
-	path = svn_path_canonicalize (path, pool);
 
-	array = apr_array_make (pool, 1, sizeof (const char *));
-	(*((const char **) apr_array_push (array))) = path;
+/* Copies to COPY the options SESSION was opened with, allocating them
+   in POOL, so that COPY can build its own context */
+static void
+session_copy_options (session_t *copy, const session_t *session, apr_pool_t *pool) {
+	copy->config_dir = session->config_dir ? apr_pstrdup (pool, session->config_dir) : NULL;
+	copy->username = session->username ? apr_pstrdup (pool, session->username) : NULL;
+	copy->password = session->password ? apr_pstrdup (pool, session->password) : NULL;
+	copy->non_interactive = session->non_interactive;
+	copy->no_auth_cache = session->no_auth_cache;
+	copy->ra_max = session->ra_max;
+	copy->ra_idle = session->ra_idle;
+	copy->head_ttl = session->head_ttl;
+}
 
-	lua_newtable (L);
 
-	if (svn_path_is_url (path)) {
-		make_log_msg_baton (&(ctx->log_msg_baton2), message, NULL, ctx->config, pool, L);
-		ctx->log_msg_func2 = log_msg_func2;
-	}
+/* Builds the client context, the pool of connections and the caches of
+   SESSION in POOL, which becomes the pool of the session. The options
+   must be set already */
+static svn_error_t *
+session_init (session_t *session, apr_pool_t *pool) {
+	SVN_ERR (create_context (&session->ctx, session, pool));
 
-	err = svn_client_delete2 (&commit_info, array, force, ctx, pool);
-	IF_ERROR_RETURN (err, pool, L);
+	session->ra_pool = apr_hash_make (pool);
+	session->ra_roots = apr_hash_make (pool);
+	session->ra_heads = apr_hash_make (pool);
+	session->ra_locations_pool = svn_pool_create (pool);
+	session->ra_locations = apr_hash_make (session->ra_locations_pool);
 
-	if (commit_info == NULL) {
-		lua_pushnil (L);
-	} else {
-		lua_pushinteger (L, commit_info->revision);
-	}
-	
-	svn_pool_destroy (pool);
+	session->cat_cache.index = apr_hash_make (pool);
+	apr_pool_cleanup_register (pool, &session->cat_cache, lru_cleanup,
+			apr_pool_cleanup_null);
 
-	return 1;
+	session->list_cache.index = apr_hash_make (pool);
+	apr_pool_cleanup_register (pool, &session->list_cache, lru_cleanup,
+			apr_pool_cleanup_null);
+
+	session->pool = pool;
+
+	return SVN_NO_ERROR;
 }
 
 
+/* Builds the pool and the client context of SESSION.
+   The options are read from the table at index ITABLE, if there is one */
 static int
-l_diff (lua_State *L) {
+open_session (session_t *session, int itable, lua_State *L) {
+	apr_allocator_t *allocator;
 	apr_pool_t *pool;
 	svn_error_t *err;
-	svn_client_ctx_t *ctx;
-
-	apr_file_t *aprout;
-	apr_file_t *aprerr;
-	apr_status_t status;
-	apr_array_header_t *array;
-	svn_opt_revision_t rev1;
-	svn_opt_revision_t rev2;
-
-	const char *path1 = NULL;
-	const char *path2 = NULL;
-	const char *outfile = NULL;	
-	const char *errfile = NULL;
-	int itable = 7;
-	svn_boolean_t recursive = TRUE;
-	svn_boolean_t ignore_ancestry = TRUE;
-	svn_boolean_t no_diff_deleted = FALSE;
-	svn_boolean_t force = FALSE;
-	
-	path1 = (lua_gettop (L) < 1 || lua_isnil (L, 1)) ? "" : luaL_checkstring (L, 1);
-		
-	if (lua_gettop (L) < 2 || lua_isnil (L, 2)) {
-		rev1.kind = get_revision_kind (path1);
-	} else {
-		rev1.kind = svn_opt_revision_number;
-		rev1.value.number = lua_tointeger (L, 2);
-	}
-	
-	path2 = (lua_gettop (L) < 3 || lua_isnil (L, 3)) ? path1 : luaL_checkstring (L, 3);
 
-	if (lua_gettop (L) < 4 || lua_isnil (L, 4)) {
-		if (svn_path_is_url (path2)) {
-			rev2.kind = svn_opt_revision_head;
-		} else {
-			rev2.kind = svn_opt_revision_working;
+	const char *config_dir = NULL;
+	const char *username = NULL;
+	const char *password = NULL;
+	int ra_max = RA_POOL_MAX;
+	int ra_idle = RA_POOL_IDLE;
+	lua_Number head_ttl = RA_HEAD_TTL;
+
+	if (itable && lua_istable (L, itable)) {
+		lua_getfield (L, itable, "config_dir");
+		if (lua_isstring (L, -1)) {
+			config_dir = lua_tostring (L, -1);
 		}
-	} else {
-		rev2.kind = svn_opt_revision_number;
-		rev2.value.number = lua_tointeger (L, 4);
-	}
 
-	outfile = (lua_gettop (L) < 5 || lua_isnil (L, 5)) ? NULL : luaL_checkstring (L, 5);
-	
-	errfile = (lua_gettop (L) < 6 || lua_isnil (L, 6)) ? NULL : luaL_checkstring (L, 6);
-	
-	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
-		lua_getfield (L, itable, "recursive");
-		if (lua_isboolean (L, -1)) {
-			recursive = lua_toboolean (L, -1);
+		lua_getfield (L, itable, "username");
+		if (lua_isstring (L, -1)) {
+			username = lua_tostring (L, -1);
 		}
 
-		lua_getfield (L, itable, "ignore_ancestry");
-		if (lua_isboolean (L, -1)) {
-			ignore_ancestry = lua_toboolean (L, -1);
+		lua_getfield (L, itable, "password");
+		if (lua_isstring (L, -1)) {
+			password = lua_tostring (L, -1);
 		}
-		
-		lua_getfield (L, itable, "no_diff_deleted");
+
+		lua_getfield (L, itable, "non_interactive");
 		if (lua_isboolean (L, -1)) {
-			no_diff_deleted = lua_toboolean (L, -1);
+			session->non_interactive = lua_toboolean (L, -1);
 		}
-		
-		lua_getfield (L, itable, "force");
+
+		lua_getfield (L, itable, "no_auth_cache");
 		if (lua_isboolean (L, -1)) {
-			force = lua_toboolean (L, -1);
+			session->no_auth_cache = lua_toboolean (L, -1);
 		}
-	} 
 
-	init_function (&ctx, &pool, L);
+		lua_getfield (L, itable, "ra_pool_max");
+		if (lua_isnumber (L, -1)) {
+			ra_max = lua_tointeger (L, -1);
+		}
 
-	path1 = svn_path_canonicalize (path1, pool);
-	path2 = svn_path_canonicalize (path2, pool);
+		lua_getfield (L, itable, "ra_pool_idle");
+		if (lua_isnumber (L, -1)) {
+			ra_idle = lua_tointeger (L, -1);
+		}
 
-	if (outfile) {
-		status = apr_file_open (&aprout, outfile, APR_READ | APR_WRITE | APR_CREATE,
-				                APR_OS_DEFAULT, pool);
-	} else {
-		status = apr_file_open_stdout(&aprout, pool);
-	}
-	if (status) {
-		IF_ERROR_RETURN (svn_error_wrap_apr(status, "Can't open output file"), pool, L);
+		lua_getfield (L, itable, "head_ttl");
+		if (lua_isnumber (L, -1)) {
+			head_ttl = lua_tonumber (L, -1);
+		}
 	}
 
-	if (errfile) {
-		status = apr_file_open (&aprerr, errfile, APR_READ | APR_WRITE | APR_CREATE,
-				                APR_OS_DEFAULT, pool);
-	} else {
-		status = apr_file_open_stderr(&aprerr, pool);
-	}
-	if (status) {
-		IF_ERROR_RETURN (svn_error_wrap_apr(status, "Can't open error file"), pool , L);
+	if (apr_allocator_create(&allocator)) {
+		return send_error (L, "Error creating allocator\n");
 	}
 
-	array = apr_array_make (pool, 0, sizeof (const char *));
+	apr_allocator_max_free_set(allocator, SVN_ALLOCATOR_RECOMMENDED_MAX_FREE);
 
-	err = svn_client_diff3 (array, path1, &rev1, path2, &rev2,
-			                recursive, ignore_ancestry, no_diff_deleted, force,
-							APR_LOCALE_CHARSET, aprout, aprerr,
-							ctx, pool);
-	IF_ERROR_RETURN (err, pool, L);	
+	pool = svn_pool_create_ex(root_pool, allocator);
+	apr_allocator_owner_set(allocator, pool);
 
-	svn_pool_destroy (pool);
+	session->config_dir = config_dir ? apr_pstrdup (pool, config_dir) : NULL;
+	session->username = username ? apr_pstrdup (pool, username) : NULL;
+	session->password = password ? apr_pstrdup (pool, password) : NULL;
+
+	session->ra_max = ra_max;
+	session->ra_idle = apr_time_from_sec (ra_idle);
+	session->head_ttl = (apr_interval_time_t) (head_ttl * APR_USEC_PER_SEC);
+
+	err = session_init (session, pool);
+	IF_ERROR_RETURN (err, pool, L);
 
 	return 0;
 }
 
 
-static int
-l_import (lua_State *L) {
-	apr_pool_t *pool;
-	svn_error_t *err;
-	svn_client_ctx_t *ctx;
-	
-	const char *path = lua_isnil (L, 1) ? "" : luaL_checkstring (L, 1);
-	const char *url = luaL_checkstring (L, 2);
-	const char *message = (lua_gettop (L) < 3 || lua_isnil (L, 3)) ? "" : luaL_checkstring (L, 3);
-	int itable = 4;
-	svn_boolean_t recursive = TRUE;
-	svn_boolean_t no_ignore = FALSE;
-	svn_commit_info_t *commit_info = NULL;
-	
-	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
-		lua_getfield (L, itable, "recursive");
-		if (lua_isboolean (L, -1)) {
-			recursive = lua_toboolean (L, -1);
-		}
-
-		lua_getfield (L, itable, "no_ignore");
-		if (lua_isboolean (L, -1)) {
-			no_ignore = lua_toboolean (L, -1);
-		}
-	} 
+/* Pushes a new session userdata, still without pool and context */
+static session_t *
+new_session (lua_State *L) {
+	session_t *session = lua_newuserdata (L, sizeof (session_t));
 
-	init_function (&ctx, &pool, L);
+	memset (session, 0, sizeof (session_t));
 
-	path = svn_path_canonicalize (path, pool);
-	url = svn_path_canonicalize (url, pool);
+	luaL_getmetatable (L, SESSION_MT);
+	lua_setmetatable (L, -2);
 
-	make_log_msg_baton (&(ctx->log_msg_baton2), message, NULL, ctx->config, pool, L);
-	ctx->log_msg_func2 = log_msg_func2;
+	lua_getfield (L, LUA_REGISTRYINDEX, SESSION_ALL);
+	lua_pushlightuserdata (L, session);
+	lua_pushvalue (L, -3);
+	lua_rawset (L, -3);
+	lua_pop (L, 1);
 
-	err = svn_client_import2 (&commit_info, path, url, !recursive, no_ignore, ctx, pool);
-	IF_ERROR_RETURN (err, pool, L);
+	return session;
+}
 
-	if (commit_info == NULL) {
-		lua_pushnil (L);
-	} else {
-		lua_pushinteger (L, commit_info->revision);
-	}
 
-	svn_pool_destroy (pool);
-	
-	return 1;
+/* Pushes the userdata of SESSION, which is still referenced somewhere,
+   for the objects that must keep it alive */
+static void
+push_session (lua_State *L, session_t *session) {
+	lua_getfield (L, LUA_REGISTRYINDEX, SESSION_ALL);
+	lua_pushlightuserdata (L, session);
+	lua_rawget (L, -2);
+	lua_remove (L, -2);
 }
 
 
-static svn_error_t *
-list_func (void *baton,
-		   const char *path,
-		   const svn_dirent_t *dirent,
-		   const svn_lock_t *lock,
-		   const char *abs_path,
-		   apr_pool_t *pool)
-{
-	lua_State *L = baton;
+/* Returns the session of the current call. That is the session a method
+   was called on, or the default session used by the module functions,
+   which is created on first use */
+static session_t *
+get_session (lua_State *L) {
+	session_t *session;
 
-	if (strcmp (path, "") == 0) {
-		if (dirent->kind == svn_node_file) {
-			path = svn_path_basename (abs_path, pool);
-		} else {
-			return SVN_NO_ERROR;
-		}
-	} 	
-	
-	lua_pushfstring (L, "%s%s", path, dirent->kind == svn_node_dir ? "/" : "");
-	
-	lua_newtable (L);
-	
-	if (dirent->kind == svn_node_file)
-		lua_pushinteger (L, dirent->size);
-	else
+	lua_getfield (L, LUA_REGISTRYINDEX, SESSION_CURRENT);
+	session = lua_touserdata (L, -1);
+	lua_pop (L, 1);
+
+	if (session != NULL) {
 		lua_pushnil (L);
+		lua_setfield (L, LUA_REGISTRYINDEX, SESSION_CURRENT);
+	} else {
+		lua_getfield (L, LUA_REGISTRYINDEX, SESSION_DEFAULT);
+		session = lua_touserdata (L, -1);
+		lua_pop (L, 1);
+
+		if (session == NULL) {
+			session = new_session (L);
+			open_session (session, 0, L);
+			lua_setfield (L, LUA_REGISTRYINDEX, SESSION_DEFAULT);
+		}
+	}
+
+	if (session->pool == NULL) {
+		send_error (L, "Session is closed\n");
+	}
 
-	lua_setfield (L, -2, "size");
+	return session;
+}
 
-	if (dirent->last_author)
-		lua_pushstring (L, dirent->last_author);
-	else
-		lua_pushnil (L);
 
-	lua_setfield (L, -2, "author");
-	
-	lua_pushinteger (L, dirent->created_rev);
-	lua_setfield (L, -2, "revision");
+/* Gets the client context of the current session and a pool for the call.
+   Returns the session. The context is a copy made in the pool of the call,
+   which shares the configuration and the auth baton of the session, so
+   the callbacks a call sets are not overwritten by the calls made from
+   its Lua callbacks */
+static session_t *
+init_function (svn_client_ctx_t **ctx, apr_pool_t **pool, lua_State *L) {
+	session_t *session = get_session (L);
 
-	lua_pushstring (L, svn_time_to_human_cstring (dirent->time, pool));
-	lua_setfield (L, -2, "date");
+	*pool = svn_pool_create (session->pool);
 
-	lua_settable (L, -3);
+	*ctx = apr_pmemdup (*pool, session->ctx, sizeof (svn_client_ctx_t));
+	(*ctx)->log_msg_func2 = NULL;
+	(*ctx)->log_msg_baton2 = NULL;
 
-	return SVN_NO_ERROR;
+	return session;
 }
 
-static int
-l_list (lua_State *L) {
-	apr_pool_t *pool;
-	svn_error_t *err;
-	svn_client_ctx_t *ctx;
 
-	svn_opt_revision_t revision;
-	svn_opt_revision_t peg_revision;
+#if APR_HAS_THREADS
 
-	const char *path = (lua_gettop (L) < 1 || lua_isnil (L, 1)) ? "" : luaL_checkstring (L, 1);
-	int itable = 3;
-	svn_boolean_t recursive = FALSE;
-	svn_boolean_t fetch_locks = FALSE;
-	peg_revision.kind = svn_opt_revision_unspecified;
+/* Takes an idle worker session of SESSION, or opens a new one with the
+   same options. A worker session has its own context and connections in
+   a pool that does not derive from the one of SESSION, so it can be used
+   by another thread, one at a time, and outlive SESSION. Worker sessions
+   are only taken and given back on the Lua thread */
+static svn_error_t *
+session_take_worker (session_t **worker, session_t *session) {
+	apr_allocator_t *allocator;
+	apr_pool_t *pool;
+	svn_error_t *err;
 
-	if (lua_gettop (L) < 2 || lua_isnil (L, 2)) {
-		revision.kind = get_revision_kind (path);
-	} else {
-		revision.kind = svn_opt_revision_number;
-		revision.value.number = lua_tointeger (L, 2);
+	if (session->workers != NULL) {
+		*worker = session->workers;
+		session->workers = (*worker)->next;
+		session->idle_workers--;
+		(*worker)->next = NULL;
+		return SVN_NO_ERROR;
 	}
 
-	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
-		lua_getfield (L, itable, "recursive");
-		if (lua_isboolean (L, -1)) {
-			recursive = lua_toboolean (L, -1);
-		}
-
-		lua_getfield (L, itable, "fetch_locks");
-		if (lua_isboolean (L, -1)) {
-			fetch_locks = lua_toboolean (L, -1);
-		}
+	if (apr_allocator_create (&allocator)) {
+		return svn_error_create (APR_ENOMEM, NULL, "Error creating allocator");
 	}
 
-	init_function (&ctx, &pool, L);
-	path = svn_path_canonicalize (path, pool);
-	lua_newtable (L);
+	apr_allocator_max_free_set (allocator, SVN_ALLOCATOR_RECOMMENDED_MAX_FREE);
 
-	err = svn_client_list (path, &peg_revision, &revision, recursive, SVN_DIRENT_ALL,
-			               fetch_locks, list_func, L, ctx, pool);
-	IF_ERROR_RETURN (err, pool, L);
+	pool = svn_pool_create_ex (NULL, allocator);
+	apr_allocator_owner_set (allocator, pool);
 
-	svn_pool_destroy (pool);
+	*worker = apr_pcalloc (pool, sizeof (session_t));
+	session_copy_options (*worker, session, pool);
 
-	return 1;
-}
+	err = session_init (*worker, pool);
+	if (err) {
+		svn_pool_destroy (pool);
+	}
 
+	return err;
+}
 
-static svn_error_t *
-log_receiver (void *baton,
-			  apr_hash_t *changed_paths,
-			  svn_revnum_t revision,
-			  const char *author,
-			  const char *date,
-			  const char *message,
-			  apr_pool_t *pool) 
-{
 
-	lua_pushinteger ((lua_State*)baton, revision);
-	
-	lua_newtable ((lua_State*)baton);
+/* Gives WORKER back to SESSION, or destroys it when SESSION is closed or
+   has enough idle worker sessions already */
+static void
+session_give_worker (session_t *session, session_t *worker) {
+	if (session->pool == NULL || session->idle_workers >= SESSION_WORKERS_MAX) {
+		svn_pool_destroy (worker->pool);
+		return;
+	}
 
-	lua_pushstring ((lua_State*)baton, date);
+	worker->next = session->workers;
+	session->workers = worker;
+	session->idle_workers++;
+}
 
-	lua_setfield ((lua_State*)baton, -2, "date");
+#endif
 
-	lua_pushstring ((lua_State*)baton, message);
 
-	lua_setfield ((lua_State*)baton, -2, "message");
+/* Closes the idle connections of SESSION that were not used since
+   the idle time of the session */
+static void
+ra_evict (session_t *session, apr_time_t now) {
+	apr_hash_index_t *hi;
 
-	lua_pushstring ((lua_State*)baton, author);
+	for (hi = apr_hash_first (NULL, session->ra_pool); hi; hi = apr_hash_next (hi)) {
+		const void *key;
+		void *val;
+		ra_conn_t **conn;
 
-	lua_setfield ((lua_State*)baton, -2, "author");
+		apr_hash_this (hi, &key, NULL, &val);
 
-	lua_settable ((lua_State*)baton, -3);
+		for (conn = (ra_conn_t **) &val; *conn != NULL; ) {
+			if (now - (*conn)->last_used > session->ra_idle) {
+				ra_conn_t *old = *conn;
+				*conn = old->next;
+				svn_pool_destroy (old->pool);
+			} else {
+				conn = &((*conn)->next);
+			}
+		}
 
-	return NULL;
+		apr_hash_set (session->ra_pool, key, APR_HASH_KEY_STRING, val);
+	}
 }
 
 
-static int
-l_log (lua_State *L) {
-	apr_pool_t *pool;
+/* Gets a connection to the repository of URL, reparented to URL.
+   An idle connection to the same repository root is reused when there
+   is one, otherwise a new RA session is opened */
+static svn_error_t *
+ra_acquire (ra_conn_t **result, session_t *session, const char *url, apr_pool_t *pool) {
+	apr_hash_index_t *hi;
+	apr_pool_t *conn_pool;
+	ra_conn_t *conn;
+	const char *root;
 	svn_error_t *err;
-	svn_client_ctx_t *ctx;
-	
-	apr_array_header_t *array;
-	svn_opt_revision_t start, end;
-	svn_opt_revision_t peg_revision;
 
-	const char *path = (lua_gettop (L) < 1 || lua_isnil (L, 1)) ? "" : luaL_checkstring (L, 1);
-	int itable = 5;
-	int limit = 0; 
-	svn_boolean_t discover_changed_paths = FALSE;
-	svn_boolean_t stop_on_copy = FALSE;
-	peg_revision.kind = svn_opt_revision_unspecified;
-	start.kind = svn_opt_revision_number;
-	
-	if (lua_gettop (L) < 2 || lua_isnil (L, 2)) {
-		start.value.number = 0;
-	} else {
-		start.value.number = lua_tointeger (L, 2);
-	}
+	ra_evict (session, apr_time_now ());
 
-	if (lua_gettop (L) < 3 || lua_isnil (L, 3)) {
-		end.kind = get_revision_kind (path);
-	} else {
-		end.kind = svn_opt_revision_number;
-		end.value.number = lua_tointeger (L, 3);
-	}
+	for (hi = apr_hash_first (pool, session->ra_pool); hi; hi = apr_hash_next (hi)) {
+		const void *key;
+		void *val;
 
-	if (lua_gettop (L) >= 4) {
-		limit = lua_tointeger (L, 4);
-	}
-	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
-		lua_getfield (L, itable, "discover_changed_paths");
-		if (lua_isboolean (L, -1)) {
-			discover_changed_paths = lua_toboolean (L, -1);
-		}
+		apr_hash_this (hi, &key, NULL, &val);
 
-		lua_getfield (L, itable, "stop_on_copy");
-		if (lua_isboolean (L, -1)) {
-			stop_on_copy = lua_toboolean (L, -1);
+		conn = val;
+		if (conn != NULL && svn_path_is_ancestor (key, url)) {
+			apr_hash_set (session->ra_pool, key, APR_HASH_KEY_STRING, conn->next);
+			conn->next = NULL;
+
+			/* the connection is no longer in the pool, close it on errors */
+			err = svn_ra_reparent (conn->ra, url, pool);
+			if (err) {
+				svn_pool_destroy (conn->pool);
+				return err;
+			}
+
+			*result = conn;
+			return SVN_NO_ERROR;
 		}
-	} 
+	}
 
-	init_function (&ctx, &pool, L);
+	conn_pool = svn_pool_create (session->pool);
+	conn = apr_pcalloc (conn_pool, sizeof (*conn));
+	conn->pool = conn_pool;
 
-	path = svn_path_canonicalize (path, pool);
+	err = svn_client_open_ra_session (&conn->ra, url, session->ctx, conn_pool);
 
-	array = apr_array_make (pool, 1, sizeof (const char *));
-	(*((const char **) apr_array_push (array))) = path;
+	if (!err) {
+		err = svn_ra_get_repos_root (conn->ra, &root, conn_pool);
+	}
 
-	lua_newtable (L);
+	/* conn_pool lives as long as the session otherwise */
+	if (err) {
+		svn_pool_destroy (conn_pool);
+		return err;
+	}
 
-	err = svn_client_log3 (array, &peg_revision, &end, &start, limit, 
-					discover_changed_paths, stop_on_copy, log_receiver, L, ctx, pool);
-	IF_ERROR_RETURN (err, pool, L);
+	/* the keys of the pool must live as long as the session */
+	conn->root = apr_hash_get (session->ra_roots, root, APR_HASH_KEY_STRING);
+	if (conn->root == NULL) {
+		conn->root = apr_pstrdup (session->pool, root);
+		apr_hash_set (session->ra_roots, conn->root, APR_HASH_KEY_STRING, conn->root);
+	}
 
-	svn_pool_destroy (pool);
+	*result = conn;
+	return SVN_NO_ERROR;
+}
 
-	return 1;
+
+/* Tells whether a connection can still be used after an operation
+   that resulted in ERR */
+static svn_boolean_t
+ra_reusable (svn_error_t *err) {
+	return err == NULL
+		|| err->apr_err == SVN_ERR_FS_NOT_FOUND
+		|| err->apr_err == SVN_ERR_CLIENT_IS_DIRECTORY;
 }
 
 
-static int
-l_merge (lua_State *L) {
-	apr_pool_t *pool;
-	svn_error_t *err;
-	svn_client_ctx_t *ctx;
+/* Gives CONN back to the pool of connections of SESSION. The connection
+   is closed instead when ERR, the result of the operation that used it,
+   may have left it in an unknown state, or when there are enough idle
+   connections to the same repository root */
+static void
+ra_release (session_t *session, ra_conn_t *conn, svn_error_t *err) {
+	ra_conn_t *head;
+	ra_conn_t *idle;
+	int count = 0;
+
+	if (!ra_reusable (err)) {
+		svn_pool_destroy (conn->pool);
+		return;
+	}
 
-	svn_opt_revision_t rev1;
-	svn_opt_revision_t rev2;
+	head = apr_hash_get (session->ra_pool, conn->root, APR_HASH_KEY_STRING);
 
-	const char *source1 = NULL;
-	const char *source2 = NULL;
-	const char *wcpath = NULL;
-	int itable = 6;
-	svn_boolean_t recursive = TRUE;
-	svn_boolean_t ignore_ancestry = FALSE;
-	svn_boolean_t force = FALSE;
-	svn_boolean_t dry_run = FALSE;
+	for (idle = head; idle != NULL; idle = idle->next) {
+		count++;
+	}
 
-	source1 = luaL_checkstring (L, 1);
-		
-	if (lua_isnil (L, 2)) {
-		rev1.kind = svn_opt_revision_head;
-	} else {
-		rev1.kind = svn_opt_revision_number;
-		rev1.value.number = lua_tointeger (L, 2);
+	if (count >= session->ra_max) {
+		svn_pool_destroy (conn->pool);
+		return;
 	}
 
-	source2 = luaL_checkstring (L, 3);
+	conn->last_used = apr_time_now ();
+	conn->next = head;
+	apr_hash_set (session->ra_pool, conn->root, APR_HASH_KEY_STRING, conn);
+}
 
-	if (lua_isnil (L, 4)) {
-		rev2.kind = svn_opt_revision_head;
-	} else {
-		rev2.kind = svn_opt_revision_number;
-		rev2.value.number = lua_tointeger (L, 4);
-	}
 
-	if (lua_gettop (L) < 5 || lua_isnil (L, 5)) {
-		wcpath = "";
+/* Resolves REVISION to a revision number, using RA to get the youngest
+   revision of the repository if needed */
+static svn_error_t *
+ra_revnum (svn_revnum_t *rev, svn_ra_session_t *ra,
+           const svn_opt_revision_t *revision, apr_pool_t *pool) {
+
+	if (revision->kind == svn_opt_revision_number) {
+		*rev = revision->value.number;
+	} else if (revision->kind == svn_opt_revision_head
+			|| revision->kind == svn_opt_revision_unspecified) {
+		SVN_ERR (svn_ra_get_latest_revnum (ra, rev, pool));
 	} else {
-		wcpath = luaL_checkstring (L, 5);
+		return svn_error_create (SVN_ERR_INCORRECT_PARAMS, NULL,
+				"Revision must be a number or HEAD for URLs");
 	}
 
-	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
-		lua_getfield (L, itable, "recursive");
-		if (lua_isboolean (L, -1)) {
-			recursive = lua_toboolean (L, -1);
-		}
+	return SVN_NO_ERROR;
+}
 
-		lua_getfield (L, itable, "ignore_ancestry");
-		if (lua_isboolean (L, -1)) {
-			ignore_ancestry = lua_toboolean (L, -1);
-		}
-		
-		lua_getfield (L, itable, "force");
-		if (lua_isboolean (L, -1)) {
-			force = lua_toboolean (L, -1);
-		}
-		
-		lua_getfield (L, itable, "dry_run");
-		if (lua_isboolean (L, -1)) {
-			dry_run = lua_toboolean (L, -1);
-		}
-	}
 
-	init_function (&ctx, &pool, L);
+/* The youngest revision of a repository, as seen at CHECKED */
+typedef struct ra_head_t {
+	svn_revnum_t rev;
+	apr_time_t checked;
+} ra_head_t;
 
-	source1 = svn_path_canonicalize (source1, pool);
-	source2 = svn_path_canonicalize (source2, pool);
-	wcpath = svn_path_canonicalize (wcpath, pool);
 
-	err = svn_client_merge2 (source1, &rev1, source2, &rev2, wcpath,
-			recursive, ignore_ancestry, force, dry_run, NULL, ctx, pool);
-	IF_ERROR_RETURN (err, pool, L);	
+/* Returns the youngest revision of the repository of URL if it was seen
+   by SESSION less than TTL ago, SVN_INVALID_REVNUM otherwise */
+static svn_revnum_t
+ra_head_get (session_t *session, const char *url, apr_interval_time_t ttl) {
+	apr_hash_index_t *hi;
 
-	svn_pool_destroy (pool);
+	if (ttl <= 0) {
+		return SVN_INVALID_REVNUM;
+	}
 
-	return 0;
-}
+	for (hi = apr_hash_first (NULL, session->ra_heads); hi; hi = apr_hash_next (hi)) {
+		const void *key;
+		void *val;
+		ra_head_t *head;
 
+		apr_hash_this (hi, &key, NULL, &val);
+		head = val;
 
-static int
-l_mkdir (lua_State *L) {
-	apr_pool_t *pool;
-	svn_error_t *err;
-	svn_client_ctx_t *ctx;
-	
-	apr_array_header_t *array;
-	
-	const char *path = luaL_checkstring (L, 1);
-	const char *message = (lua_gettop (L) < 2 || lua_isnil (L, 2)) ? "" : luaL_checkstring (L, 2);
-	svn_commit_info_t *commit_info = NULL;
-
-	init_function (&ctx, &pool, L);
-
-	path = svn_path_canonicalize (path, pool);
-
-	array = apr_array_make (pool, 1, sizeof (const char *));
-	(*((const char **) apr_array_push (array))) = path;
-
-	if (svn_path_is_url (path)) {
-		make_log_msg_baton (&(ctx->log_msg_baton2), message, NULL, ctx->config, pool, L);
-		ctx->log_msg_func2 = log_msg_func2;
-	}
-
-	err = svn_client_mkdir2 (&commit_info, array, ctx, pool);
-	IF_ERROR_RETURN (err, pool, L);
-
-	if (commit_info == NULL) {
-		lua_pushnil (L);
-	} else {
-		lua_pushinteger (L, commit_info->revision);
+		if (svn_path_is_ancestor (key, url)) {
+			if (apr_time_now () - head->checked < ttl) {
+				return head->rev;
+			}
+			break;
+		}
 	}
 
-	svn_pool_destroy (pool);
-
-	return 1;
+	return SVN_INVALID_REVNUM;
 }
 
 
-static int
-l_move (lua_State *L) {
-	apr_pool_t *pool;
-	svn_error_t *err;
-	svn_client_ctx_t *ctx;
-	
-	const char *src_path = luaL_checkstring (L, 1);
-	const char *dest_path = luaL_checkstring (L, 2);
-	const char *message = (lua_gettop (L) < 3 || lua_isnil (L, 3)) ? "" : luaL_checkstring (L, 3);
-	int itable = 4;
-	svn_boolean_t force = FALSE;
-	svn_commit_info_t *commit_info = NULL;
-	
-	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
-		lua_getfield (L, itable, "force");
-		if (lua_isboolean (L, -1)) {
-			force = lua_toboolean (L, -1);
-		}
-	} 
-
-	init_function (&ctx, &pool, L);
-
-	src_path = svn_path_canonicalize (src_path, pool);
-	dest_path = svn_path_canonicalize (dest_path, pool);
-	
-	if (svn_path_is_url (dest_path)) {
-		make_log_msg_baton (&(ctx->log_msg_baton2), message, NULL, ctx->config, pool, L);
-		ctx->log_msg_func2 = log_msg_func2;
-	}
-
-	err = svn_client_move4 (&commit_info, src_path, dest_path, force, ctx, pool);
-	IF_ERROR_RETURN (err, pool, L);	
+/* Remembers REV as the youngest revision of the repository at ROOT,
+   one of the keys of the connection pool of SESSION */
+static void
+ra_head_set (session_t *session, const char *root, svn_revnum_t rev) {
+	ra_head_t *head;
 
-	if (commit_info == NULL) {
-		lua_pushnil (L);
-	} else {
-		lua_pushinteger (L, commit_info->revision);
+	head = apr_hash_get (session->ra_heads, root, APR_HASH_KEY_STRING);
+	if (head == NULL) {
+		head = apr_palloc (session->pool, sizeof (*head));
+		apr_hash_set (session->ra_heads, root, APR_HASH_KEY_STRING, head);
 	}
 
-	svn_pool_destroy (pool);
-
-	return 1;
+	head->rev = rev;
+	head->checked = apr_time_now ();
 }
 
 
-static int
-l_propget (lua_State *L) {
-	apr_pool_t *pool;
-	svn_error_t *err;
-	svn_client_ctx_t *ctx;
-
-	apr_hash_t *props;
-	const char *propname_utf8;
-	const void *key;
-	void *val;
+/* Forgets the youngest revisions seen by SESSION, after a commit */
+static void
+ra_heads_expire (session_t *session) {
 	apr_hash_index_t *hi;
-	svn_opt_revision_t peg_revision;
-	svn_opt_revision_t revision;
 
-	const char *path = luaL_checkstring (L, 1);
-	const char *propname = luaL_checkstring (L, 2);
-	int itable = 4;
-	svn_boolean_t recursive = FALSE;
-	peg_revision.kind = svn_opt_revision_unspecified;
+	for (hi = apr_hash_first (NULL, session->ra_heads); hi; hi = apr_hash_next (hi)) {
+		void *val;
 
-	if (lua_gettop (L) < 3 || lua_isnil (L, 3)) {
-		revision.kind = svn_opt_revision_unspecified;
-	} else {
-		revision.kind = svn_opt_revision_number;
-		revision.value.number = lua_tointeger (L, 3);
+		apr_hash_this (hi, NULL, NULL, &val);
+		((ra_head_t *) val)->checked = 0;
 	}
+}
 
-	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
-		lua_getfield (L, itable, "recursive");
-		if (lua_isboolean (L, -1)) {
-			recursive = lua_toboolean (L, -1);
-		}
-	} 
-
-	init_function (&ctx, &pool, L);
-
-	path = svn_path_canonicalize (path, pool);
-	
-	err = svn_utf_cstring_to_utf8 (&propname_utf8, propname, pool);
-	IF_ERROR_RETURN (err, pool, L);
-
-	err = svn_client_propget2 (&props, propname_utf8, path, &peg_revision, &revision, recursive, ctx, pool);
-	IF_ERROR_RETURN (err, pool, L);
 
-	lua_newtable (L);
+/* Asks the repository of URL for its youngest revision, acquiring a
+   connection of SESSION in CONN if there is none yet */
+static svn_error_t *
+ra_latest (svn_revnum_t *head, session_t *session, ra_conn_t **conn,
+           const char *url, apr_pool_t *pool) {
 
-	for (hi = apr_hash_first (pool, props); hi; hi = apr_hash_next (hi)) {
-	  svn_string_t *s;
-	  apr_hash_this (hi, &key, NULL, &val);
-	  s = (svn_string_t *) val;
-	  
-	  lua_pushstring (L, s->data);
-	  lua_setfield (L, -2, (char *) key);
+	if (*conn == NULL) {
+		SVN_ERR (ra_acquire (conn, session, url, pool));
 	}
 
-	svn_pool_destroy (pool);
+	SVN_ERR (svn_ra_get_latest_revnum ((*conn)->ra, head, pool));
+	ra_head_set (session, (*conn)->root, *head);
 
-	return 1;
+	return SVN_NO_ERROR;
 }
 
 
-static int
-l_proplist (lua_State *L) {
-	apr_pool_t *pool;
-	svn_error_t *err;
-	svn_client_ctx_t *ctx;
-
-	apr_array_header_t *props;
-	svn_opt_revision_t peg_revision;
-	svn_opt_revision_t revision;
-	int is_url;
-	int i;
-
-	const char *path = (lua_gettop (L) < 1 || lua_isnil (L, 1)) ? "" : luaL_checkstring (L, 1);
-	int itable = 3;
-	svn_boolean_t recursive = FALSE;
-	peg_revision.kind = svn_opt_revision_unspecified;
+/* Sets LOCATED to the URL of the location in revision REV of the node
+   found at URL in revision PEG, following its copies and renames. This is
+   what svn_client does with a URL without a peg revision, for which PEG
+   is HEAD: the URL must exist in PEG, and it is read where it lived in REV.
+   The locations never change for a given PEG, so they are remembered by
+   SESSION, and a connection is acquired in CONN only when one must be
+   asked for. CONN, if any, is at URL on entry, and at LOCATED on exit */
+static svn_error_t *
+ra_locate (const char **located, session_t *session, ra_conn_t **conn,
+           const char *url, svn_revnum_t peg, svn_revnum_t rev, apr_pool_t *pool) {
+	apr_array_header_t *revs;
+	apr_hash_t *locations;
+	const char *key;
+	const char *path;
 
-	if (lua_gettop (L) < 2 || lua_isnil (L, 2)) {
-		revision.kind = svn_opt_revision_unspecified;
-	} else {
-		revision.kind = svn_opt_revision_number;
-		revision.value.number = lua_tointeger (L, 2);
-	}	
+	*located = url;
 
-	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
-		lua_getfield (L, itable, "recursive");
-		if (lua_isboolean (L, -1)) {
-			recursive = lua_toboolean (L, -1);
-		}
+	if (rev >= peg) {
+		return SVN_NO_ERROR;
 	}
 
-	init_function (&ctx, &pool, L);
-
-	path = svn_path_canonicalize (path, pool);
-
-	is_url = svn_path_is_url (path);
-
-	err = svn_client_proplist2 (&props, path, &peg_revision, &revision, recursive, ctx, pool);
-	IF_ERROR_RETURN (err, pool, L);
-
-	lua_newtable (L);
-
-	for (i = 0; i < props->nelts; ++i)
-	{
-		const void *key;
-		void *val;
-		svn_client_proplist_item_t *item = ((svn_client_proplist_item_t **)props->elts)[i];
-		apr_hash_index_t *hi;
-		const char *name_local;
+	key = apr_psprintf (pool, "%ld:%ld:%s", peg, rev, url);
+	path = apr_hash_get (session->ra_locations, key, APR_HASH_KEY_STRING);
 
-		if (is_url) {
-			name_local = svn_path_local_style (item->node_name->data, pool);
-		} else {
-			name_local = item->node_name->data;
+	if (path != NULL) {
+		*located = path;
+	} else {
+		if (*conn == NULL) {
+			SVN_ERR (ra_acquire (conn, session, url, pool));
 		}
 
-		lua_pushstring (L, name_local);
-
-		lua_newtable (L);
+		revs = apr_array_make (pool, 1, sizeof (svn_revnum_t));
+		(*((svn_revnum_t *) apr_array_push (revs))) = rev;
 
-		for (hi = apr_hash_first (pool, item->prop_hash); hi; hi = apr_hash_next (hi)) {
-			const char *pname;
-			svn_string_t *pval;
-			
-			apr_hash_this (hi, &key, NULL, &val);
+		SVN_ERR (svn_ra_get_locations ((*conn)->ra, &locations, "", peg, revs, pool));
 
-			pname = key;
-			pval = (svn_string_t *) val;
+		path = apr_hash_get (locations, &rev, sizeof (svn_revnum_t));
+		if (path == NULL) {
+			return svn_error_createf (SVN_ERR_CLIENT_UNRELATED_RESOURCES, NULL,
+					"Unable to find repository location for '%s' in revision %ld", url, rev);
+		}
 
-			err = svn_cmdline_cstring_from_utf8 (&pname, pname, pool);
-			IF_ERROR_RETURN (err, pool, L);
+		/* the locations are absolute paths in the repository */
+		*located = svn_path_url_add_component ((*conn)->root, path + 1, pool);
 
-			lua_pushstring (L, pval->data);
-			lua_setfield (L, -2, pname);
+		if (apr_hash_count (session->ra_locations) >= RA_LOCATIONS_MAX) {
+			svn_pool_clear (session->ra_locations_pool);
+			session->ra_locations = apr_hash_make (session->ra_locations_pool);
 		}
 
-		lua_settable (L, -3);
-
+		apr_hash_set (session->ra_locations,
+				apr_pstrdup (session->ra_locations_pool, key), APR_HASH_KEY_STRING,
+				apr_pstrdup (session->ra_locations_pool, *located));
 	}
 
-	svn_pool_destroy (pool);
+	if (*conn != NULL && strcmp (*located, url) != 0) {
+		SVN_ERR (svn_ra_reparent ((*conn)->ra, *located, pool));
+	}
 
-	return 1;
+	return SVN_NO_ERROR;
 }
 
-static int
-l_propset (lua_State *L) {
-	apr_pool_t *pool;
+
+/* Like ra_locate, with URL taken in HEAD. If HEAD is valid, it is used as
+   is, otherwise it is the youngest revision seen by SESSION in the last
+   head_ttl seconds, or the one the repository gives, and HEAD is set to it.
+   A HEAD that may be outdated is refreshed when REV is younger, and when
+   URL can not be traced from it, since URL may have been created or moved
+   since then */
+static svn_error_t *
+ra_trace (const char **located, svn_revnum_t *head, session_t *session,
+          ra_conn_t **conn, const char *url, svn_revnum_t rev, apr_pool_t *pool) {
+	svn_boolean_t fresh = SVN_IS_VALID_REVNUM (*head);
 	svn_error_t *err;
-	svn_client_ctx_t *ctx;
 
-	const char *path = luaL_checkstring (L, 1);
-	const char *propname = luaL_checkstring (L, 2);
-	const char *propval = lua_isnil (L, 3) ? NULL : luaL_checkstring (L, 3);
-	const char *propname_utf8 = NULL;
-	int itable = 4;
-	svn_boolean_t recursive = FALSE;
-	svn_boolean_t force = FALSE;
+	if (!fresh) {
+		*head = ra_head_get (session, url, session->head_ttl);
 
-	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
-		
-		lua_getfield (L, itable, "recursive");
-		if (lua_isboolean (L, -1)) {
-			recursive = lua_toboolean (L, -1);
-		}
-		
-		lua_getfield (L, itable, "force");
-		if (lua_isboolean (L, -1)) {
-			force = lua_toboolean (L, -1);
+		if (!SVN_IS_VALID_REVNUM (*head) || rev > *head) {
+			SVN_ERR (ra_latest (head, session, conn, url, pool));
+			fresh = TRUE;
 		}
-	} 
-
-	init_function (&ctx, &pool, L);
-
-	path = svn_path_canonicalize (path, pool);
+	}
 
-	err = svn_utf_cstring_to_utf8 (&propname_utf8, propname, pool);
-	IF_ERROR_RETURN (err, pool, L);
+	err = ra_locate (located, session, conn, url, *head, rev, pool);
 
-	if (propval != NULL) {
-		svn_string_t *sstring = svn_string_create (propval, pool);
+	if (err && !fresh) {
+		svn_error_clear (err);
 
-		err = svn_client_propset2 (propname_utf8, sstring, path, recursive, force, ctx, pool);
-	} else {
-		err = svn_client_propset2 (propname_utf8, NULL, path, recursive, force, ctx, pool);
+		SVN_ERR (ra_latest (head, session, conn, url, pool));
+		err = ra_locate (located, session, conn, url, *head, rev, pool);
 	}
-	IF_ERROR_RETURN (err, pool, L);
-	
-	svn_pool_destroy (pool);
 
-	return 0;
+	return err;
 }
 
 
-static int
-l_repos_create (lua_State *L) {
-	apr_pool_t *pool;
-	svn_error_t *err;
-	svn_repos_t *repos_p;
-	
-	const char *path = luaL_checkstring (L, 1);
+/* Resolves REVISION like ra_revnum, and sets LOCATED to the location of
+   URL in that revision, URL being taken in HEAD. A connection of SESSION
+   is acquired in CONN only when the repository must be asked, see
+   ra_locate. The caller releases CONN, if any, even on errors */
+static svn_error_t *
+ra_resolve (svn_revnum_t *rev, const char **located, session_t *session,
+            ra_conn_t **conn, const char *url, const svn_opt_revision_t *revision,
+            apr_pool_t *pool) {
+	svn_revnum_t head = SVN_INVALID_REVNUM;
+
+	*located = url;
 
-	if (init_pool (&pool) != 0) {
-		return init_pool_error (L);
+	if (revision->kind == svn_opt_revision_number) {
+		*rev = revision->value.number;
+		return ra_trace (located, &head, session, conn, url, *rev, pool);
 	}
 
-	path = svn_path_canonicalize (path, pool);
+	if (*conn == NULL) {
+		SVN_ERR (ra_acquire (conn, session, url, pool));
+	}
 
-	err = svn_repos_create (&repos_p, path, NULL, NULL, NULL, NULL, pool);
-	IF_ERROR_RETURN (err, pool, L);
+	SVN_ERR (ra_revnum (rev, (*conn)->ra, revision, pool));
+	ra_head_set (session, (*conn)->root, *rev);
 
-	return 0;
+	return SVN_NO_ERROR;
 }
 
 
-static int
-l_repos_delete (lua_State *L) {
-	apr_pool_t *pool;
-	svn_error_t *err;
+struct log_msg_baton
+{
+  const char *editor_cmd;  /* editor specified via --editor-cmd, else NULL */
+  const char *message;  /* the message. */
+  const char *message_encoding; /* the locale/encoding of the message. */
+  const char *base_dir; /* the base directory for an external edit. UTF-8! */
+  const char *tmpfile_left; /* the tmpfile left by an external edit. UTF-8! */
+  svn_boolean_t non_interactive; /* if true, don't pop up an editor */
+  apr_hash_t *config; /* client configuration hash */
+  svn_boolean_t keep_locks; /* Keep repository locks? */
+  apr_pool_t *pool; /* a pool. */
+  lua_State *L;
+};
+
+
+svn_error_t *
+make_log_msg_baton(void **baton,
+		const char *message,
+		const char *base_dir /* UTF-8! */,
+		apr_hash_t *config,
+		apr_pool_t *pool,
+		lua_State *L)
+{
+  struct log_msg_baton *lmb = apr_palloc(pool, sizeof(*lmb));
+
+  lmb->message = message;
+
+  lmb->editor_cmd = NULL;;
+  
+  if (config)
+  {
+ 	  svn_config_t *cfg = apr_hash_get(config, SVN_CONFIG_CATEGORY_CONFIG, 
+                                       APR_HASH_KEY_STRING);
+      svn_config_get(cfg, &(lmb->message_encoding),
+                     SVN_CONFIG_SECTION_MISCELLANY,
+                     SVN_CONFIG_OPTION_LOG_ENCODING,
+                     NULL);
+  } else 
+  {
+	  lmb->message_encoding = APR_LOCALE_CHARSET;
+  }
+
+  lmb->base_dir = base_dir ? base_dir : "";
+  lmb->tmpfile_left = NULL;
+  lmb->config = config;
+  lmb->keep_locks = FALSE;
+  lmb->non_interactive = TRUE;
+  lmb->pool = pool;
+  lmb->L = L;
+  *baton = lmb;
+  return SVN_NO_ERROR;
+}
+
+static svn_error_t *
+log_msg_func2 (const char **log_msg,
+		       const char **tmp_file,
+			   const apr_array_header_t *commit_items,
+			   void *baton,
+			   apr_pool_t *pool)
+{
+	struct log_msg_baton *lmb = baton;
+
+	svn_error_t *err = svn_utf_cstring_to_utf8 (log_msg, lmb->message, pool);
+	
+	if (err) {     
+	  return err;
+	} 
+
+	*tmp_file = NULL;
+
+	return SVN_NO_ERROR;
+}
+
+
+static enum svn_opt_revision_kind
+get_revision_kind (const char *path) {
+	if (svn_path_is_url (path))
+		return svn_opt_revision_head;
+	return svn_opt_revision_base;
+}
+
+
+#define DATE_STRING 0
+#define DATE_SECONDS 1
+#define DATE_MICROSECONDS 2
+
+
+/* Reads the format of the dates returned from the field date_format
+   of the table at index ITABLE, if there is one */
+static int
+get_date_format (lua_State *L, int itable) {
+	const char *format;
+
+	if (lua_gettop (L) < itable || !lua_istable (L, itable)) {
+		return DATE_STRING;
+	}
+
+	lua_getfield (L, itable, "date_format");
+	format = lua_tostring (L, -1);
+	lua_pop (L, 1);
+
+	if (format == NULL || strcmp (format, "string") == 0) {
+		return DATE_STRING;
+	} else if (strcmp (format, "seconds") == 0) {
+		return DATE_SECONDS;
+	} else if (strcmp (format, "microseconds") == 0) {
+		return DATE_MICROSECONDS;
+	}
+
+	return luaL_error (L, "invalid date format '%s'", format);
+}
+
+
+/* Pushes WHEN as a number of seconds or microseconds since the epoch */
+static void
+push_date (lua_State *L, apr_time_t when, int format) {
+	if (format == DATE_SECONDS) {
+		lua_pushnumber (L, (lua_Number) when / APR_USEC_PER_SEC);
+	} else {
+		lua_pushnumber (L, (lua_Number) when);
+	}
+}
+
+
+static int
+l_add (lua_State *L) {
+	apr_pool_t *pool;
+	svn_error_t *err;
+	svn_client_ctx_t *ctx;
 	
 	const char *path = luaL_checkstring (L, 1);
+	int itable = 2;
+	svn_boolean_t recursive = TRUE;
+	svn_boolean_t force = FALSE;
+	svn_boolean_t no_ignore = FALSE;
+
+	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
+		lua_getfield (L, itable, "recursive");
+		if (lua_isboolean (L, -1)) {
+			recursive = lua_toboolean (L, -1);
+		}
+
+		lua_getfield (L, itable, "force");
+		if (lua_isboolean (L, -1)) {
+			force = lua_toboolean (L, -1);
+		}
+	
+		lua_getfield (L, itable, "no_ignore");
+		if (lua_isboolean (L, -1)) {
+			no_ignore = lua_toboolean (L, -1);
+		}
+	} 
+
+	init_function (&ctx, &pool, L);
+
+	path = svn_path_canonicalize (path, pool);
+
+	err = svn_client_add3 (path, recursive, force, no_ignore, ctx, pool);
+	IF_ERROR_RETURN (err, pool, L);
+
+	svn_pool_destroy (pool);
+	
+	return 0;
+}
+
+
+static svn_error_t *
+write_fn (void *baton, const char *data, apr_size_t *len) {
+
+	svn_stringbuf_appendbytes (baton, data, *len);
+
+	return SVN_NO_ERROR;
+}
+
+
+/* Gets the dirent of the file at the session URL of RA, in revision REV */
+static svn_error_t *
+ra_stat_file (svn_dirent_t **dirent, svn_ra_session_t *ra, const char *url,
+              svn_revnum_t rev, apr_pool_t *pool) {
+
+	SVN_ERR (svn_ra_stat (ra, "", rev, dirent, pool));
+
+	if (*dirent == NULL) {
+		return svn_error_createf (SVN_ERR_FS_NOT_FOUND, NULL,
+				"'%s' does not exist in revision %ld", url, rev);
+	}
+
+	if ((*dirent)->kind == svn_node_dir) {
+		return svn_error_createf (SVN_ERR_CLIENT_IS_DIRECTORY, NULL,
+				"URL '%s' refers to a directory", url);
+	}
+
+	return SVN_NO_ERROR;
+}
+
+
+/* Sets STREAM to a stream that writes to OUT the contents of the file at
+   URL with the properties PROPS, with its keywords expanded from REV, DATE
+   and AUTHOR, and its end of lines translated, when it has the
+   corresponding properties. STREAM is OUT when nothing is translated, and
+   must be closed otherwise, which leaves OUT open */
+static svn_error_t *
+subst_stream (svn_stream_t **stream, svn_stream_t *out, apr_hash_t *props,
+              const char *url, const char *rev, const char *date, const char *author,
+              apr_pool_t *pool) {
+	svn_string_t *eol_style = apr_hash_get (props, SVN_PROP_EOL_STYLE, APR_HASH_KEY_STRING);
+	svn_string_t *keywords = apr_hash_get (props, SVN_PROP_KEYWORDS, APR_HASH_KEY_STRING);
+	svn_subst_eol_style_t style;
+	const char *eol = NULL;
+	apr_hash_t *kw = NULL;
+
+	*stream = out;
+
+	if (!eol_style && !keywords) {
+		return SVN_NO_ERROR;
+	}
+
+	if (eol_style) {
+		svn_subst_eol_style_from_value (&style, &eol, eol_style->data);
+		if (style == svn_subst_eol_style_native) {
+			eol = APR_EOL_STR;
+		}
+	}
+
+	if (keywords) {
+		apr_time_t when = 0;
+
+		if (date) {
+			SVN_ERR (svn_time_from_cstring (&when, date, pool));
+		}
+
+		SVN_ERR (svn_subst_build_keywords2 (&kw, keywords->data, rev, url, when,
+					author, pool));
+	}
+
+	*stream = svn_subst_stream_translated (svn_stream_disown (out, pool),
+			eol, FALSE, kw, TRUE, pool);
+
+	return SVN_NO_ERROR;
+}
+
+
+/* Writes to OUT the contents of the file at the session URL of RA, in
+   revision REV. Like svn_client_cat2, expands the keywords and translates
+   the end of lines when the file has the corresponding properties. This
+   is a copy of the URL case of svn_client_cat2 in libsvn_client/cat.c,
+   and must be kept in line with it: an unknown svn:eol-style leaves the
+   end of lines alone and svn:special is not looked at, as there. The
+   properties are fetched first, without the contents, so that these are
+   translated as they arrive instead of going through a temporary file */
+static svn_error_t *
+ra_cat (svn_ra_session_t *ra, const char *url, svn_revnum_t rev,
+        const svn_dirent_t *dirent, svn_stream_t *out, apr_pool_t *pool) {
+	apr_hash_t *props;
+	svn_stream_t *stream = out;
+
+	if (dirent->has_props) {
+		svn_string_t *cmt_rev, *cmt_date, *cmt_author;
+
+		SVN_ERR (svn_ra_get_file (ra, "", rev, NULL, NULL, &props, pool));
+
+		cmt_rev = apr_hash_get (props, SVN_PROP_ENTRY_COMMITTED_REV, APR_HASH_KEY_STRING);
+		cmt_date = apr_hash_get (props, SVN_PROP_ENTRY_COMMITTED_DATE, APR_HASH_KEY_STRING);
+		cmt_author = apr_hash_get (props, SVN_PROP_ENTRY_LAST_AUTHOR, APR_HASH_KEY_STRING);
+
+		SVN_ERR (subst_stream (&stream, out, props, url,
+					cmt_rev ? cmt_rev->data : NULL, cmt_date ? cmt_date->data : NULL,
+					cmt_author ? cmt_author->data : NULL, pool));
+	}
+
+	SVN_ERR (svn_ra_get_file (ra, "", rev, stream, NULL, NULL, pool));
+
+	if (stream != out) {
+		SVN_ERR (svn_stream_close (stream));
+	}
+
+	return SVN_NO_ERROR;
+}
+
+
+/* Copies the data written to the stream it wraps, see cat_read */
+typedef struct copy_bt {
+	svn_stream_t *out;
+	svn_stringbuf_t *copy;
+} copy_bt;
+
+
+static svn_error_t *
+copy_write_fn (void *baton, const char *data, apr_size_t *len) {
+	copy_bt *cb = baton;
+
+	svn_stringbuf_appendbytes (cb->copy, data, *len);
+
+	return svn_stream_write (cb->out, data, len);
+}
+
+
+/* Key of the contents of the file at URL in revision REV in a cat cache.
+   URL is the location of the file in REV, so the contents never change */
+static const char *
+cat_cache_key (const char *url, svn_revnum_t rev, apr_pool_t *pool) {
+	return apr_psprintf (pool, "%s@%ld", url, rev);
+}
+
+
+/* Writes to OUT the contents of the file at the session URL of RA, in
+   revision REV, see ra_cat. If BUFFER is not NULL, it is what OUT writes
+   to, and it is grown to the size of the file first. If MAX_COPY is not 0
+   and the file is not larger, COPY is set to a copy of the contents for a
+   cache, which is BUFFER itself when there is one; it is NULL otherwise.
+   This only uses RA and POOL, so it may run in a thread */
+static svn_error_t *
+cat_read (svn_stringbuf_t **copy, svn_ra_session_t *ra, const char *url,
+          svn_revnum_t rev, svn_stream_t *out, svn_stringbuf_t *buffer,
+          apr_size_t max_copy, apr_pool_t *pool) {
+	svn_dirent_t *dirent;
+
+	*copy = NULL;
+
+	SVN_ERR (ra_stat_file (&dirent, ra, url, rev, pool));
+
+	if (buffer != NULL && dirent->size != SVN_INVALID_FILESIZE) {
+		svn_stringbuf_ensure (buffer, (apr_size_t) dirent->size + 1);
+	}
+
+	if (max_copy > 0 && dirent->size != SVN_INVALID_FILESIZE
+			&& (apr_size_t) dirent->size <= max_copy) {
+		if (buffer != NULL) {
+			*copy = buffer;
+		} else {
+			copy_bt *cb = apr_palloc (pool, sizeof (*cb));
+
+			cb->out = out;
+			cb->copy = svn_stringbuf_create ("", pool);
+			svn_stringbuf_ensure (cb->copy, (apr_size_t) dirent->size + 1);
+
+			out = svn_stream_create (cb, pool);
+			svn_stream_set_write (out, copy_write_fn);
+
+			*copy = cb->copy;
+		}
+	}
+
+	return ra_cat (ra, url, rev, dirent, out, pool);
+}
+
+
+/* Where the contents of a file read from a URL come from */
+typedef struct cat_source_t {
+	const char *url; /* location of the file in REV, see ra_locate */
+	svn_revnum_t rev;
+	const char *key; /* key in the cat cache of the session, NULL when disabled */
+	const char *data; /* contents found in the cache, NULL on a miss */
+	apr_size_t len;
+} cat_source_t;
+
+
+/* Resolves URL at REVISION into SRC, and looks the contents up in the
+   cache of SESSION. The repository is only asked, with a connection
+   acquired in CONN, when SESSION does not know HEAD or the location of
+   URL, see ra_resolve, so a hit usually needs no connection. The data
+   found is valid until the next change of the cache */
+static svn_error_t *
+cat_resolve (cat_source_t *src, session_t *session, ra_conn_t **conn,
+             const char *url, const svn_opt_revision_t *revision, apr_pool_t *pool) {
+
+	src->key = NULL;
+	src->data = NULL;
+	src->len = 0;
+
+	SVN_ERR (ra_resolve (&src->rev, &src->url, session, conn, url, revision, pool));
+
+	if (session->cat_cache.max_bytes > 0) {
+		src->key = cat_cache_key (src->url, src->rev, pool);
+
+		if (!lru_get (&session->cat_cache, src->key, &src->data, &src->len, pool)) {
+			src->data = NULL;
+		}
+	}
+
+	return SVN_NO_ERROR;
+}
+
+
+/* Writes to OUT the contents of URL at REVISION, from the cache of
+   SESSION or using one of its pooled connections, and caches them when
+   they fit. URL is taken in HEAD, see ra_locate. If BUFFER is not NULL,
+   it is what OUT writes to, and it is grown to the size of the file
+   before the contents are written */
+static svn_error_t *
+cat_url (session_t *session, const char *url, const svn_opt_revision_t *revision,
+         svn_stream_t *out, svn_stringbuf_t *buffer, apr_pool_t *pool) {
+	ra_conn_t *conn = NULL;
+	cat_source_t src;
+	svn_stringbuf_t *copy = NULL;
+	svn_error_t *err;
+
+	err = cat_resolve (&src, session, &conn, url, revision, pool);
+
+	if (!err && src.data != NULL) {
+		/* OUT may run Lua code, which may change the cache */
+		if (buffer == NULL) {
+			src.data = apr_pmemdup (pool, src.data, src.len);
+		}
+
+		err = svn_stream_write (out, src.data, &src.len);
+	} else if (!err) {
+		if (conn == NULL) {
+			err = ra_acquire (&conn, session, src.url, pool);
+		}
+
+		if (!err) {
+			err = cat_read (&copy, conn->ra, src.url, src.rev, out, buffer,
+					src.key != NULL ? session->cat_cache.max_bytes : 0, pool);
+		}
+
+		if (!err && copy != NULL) {
+			lru_put (&session->cat_cache, src.key, copy->data, copy->len, pool);
+		}
+	}
+
+	if (conn != NULL) {
+		ra_release (session, conn, err);
+	}
+
+	return err;
+}
+
+
+/* Counts and checksums the data written to the stream it wraps */
+typedef struct digest_bt {
+	svn_stream_t *out;
+	apr_md5_ctx_t context;
+	svn_filesize_t total;
+} digest_bt;
+
+
+static svn_error_t *
+digest_write_fn (void *baton, const char *data, apr_size_t *len) {
+	digest_bt *db = baton;
+
+	SVN_ERR (svn_stream_write (db->out, data, len));
+
+	apr_md5_update (&db->context, data, *len);
+	db->total += *len;
+
+	return SVN_NO_ERROR;
+}
+
+
+/* Opens a stream to the output target at index IDX, which may be a file
+   name, a Lua file or a file descriptor. Files given by the caller are not
+   closed with the stream */
+static svn_error_t *
+open_target (svn_stream_t **stream, lua_State *L, int idx, apr_pool_t *pool) {
+	apr_file_t *file;
+	apr_os_file_t fd;
+	apr_status_t status;
+
+	if (lua_type (L, idx) == LUA_TSTRING) {
+		SVN_ERR (svn_io_file_open (&file, lua_tostring (L, idx),
+					APR_WRITE | APR_CREATE | APR_TRUNCATE | APR_BUFFERED | APR_BINARY,
+					APR_OS_DEFAULT, pool));
+
+		*stream = svn_stream_from_aprfile2 (file, FALSE, pool);
+		return SVN_NO_ERROR;
+	}
+
+	if (lua_type (L, idx) == LUA_TNUMBER) {
+		fd = lua_tointeger (L, idx);
+	} else {
+		FILE **f = luaL_checkudata (L, idx, LUA_FILEHANDLE);
+
+		if (*f == NULL) {
+			return svn_error_create (SVN_ERR_INCORRECT_PARAMS, NULL,
+					"Attempt to use a closed file");
+		}
+
+		fflush (*f);
+		fd = fileno (*f);
+	}
+
+	status = apr_os_file_put (&file, &fd, APR_WRITE, pool);
+	if (status) {
+		return svn_error_wrap_apr (status, "Can't use the output file");
+	}
+
+	*stream = svn_stream_from_aprfile2 (file, TRUE, pool);
+
+	return SVN_NO_ERROR;
+}
+
+
+static int
+l_cat (lua_State *L) {
+	apr_pool_t *pool;
+	svn_error_t *err;
+	svn_client_ctx_t *ctx;
+	session_t *session;
+	
+	svn_stream_t *stream;
+	svn_stringbuf_t *buffer;
+	svn_opt_revision_t peg_revision;
+	svn_opt_revision_t revision;
+	digest_bt digest;
+	apr_finfo_t finfo;
+
+	const char *path = luaL_checkstring (L, 1);
+	peg_revision.kind = svn_opt_revision_unspecified;
+
+	if (lua_gettop (L) < 2 || lua_isnil (L, 2)) {
+		revision.kind = get_revision_kind (path);
+	} else {
+		revision.kind = svn_opt_revision_number;
+		revision.value.number = lua_tointeger (L, 2);
+	}
+
+	/* open_target raises for anything else, which must happen before
+	   the pool is created */
+	if (!lua_isnoneornil (L, 3) && lua_type (L, 3) != LUA_TSTRING
+			&& lua_type (L, 3) != LUA_TNUMBER) {
+		luaL_checkudata (L, 3, LUA_FILEHANDLE);
+	}
+
+	session = init_function (&ctx, &pool, L);
+
+	path = svn_path_canonicalize (path, pool);
+
+	stream = svn_stream_empty (pool);
+
+	if (lua_gettop (L) < 3 || lua_isnil (L, 3)) {
+		svn_stream_set_write (stream, write_fn);
+
+		buffer = svn_stringbuf_create ("", pool);
+
+		/* the size of the working file is a good guess of the size of
+		   its base, so usually the buffer is allocated only once. Older
+		   revisions may have nothing to do with it */
+		if (!svn_path_is_url (path)
+				&& (revision.kind == svn_opt_revision_base
+					|| revision.kind == svn_opt_revision_working)
+				&& apr_stat (&finfo, path, APR_FINFO_SIZE, pool) == APR_SUCCESS) {
+			svn_stringbuf_ensure (buffer, (apr_size_t) finfo.size + 1);
+		}
+
+		svn_stream_set_baton (stream, buffer);
+	} else {
+		buffer = NULL;
+
+		err = open_target (&digest.out, L, 3, pool);
+		IF_ERROR_RETURN (err, pool, L);
+
+		apr_md5_init (&digest.context);
+		digest.total = 0;
+
+		svn_stream_set_write (stream, digest_write_fn);
+		svn_stream_set_baton (stream, &digest);
+	}
+
+	if (svn_path_is_url (path)) {
+		err = cat_url (session, path, &revision, stream, buffer, pool);
+	} else {
+		err = svn_client_cat2 (stream, path, &peg_revision, &revision, ctx, pool);
+	}
+
+	if (!err && buffer == NULL) {
+		err = svn_stream_close (digest.out);
+	}
+	IF_ERROR_RETURN (err, pool, L);
+
+	if (buffer == NULL) {
+		unsigned char checksum[APR_MD5_DIGESTSIZE];
+
+		apr_md5_final (checksum, &digest.context);
+
+		lua_pushnumber (L, (lua_Number) digest.total);
+		lua_pushstring (L, svn_md5_digest_to_cstring_display (checksum, pool));
+
+		svn_pool_destroy (pool);
+
+		return 2;
+	}
+
+	lua_pushlstring (L, buffer->data, buffer->len);
+
+	svn_pool_destroy (pool);
+
+	return 1;
+}
+
+
+/* Writes to OUT the contents of URL at REVISION, using the connection in
+   CONN, which is reparented when URL is in the same repository, or
+   replaced by another one from SESSION otherwise. REV is the revision
+   REVISION was resolved to in the repository of CONN, and HEAD the
+   youngest revision of it, in which URL is taken */
+static svn_error_t *
+cat_many_url (session_t *session, ra_conn_t **conn, svn_revnum_t *rev,
+              svn_revnum_t *head, const char *url, const svn_opt_revision_t *revision,
+              svn_stream_t *out, svn_stringbuf_t *buffer, apr_pool_t *pool) {
+	svn_stringbuf_t *copy;
+	const char *key = NULL;
+	const char *data;
+	apr_size_t len;
+
+	if (*conn != NULL && svn_path_is_ancestor ((*conn)->root, url)) {
+		SVN_ERR (svn_ra_reparent ((*conn)->ra, url, pool));
+	} else {
+		if (*conn != NULL) {
+			ra_release (session, *conn, NULL);
+			*conn = NULL;
+		}
+
+		SVN_ERR (ra_acquire (conn, session, url, pool));
+		SVN_ERR (ra_revnum (rev, (*conn)->ra, revision, pool));
+
+		/* set by ra_trace for a revision number */
+		*head = (revision->kind == svn_opt_revision_number) ? SVN_INVALID_REVNUM : *rev;
+	}
+
+	SVN_ERR (ra_trace (&url, head, session, conn, url, *rev, pool));
+
+	if (session->cat_cache.max_bytes > 0) {
+		key = cat_cache_key (url, *rev, pool);
+
+		if (lru_get (&session->cat_cache, key, &data, &len, pool)) {
+			return svn_stream_write (out, data, &len);
+		}
+	}
+
+	SVN_ERR (cat_read (&copy, (*conn)->ra, url, *rev, out, buffer,
+				key != NULL ? session->cat_cache.max_bytes : 0, pool));
+
+	if (copy != NULL) {
+		lru_put (&session->cat_cache, key, copy->data, copy->len, pool);
+	}
+
+	return SVN_NO_ERROR;
+}
+
+
+static int
+l_cat_many (lua_State *L) {
+	apr_pool_t *pool;
+	apr_pool_t *subpool;
+	svn_error_t *err;
+	svn_client_ctx_t *ctx;
+	session_t *session;
+
+	svn_opt_revision_t peg_revision;
+	svn_opt_revision_t revision;
+	svn_revnum_t rev = SVN_INVALID_REVNUM;
+	svn_revnum_t head = SVN_INVALID_REVNUM;
+	ra_conn_t *conn = NULL;
+	int i, n;
+
+	luaL_checktype (L, 1, LUA_TTABLE);
+	peg_revision.kind = svn_opt_revision_unspecified;
+
+	if (lua_gettop (L) < 2 || lua_isnil (L, 2)) {
+		revision.kind = svn_opt_revision_unspecified;
+	} else {
+		revision.kind = svn_opt_revision_number;
+		revision.value.number = lua_tointeger (L, 2);
+	}
+
+	n = lua_objlen (L, 1);
+
+	session = init_function (&ctx, &pool, L);
+
+	subpool = svn_pool_create (pool);
+
+	lua_newtable (L);
+	lua_newtable (L);
+
+	for (i = 1; i <= n; i++) {
+		svn_opt_revision_t path_revision = revision;
+		svn_stringbuf_t *buffer;
+		svn_stream_t *stream;
+		const char *path;
+
+		svn_pool_clear (subpool);
+
+		lua_rawgeti (L, 1, i);
+		path = lua_tostring (L, -1);
+		if (path == NULL) {
+			lua_pop (L, 1);
+			continue;
+		}
+
+		path = svn_path_canonicalize (path, subpool);
+
+		buffer = svn_stringbuf_create ("", subpool);
+		stream = svn_stream_empty (subpool);
+		svn_stream_set_write (stream, write_fn);
+		svn_stream_set_baton (stream, buffer);
+
+		if (svn_path_is_url (path)) {
+			err = cat_many_url (session, &conn, &rev, &head, path, &revision, stream, buffer, subpool);
+
+			if (conn != NULL && !ra_reusable (err)) {
+				ra_release (session, conn, err);
+				conn = NULL;
+			}
+		} else {
+			if (path_revision.kind == svn_opt_revision_unspecified) {
+				path_revision.kind = get_revision_kind (path);
+			}
+
+			err = svn_client_cat2 (stream, path, &peg_revision, &path_revision, ctx, subpool);
+		}
+
+		if (err) {
+			char buf[256];
+
+			lua_pushstring (L, svn_err_best_message (err, buf, sizeof (buf)));
+			lua_settable (L, -3);
+			svn_error_clear (err);
+		} else {
+			lua_pushlstring (L, buffer->data, buffer->len);
+			lua_settable (L, -4);
+		}
+	}
+
+	if (conn != NULL) {
+		ra_release (session, conn, NULL);
+	}
+
+	svn_pool_destroy (pool);
+
+	return 2;
+}
+
+
+static int
+l_cat_cache (lua_State *L) {
+	session_t *session = get_session (L);
+	apr_pool_t *pool = svn_pool_create (session->pool);
+
+	lru_config (&session->cat_cache, 1, L, pool);
+
+	svn_pool_destroy (pool);
+
+	return 1;
+}
+
+
+#define CHUNK_SIZE 16384
+#define CHUNK_QUEUE_LEN 4
+
+
+/* Delivers the contents written to a stream to a Lua function, in chunks
+   of at most size bytes */
+typedef struct chunk_bt {
+	lua_State *L;
+	int ifunc;
+	char *data;
+	apr_size_t len;
+	apr_size_t size;
+	apr_size_t total;
+	svn_boolean_t stopped; /* the function returned false */
+	svn_boolean_t failed; /* the function raised an error, which is on the stack */
+} chunk_bt;
+
+
+/* Calls the Lua function of BATON with the chunk collected so far */
+static svn_error_t *
+chunk_flush (chunk_bt *baton) {
+	lua_State *L = baton->L;
+
+	if (baton->len == 0) {
+		return SVN_NO_ERROR;
+	}
+
+	lua_pushvalue (L, baton->ifunc);
+	lua_pushlstring (L, baton->data, baton->len);
+
+	baton->total += baton->len;
+	baton->len = 0;
+
+	if (lua_pcall (L, 1, 1, 0) != 0) {
+		baton->failed = TRUE;
+		return svn_error_create (SVN_ERR_CANCELLED, NULL, lua_tostring (L, -1));
+	}
+
+	if (lua_isboolean (L, -1) && !lua_toboolean (L, -1)) {
+		baton->stopped = TRUE;
+	}
+	lua_pop (L, 1);
+
+	if (baton->stopped) {
+		return svn_error_create (SVN_ERR_CEASE_INVOCATION, NULL, NULL);
+	}
+
+	return SVN_NO_ERROR;
+}
+
+
+static svn_error_t *
+chunk_write_fn (void *baton, const char *data, apr_size_t *len) {
+	chunk_bt *cb = baton;
+	apr_size_t left = *len;
+
+	while (left > 0) {
+		apr_size_t n = cb->size - cb->len;
+
+		if (n > left) {
+			n = left;
+		}
+
+		memcpy (cb->data + cb->len, data, n);
+		cb->len += n;
+		data += n;
+		left -= n;
+
+		if (cb->len == cb->size) {
+			SVN_ERR (chunk_flush (cb));
+		}
+	}
+
+	return SVN_NO_ERROR;
+}
+
+
+static int
+l_cat_stream (lua_State *L) {
+	apr_pool_t *pool;
+	svn_error_t *err;
+	svn_client_ctx_t *ctx;
+	session_t *session;
+
+	svn_stream_t *stream;
+	svn_opt_revision_t peg_revision;
+	svn_opt_revision_t revision;
+	chunk_bt baton;
+
+	const char *path = luaL_checkstring (L, 1);
+	int chunk_size = (lua_gettop (L) < 4 || lua_isnil (L, 4)) ? CHUNK_SIZE : luaL_checkint (L, 4);
+	peg_revision.kind = svn_opt_revision_unspecified;
+
+	if (lua_gettop (L) < 2 || lua_isnil (L, 2)) {
+		revision.kind = get_revision_kind (path);
+	} else {
+		revision.kind = svn_opt_revision_number;
+		revision.value.number = lua_tointeger (L, 2);
+	}
+
+	luaL_checktype (L, 3, LUA_TFUNCTION);
+	luaL_argcheck (L, chunk_size > 0, 4, "chunk size must be positive");
+
+	session = init_function (&ctx, &pool, L);
+
+	path = svn_path_canonicalize (path, pool);
+
+	baton.L = L;
+	baton.ifunc = 3;
+	baton.size = chunk_size;
+	baton.data = apr_palloc (pool, baton.size);
+	baton.len = 0;
+	baton.total = 0;
+	baton.stopped = FALSE;
+	baton.failed = FALSE;
+
+	stream = svn_stream_empty (pool);
+	svn_stream_set_write (stream, chunk_write_fn);
+	svn_stream_set_baton (stream, &baton);
+
+	if (svn_path_is_url (path)) {
+		err = cat_url (session, path, &revision, stream, NULL, pool);
+	} else {
+		err = svn_client_cat2 (stream, path, &peg_revision, &revision, ctx, pool);
+	}
+
+	if (!err && !baton.stopped) {
+		err = chunk_flush (&baton);
+	}
+
+	if (err && (baton.failed || baton.stopped)) {
+		svn_error_clear (err);
+		svn_pool_destroy (pool);
+		if (baton.failed) {
+			return lua_error (L);
+		}
+	} else {
+		IF_ERROR_RETURN (err, pool, L);
+		svn_pool_destroy (pool);
+	}
+
+	lua_pushinteger (L, baton.total);
+
+	return 1;
+}
+
+
+#if APR_HAS_THREADS
+
+#define CHUNK_QUEUE_MT "svn.chunk_queue"
+
+
+/* A bounded queue of chunks, filled by a thread reading the file with a
+   worker session and drained by the Lua iterator returned by cat_chunks.
+   The contents found in the cat cache are served without a thread */
+typedef struct chunk_queue_t {
+	apr_pool_t *pool;
+	apr_pool_t *thread_pool;
+	apr_thread_t *thread;
+	apr_thread_mutex_t *mutex;
+	apr_thread_cond_t *cond;
+	session_t *session; /* session the worker session is given back to */
+	session_t *worker; /* worker session used by the thread */
+	const char *path; /* working copy path, NULL for a URL */
+	svn_opt_revision_t revision;
+	const char *url; /* location of the URL in REV, see cat_resolve */
+	svn_revnum_t rev;
+	const char *key; /* key in the cat cache, NULL when disabled */
+	apr_size_t max_copy;
+	svn_stringbuf_t *copy; /* contents read for the cache, see cat_read */
+	char *contents; /* contents found in the cache */
+	apr_size_t contents_len;
+	apr_size_t offset; /* of the next chunk in CONTENTS */
+	char *chunks[CHUNK_QUEUE_LEN];
+	apr_size_t lens[CHUNK_QUEUE_LEN];
+	int first;
+	int count;
+	char *data; /* chunk being filled by the thread */
+	apr_size_t len;
+	apr_size_t size;
+	svn_boolean_t done;
+	svn_boolean_t cancelled;
+	char *error;
+} chunk_queue_t;
+
+
+/* Hands the chunk being filled to the iterator, waiting while the queue
+   is full. Fails if the iterator was collected meanwhile */
+static svn_error_t *
+chunk_queue_push (chunk_queue_t *q) {
+	svn_boolean_t cancelled;
+
+	if (q->len == 0) {
+		return SVN_NO_ERROR;
+	}
+
+	apr_thread_mutex_lock (q->mutex);
+
+	while (q->count == CHUNK_QUEUE_LEN && !q->cancelled) {
+		apr_thread_cond_wait (q->cond, q->mutex);
+	}
+
+	cancelled = q->cancelled;
+	if (!cancelled) {
+		int i = (q->first + q->count) % CHUNK_QUEUE_LEN;
+		q->chunks[i] = q->data;
+		q->lens[i] = q->len;
+		q->count++;
+		apr_thread_cond_broadcast (q->cond);
+	}
+
+	apr_thread_mutex_unlock (q->mutex);
+
+	if (cancelled) {
+		return svn_error_create (SVN_ERR_CANCELLED, NULL, NULL);
+	}
+
+	q->data = malloc (q->size);
+	q->len = 0;
+	if (q->data == NULL) {
+		return svn_error_create (APR_ENOMEM, NULL, NULL);
+	}
+
+	return SVN_NO_ERROR;
+}
+
+
+static svn_error_t *
+chunk_queue_write_fn (void *baton, const char *data, apr_size_t *len) {
+	chunk_queue_t *q = baton;
+	apr_size_t left = *len;
+
+	while (left > 0) {
+		apr_size_t n = q->size - q->len;
+
+		if (n > left) {
+			n = left;
+		}
+
+		memcpy (q->data + q->len, data, n);
+		q->len += n;
+		data += n;
+		left -= n;
+
+		if (q->len == q->size) {
+			SVN_ERR (chunk_queue_push (q));
+		}
+	}
+
+	return SVN_NO_ERROR;
+}
+
+
+static void * APR_THREAD_FUNC
+chunk_queue_thread (apr_thread_t *thread, void *data) {
+	chunk_queue_t *q = data;
+	svn_stream_t *stream;
+	svn_opt_revision_t peg_revision;
+	svn_stringbuf_t *copy = NULL;
+	ra_conn_t *conn;
+	svn_error_t *err;
+	char buf[256];
+
+	peg_revision.kind = svn_opt_revision_unspecified;
+
+	stream = svn_stream_empty (q->thread_pool);
+	svn_stream_set_write (stream, chunk_queue_write_fn);
+	svn_stream_set_baton (stream, q);
+
+	if (q->path != NULL) {
+		err = svn_client_cat2 (stream, q->path, &peg_revision, &q->revision,
+				q->worker->ctx, q->thread_pool);
+	} else {
+		err = ra_acquire (&conn, q->worker, q->url, q->thread_pool);
+
+		if (!err) {
+			err = cat_read (&copy, conn->ra, q->url, q->rev, stream, NULL,
+					q->max_copy, q->thread_pool);
+			ra_release (q->worker, conn, err);
+		}
+	}
+
+	if (!err) {
+		err = chunk_queue_push (q);
+	}
+
+	apr_thread_mutex_lock (q->mutex);
+	q->done = TRUE;
+	if (err && !q->cancelled) {
+		q->error = strdup (svn_err_best_message (err, buf, sizeof (buf)));
+	}
+	if (!err) {
+		q->copy = copy;
+	}
+	apr_thread_cond_broadcast (q->cond);
+	apr_thread_mutex_unlock (q->mutex);
+
+	svn_error_clear (err);
+
+	apr_thread_exit (thread, APR_SUCCESS);
+
+	return NULL;
+}
+
+
+/* Stops the thread of Q, if it is still running, and releases the queue.
+   The contents read whole are put in the cat cache of the session, and
+   the worker session is given back to it */
+static void
+chunk_queue_close (chunk_queue_t *q) {
+	apr_status_t status;
+
+	if (q->pool == NULL) {
+		return;
+	}
+
+	if (q->thread != NULL) {
+		apr_thread_mutex_lock (q->mutex);
+		q->cancelled = TRUE;
+		apr_thread_cond_broadcast (q->cond);
+		apr_thread_mutex_unlock (q->mutex);
+
+		apr_thread_join (&status, q->thread);
+	}
+
+	if (q->copy != NULL && q->session->pool != NULL) {
+		apr_pool_t *pool = svn_pool_create (q->session->pool);
+
+		lru_put (&q->session->cat_cache, q->key, q->copy->data, q->copy->len, pool);
+
+		svn_pool_destroy (pool);
+	}
+
+	if (q->worker != NULL) {
+		session_give_worker (q->session, q->worker);
+		q->worker = NULL;
+	}
+
+	while (q->count > 0) {
+		free (q->chunks[q->first]);
+		q->first = (q->first + 1) % CHUNK_QUEUE_LEN;
+		q->count--;
+	}
+
+	free (q->data);
+	free (q->error);
+	free (q->contents);
+	q->data = NULL;
+	q->error = NULL;
+	q->contents = NULL;
+
+	svn_pool_destroy (q->pool);
+	q->pool = NULL;
+}
+
+
+static int
+chunk_queue_gc (lua_State *L) {
+	chunk_queue_close (luaL_checkudata (L, 1, CHUNK_QUEUE_MT));
+	return 0;
+}
+
+
+/* The iterator returned by cat_chunks. Returns the next chunk, or nil
+   at the end of the file */
+static int
+chunk_queue_next (lua_State *L) {
+	chunk_queue_t *q = luaL_checkudata (L, lua_upvalueindex (1), CHUNK_QUEUE_MT);
+	char *chunk = NULL;
+	apr_size_t len = 0;
+
+	if (q->pool == NULL) {
+		return 0;
+	}
+
+	if (q->contents != NULL) {
+		len = q->contents_len - q->offset;
+		if (len > q->size) {
+			len = q->size;
+		}
+
+		if (len > 0) {
+			lua_pushlstring (L, q->contents + q->offset, len);
+			q->offset += len;
+			return 1;
+		}
+
+		chunk_queue_close (q);
+		return 0;
+	}
+
+	apr_thread_mutex_lock (q->mutex);
+
+	while (q->count == 0 && !q->done) {
+		apr_thread_cond_wait (q->cond, q->mutex);
+	}
+
+	if (q->count > 0) {
+		chunk = q->chunks[q->first];
+		len = q->lens[q->first];
+		q->first = (q->first + 1) % CHUNK_QUEUE_LEN;
+		q->count--;
+		apr_thread_cond_broadcast (q->cond);
+	}
+
+	apr_thread_mutex_unlock (q->mutex);
+
+	if (chunk != NULL) {
+		lua_pushlstring (L, chunk, len);
+		free (chunk);
+		return 1;
+	}
+
+	if (q->error != NULL) {
+		lua_pushstring (L, q->error);
+		chunk_queue_close (q);
+		return lua_error (L);
+	}
+
+	chunk_queue_close (q);
+
+	return 0;
+}
+
+
+static int
+l_cat_chunks (lua_State *L) {
+	apr_allocator_t *allocator;
+	apr_status_t status;
+	apr_pool_t *pool;
+	svn_error_t *err = SVN_NO_ERROR;
+	svn_client_ctx_t *ctx;
+	session_t *session;
+	ra_conn_t *conn = NULL;
+	cat_source_t src;
+	chunk_queue_t *q;
+
+	const char *path = luaL_checkstring (L, 1);
+	int chunk_size = (lua_gettop (L) < 3 || lua_isnil (L, 3)) ? CHUNK_SIZE : luaL_checkint (L, 3);
+	svn_opt_revision_t revision;
+
+	if (lua_gettop (L) < 2 || lua_isnil (L, 2)) {
+		revision.kind = get_revision_kind (path);
+	} else {
+		revision.kind = svn_opt_revision_number;
+		revision.value.number = lua_tointeger (L, 2);
+	}
+
+	luaL_argcheck (L, chunk_size > 0, 3, "chunk size must be positive");
+
+	session = init_function (&ctx, &pool, L);
+
+	path = svn_path_canonicalize (path, pool);
+
+	/* a URL is resolved and looked up in the cache here, since both
+	   use the session */
+	if (svn_path_is_url (path)) {
+		err = cat_resolve (&src, session, &conn, path, &revision, pool);
+		if (conn != NULL) {
+			ra_release (session, conn, err);
+		}
+		IF_ERROR_RETURN (err, pool, L);
+	}
+
+	q = lua_newuserdata (L, sizeof (chunk_queue_t));
+	memset (q, 0, sizeof (chunk_queue_t));
+	luaL_getmetatable (L, CHUNK_QUEUE_MT);
+	lua_setmetatable (L, -2);
+
+	if (apr_allocator_create (&allocator)) {
+		svn_pool_destroy (pool);
+		return send_error (L, "Error creating allocator\n");
+	}
+
+	/* not derived from the root pool, the thread must be joined before
+	   the pool is destroyed, whatever the order of collection is */
+	q->pool = svn_pool_create_ex (NULL, allocator);
+	apr_allocator_owner_set (allocator, q->pool);
+
+	q->session = session;
+	q->size = chunk_size;
+	q->revision = revision;
+
+	if (!svn_path_is_url (path)) {
+		q->path = apr_pstrdup (q->pool, path);
+	} else if (src.data != NULL) {
+		/* copied, since the cache may change before the end */
+		q->contents = malloc (src.len + 1);
+		if (q->contents == NULL) {
+			svn_pool_destroy (pool);
+			chunk_queue_close (q);
+			return send_error (L, "Out of memory\n");
+		}
+		memcpy (q->contents, src.data, src.len);
+		q->contents_len = src.len;
+	} else {
+		q->url = apr_pstrdup (q->pool, src.url);
+		q->rev = src.rev;
+		if (src.key != NULL) {
+			q->key = apr_pstrdup (q->pool, src.key);
+			q->max_copy = session->cat_cache.max_bytes;
+		}
+	}
+
+	if (q->contents == NULL) {
+		q->data = malloc (q->size);
+		err = session_take_worker (&q->worker, session);
+	}
+
+	if (err) {
+		chunk_queue_close (q);
+		IF_ERROR_RETURN (err, pool, L);
+	}
+
+	svn_pool_destroy (pool);
+
+	if (q->contents == NULL) {
+		/* from now on only the thread allocates from this pool */
+		q->thread_pool = svn_pool_create (q->pool);
+
+		status = apr_thread_mutex_create (&q->mutex, APR_THREAD_MUTEX_DEFAULT, q->pool);
+		if (status == APR_SUCCESS) {
+			status = apr_thread_cond_create (&q->cond, q->pool);
+		}
+		if (status == APR_SUCCESS && q->data != NULL) {
+			status = apr_thread_create (&q->thread, NULL, chunk_queue_thread, q, q->pool);
+		}
+
+		if (status != APR_SUCCESS || q->data == NULL) {
+			q->thread = NULL;
+			chunk_queue_close (q);
+			return send_error (L, "Error starting the cat thread\n");
+		}
+	}
+
+	push_session (L, session);
+	lua_pushcclosure (L, chunk_queue_next, 2);
+
+	return 1;
+}
+
+#else
+
+static int
+l_cat_chunks (lua_State *L) {
+	return send_error (L, "cat_chunks needs APR with thread support\n");
+}
+
+#endif
+
+
+static int
+l_checkout (lua_State *L) {
+	apr_pool_t *pool;
+	svn_error_t *err;
+	svn_client_ctx_t *ctx;
+
+	svn_opt_revision_t revision;
+	svn_opt_revision_t peg_revision;
+	svn_revnum_t rev;
+
+	const char *path = luaL_checkstring (L, 1);
+	const char *dir = luaL_checkstring (L, 2);
+	int itable = 4;
+	svn_boolean_t recursive = TRUE;
+	svn_boolean_t ignore_externals = FALSE;
+	peg_revision.kind = svn_opt_revision_unspecified;
+
+	if (lua_gettop (L) < 3 || lua_isnil (L, 3)) {
+		revision.kind = svn_opt_revision_head;	
+	} else {
+		revision.kind = svn_opt_revision_number;
+		revision.value.number = lua_tointeger (L, 3);
+	}
+	
+	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
+		lua_getfield (L, itable, "recursive");
+		if (lua_isboolean (L, -1)) {
+			recursive = lua_toboolean (L, -1);
+		}
+
+		lua_getfield (L, itable, "ignore_externals");
+		if (lua_isboolean (L, -1)) {
+			ignore_externals = lua_toboolean (L, -1);
+		}
+	} 
+
+	init_function (&ctx, &pool, L);
+
+	path = svn_path_canonicalize (path, pool);
+	dir = svn_path_canonicalize (dir, pool);
+	
+	err = svn_client_checkout2 (&rev, path, dir, &peg_revision, &revision, recursive, ignore_externals, ctx, pool);
+	IF_ERROR_RETURN (err, pool, L);
+	
+	lua_pushinteger (L, rev);
+
+	svn_pool_destroy (pool);
+
+	return 1;
+}
+
+
+static int
+l_cleanup (lua_State *L) {
+	apr_pool_t *pool;
+	svn_error_t *err;
+	svn_client_ctx_t *ctx;
+
+	const char *path = (lua_gettop (L) < 1 || lua_isnil (L, 1)) ? "" : luaL_checkstring (L, 1);
+
+	init_function (&ctx, &pool, L);
+	
+	path = svn_path_canonicalize (path, pool);
+
+	err = svn_client_cleanup (path, ctx, pool);
+	IF_ERROR_RETURN (err, pool, L);
+	
+	svn_pool_destroy (pool);
+
+	return 0;
+}
+
+
+static int
+l_commit (lua_State *L) {
+	apr_pool_t *pool;
+	svn_error_t *err;
+	svn_client_ctx_t *ctx;
+	session_t *session;
+
+	apr_array_header_t *array;
+
+	const char *path = (lua_gettop (L) < 1 || lua_isnil (L, 1)) ? "" : luaL_checkstring (L, 1);
+	const char *message = (lua_gettop (L) < 2 || lua_isnil (L, 2)) ? "" : luaL_checkstring (L, 2);
+	int itable = 3;
+	svn_boolean_t recursive = TRUE;
+	svn_boolean_t keep_locks = FALSE;
+	svn_commit_info_t *commit_info = NULL;
+	
+	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
+		lua_getfield (L, itable, "recursive");
+		if (lua_isboolean (L, -1)) {
+			recursive = lua_toboolean (L, -1);
+		}
+
+		lua_getfield (L, itable, "keep_locks");
+		if (lua_isboolean (L, -1)) {
+			keep_locks = lua_toboolean (L, -1);
+		}
+	} 
+
+	session = init_function (&ctx, &pool, L);
+
+	path = svn_path_canonicalize (path, pool);
+
+	array = apr_array_make (pool, 1, sizeof (const char *));
+	(*((const char **) apr_array_push (array))) = path;
+
+	make_log_msg_baton (&(ctx->log_msg_baton2), message, path, ctx->config, pool, L);
+	
+	ctx->log_msg_func2 = log_msg_func2;
+
+	err = svn_client_commit3 (&commit_info, array, recursive, keep_locks, ctx, pool);
+	IF_ERROR_RETURN (err, pool, L);	
+
+	if (commit_info == NULL) {
+		lua_pushnil (L);
+	} else {
+		ra_heads_expire (session);
+		lua_pushinteger (L, commit_info->revision);
+	}
+
+	svn_pool_destroy (pool);
+
+	return 1;
+}
+
+
+static int
+l_copy (lua_State *L) {
+	apr_pool_t *pool;
+	svn_error_t *err;
+	svn_client_ctx_t *ctx;
+	session_t *session;
+
+	svn_opt_revision_t revision;
+
+	const char *src_path = luaL_checkstring (L, 1);
+	const char *dest_path = luaL_checkstring (L, 2);
+	const char *message = NULL;
+	svn_commit_info_t *commit_info = NULL;
+
+	if (lua_gettop (L) < 3 || lua_isnil (L, 3)) {
+		revision.kind = svn_opt_revision_unspecified;
+	} else {
+		revision.kind = svn_opt_revision_number;
+		revision.value.number = lua_tointeger (L, 3);
+	}
+
+	message = (lua_gettop (L) < 4 || lua_isnil (L, 4)) ? "" : luaL_checkstring (L, 4);
+
+	session = init_function (&ctx, &pool, L);
+
+	src_path = svn_path_canonicalize (src_path, pool);
+	dest_path = svn_path_canonicalize (dest_path, pool);
+
+	if (svn_path_is_url (dest_path)) {
+		make_log_msg_baton (&(ctx->log_msg_baton2), message, NULL, ctx->config, pool, L);
+		ctx->log_msg_func2 = log_msg_func2;
+	}
+
+	err = svn_client_copy3 (&commit_info, src_path, &revision, dest_path, ctx, pool);
+	IF_ERROR_RETURN (err, pool, L);	
+
+	if (commit_info == NULL) {
+		lua_pushnil (L);
+	} else {
+		ra_heads_expire (session);
+		lua_pushinteger (L, commit_info->revision);
+	}
+
+	svn_pool_destroy (pool);
+
+	return 1;
+}
+
+
+static int
+l_delete (lua_State *L) {
+	apr_pool_t *pool;
+	svn_error_t *err;
+	svn_client_ctx_t *ctx;
+	session_t *session;
+
+	apr_array_header_t *array;
+	
+	const char *path = luaL_checkstring (L, 1);
+	const char *message = (lua_gettop (L) < 2 || lua_isnil (L, 2)) ? "" : luaL_checkstring (L, 2);
+	int itable = 3;
+	svn_boolean_t force = FALSE;
+	svn_commit_info_t *commit_info = NULL;
+
+	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
+		lua_getfield (L, itable, "force");
+		if (lua_isboolean (L, -1)) {
+			force = lua_toboolean (L, -1);
+		}
+	} 
+
+	session = init_function (&ctx, &pool, L);
+
+	path = svn_path_canonicalize (path, pool);
+
+	array = apr_array_make (pool, 1, sizeof (const char *));
+	(*((const char **) apr_array_push (array))) = path;
+
+	lua_newtable (L);
+
+	if (svn_path_is_url (path)) {
+		make_log_msg_baton (&(ctx->log_msg_baton2), message, NULL, ctx->config, pool, L);
+		ctx->log_msg_func2 = log_msg_func2;
+	}
+
+	err = svn_client_delete2 (&commit_info, array, force, ctx, pool);
+	IF_ERROR_RETURN (err, pool, L);
+
+	if (commit_info == NULL) {
+		lua_pushnil (L);
+	} else {
+		ra_heads_expire (session);
+		lua_pushinteger (L, commit_info->revision);
+	}
+	
+	svn_pool_destroy (pool);
+
+	return 1;
+}
+
+
+#if APR_HAS_THREADS
+
+/* A diff written by a thread into a pipe, which the Lua thread reads */
+typedef struct diff_pipe_t {
+	apr_pool_t *pool;
+	apr_pool_t *thread_pool;
+	apr_thread_t *thread;
+	apr_thread_mutex_t *mutex;
+	session_t *worker; /* worker session used by the thread */
+	apr_file_t *in;
+	apr_file_t *out;
+	apr_file_t *err;
+	apr_array_header_t *options;
+	const char *path1;
+	const char *path2;
+	svn_opt_revision_t rev1;
+	svn_opt_revision_t rev2;
+	svn_boolean_t recursive;
+	svn_boolean_t ignore_ancestry;
+	svn_boolean_t no_diff_deleted;
+	svn_boolean_t force;
+	svn_boolean_t cancelled; /* the output is no longer wanted */
+	char *error;
+} diff_pipe_t;
+
+
+static svn_error_t *
+diff_pipe_cancel (void *baton) {
+	diff_pipe_t *d = baton;
+	svn_boolean_t cancelled;
+
+	apr_thread_mutex_lock (d->mutex);
+	cancelled = d->cancelled;
+	apr_thread_mutex_unlock (d->mutex);
+
+	if (cancelled) {
+		return svn_error_create (SVN_ERR_CANCELLED, NULL, NULL);
+	}
+
+	return SVN_NO_ERROR;
+}
+
+
+static void * APR_THREAD_FUNC
+diff_pipe_thread (apr_thread_t *thread, void *data) {
+	diff_pipe_t *d = data;
+	svn_client_ctx_t *ctx;
+	svn_error_t *err;
+	char buf[256];
+
+	/* the context of the worker session is kept as it is for the next use */
+	ctx = apr_pmemdup (d->thread_pool, d->worker->ctx, sizeof (svn_client_ctx_t));
+	ctx->cancel_func = diff_pipe_cancel;
+	ctx->cancel_baton = d;
+
+	err = svn_client_diff3 (d->options, d->path1, &d->rev1, d->path2, &d->rev2,
+			d->recursive, d->ignore_ancestry, d->no_diff_deleted, d->force,
+			APR_LOCALE_CHARSET, d->out, d->err, ctx, d->thread_pool);
+
+	if (err && err->apr_err != SVN_ERR_CANCELLED) {
+		d->error = strdup (svn_err_best_message (err, buf, sizeof (buf)));
+	}
+
+	svn_error_clear (err);
+
+	/* the Lua thread reads until the end of the pipe */
+	apr_file_close (d->out);
+
+	apr_thread_exit (thread, APR_SUCCESS);
+
+	return NULL;
+}
+
+
+/* Runs the diff described by D on a thread, and passes its output to
+   the Lua function at IFUNC, in chunks, or returns it as a string when
+   IFUNC is 0. The output goes through a pipe, never through a file. The
+   svn_client_diff3 of this version of Subversion only writes to an
+   apr_file_t, so the thread is what turns it into a stream */
+static int
+diff_pipe_run (lua_State *L, diff_pipe_t *d, int ifunc, const char *errfile) {
+	apr_allocator_t *allocator;
+	apr_status_t status;
+	svn_error_t *err;
+	session_t *session;
+	chunk_bt baton;
+	luaL_Buffer buffer;
+
+	session = get_session (L);
+
+	if (apr_allocator_create (&allocator)) {
+		return send_error (L, "Error creating allocator\n");
+	}
+
+	/* not derived from the root pool, see cat_chunks */
+	d->pool = svn_pool_create_ex (NULL, allocator);
+	apr_allocator_owner_set (allocator, d->pool);
+
+	err = session_take_worker (&d->worker, session);
+	IF_ERROR_RETURN (err, d->pool, L);
+
+	d->path1 = svn_path_canonicalize (d->path1, d->pool);
+	d->path2 = svn_path_canonicalize (d->path2, d->pool);
+	d->options = apr_array_make (d->pool, 0, sizeof (const char *));
+
+	memset (&baton, 0, sizeof (baton));
+	baton.L = L;
+	baton.ifunc = ifunc;
+	baton.size = CHUNK_SIZE;
+	baton.data = apr_palloc (d->pool, baton.size);
+
+	/* from now on only the thread allocates from this pool */
+	d->thread_pool = svn_pool_create (d->pool);
+
+	status = apr_thread_mutex_create (&d->mutex, APR_THREAD_MUTEX_DEFAULT, d->pool);
+
+	if (status == APR_SUCCESS) {
+		status = apr_file_pipe_create (&d->in, &d->out, d->thread_pool);
+	}
+
+	if (status == APR_SUCCESS) {
+		if (errfile) {
+			status = apr_file_open (&d->err, errfile, APR_READ | APR_WRITE | APR_CREATE,
+					APR_OS_DEFAULT, d->thread_pool);
+		} else {
+			status = apr_file_open_stderr (&d->err, d->thread_pool);
+		}
+	}
+
+	if (status == APR_SUCCESS) {
+		status = apr_thread_create (&d->thread, NULL, diff_pipe_thread, d, d->pool);
+	}
+
+	if (status != APR_SUCCESS) {
+		session_give_worker (session, d->worker);
+		svn_pool_destroy (d->pool);
+		return send_error (L, "Error starting the diff thread\n");
+	}
+
+	/* the string is built on the stack while it is read */
+	if (!ifunc) {
+		luaL_buffinit (L, &buffer);
+	}
+
+	/* Once the function failed or stopped, the rest of the output is
+	   still read, so that the thread never blocks on a full pipe, until
+	   it notices it was cancelled */
+	for (;;) {
+		apr_size_t len;
+		char *data;
+
+		if (ifunc) {
+			data = baton.data + baton.len;
+			len = baton.size - baton.len;
+		} else {
+			data = luaL_prepbuffer (&buffer);
+			len = LUAL_BUFFERSIZE;
+		}
+
+		status = apr_file_read (d->in, data, &len);
+
+		if (baton.failed || baton.stopped) {
+			len = 0;
+		}
+
+		if (ifunc) {
+			baton.len += len;
+			if (baton.len == baton.size) {
+				svn_error_clear (chunk_flush (&baton));
+			}
+		} else {
+			luaL_addsize (&buffer, len);
+		}
+
+		if (baton.failed || baton.stopped) {
+			baton.len = 0;
+			apr_thread_mutex_lock (d->mutex);
+			d->cancelled = TRUE;
+			apr_thread_mutex_unlock (d->mutex);
+		}
+
+		if (status != APR_SUCCESS && !APR_STATUS_IS_EINTR (status)) {
+			break;
+		}
+	}
+
+	apr_thread_join (&status, d->thread);
+
+	session_give_worker (session, d->worker);
+
+	if (!ifunc) {
+		luaL_pushresult (&buffer);
+		if (d->error != NULL) {
+			lua_pop (L, 1);
+		}
+	}
+
+	if (!d->error && ifunc && !baton.failed && !baton.stopped) {
+		svn_error_clear (chunk_flush (&baton));
+	}
+
+	if (!baton.failed && d->error != NULL) {
+		lua_pushstring (L, d->error);
+		baton.failed = TRUE;
+	} else if (!baton.failed && ifunc) {
+		lua_pushinteger (L, baton.total);
+	}
+
+	free (d->error);
+	svn_pool_destroy (d->pool);
+
+	if (baton.failed) {
+		return lua_error (L);
+	}
+
+	return 1;
+}
+
+#endif
+
+
+static int
+l_diff (lua_State *L) {
+	apr_pool_t *pool;
+	svn_error_t *err;
+	svn_client_ctx_t *ctx;
+
+	apr_file_t *aprout;
+	apr_file_t *aprerr;
+	apr_status_t status;
+	apr_array_header_t *array;
+	svn_opt_revision_t rev1;
+	svn_opt_revision_t rev2;
+
+	const char *path1 = NULL;
+	const char *path2 = NULL;
+	const char *outfile = NULL;	
+	const char *errfile = NULL;
+	int itable = 7;
+	svn_boolean_t recursive = TRUE;
+	svn_boolean_t ignore_ancestry = TRUE;
+	svn_boolean_t no_diff_deleted = FALSE;
+	svn_boolean_t force = FALSE;
+	svn_boolean_t as_string = FALSE;
+	int ifunc = 0;
+	
+	path1 = (lua_gettop (L) < 1 || lua_isnil (L, 1)) ? "" : luaL_checkstring (L, 1);
+		
+	if (lua_gettop (L) < 2 || lua_isnil (L, 2)) {
+		rev1.kind = get_revision_kind (path1);
+	} else {
+		rev1.kind = svn_opt_revision_number;
+		rev1.value.number = lua_tointeger (L, 2);
+	}
+	
+	path2 = (lua_gettop (L) < 3 || lua_isnil (L, 3)) ? path1 : luaL_checkstring (L, 3);
+
+	if (lua_gettop (L) < 4 || lua_isnil (L, 4)) {
+		if (svn_path_is_url (path2)) {
+			rev2.kind = svn_opt_revision_head;
+		} else {
+			rev2.kind = svn_opt_revision_working;
+		}
+	} else {
+		rev2.kind = svn_opt_revision_number;
+		rev2.value.number = lua_tointeger (L, 4);
+	}
+
+	if (lua_gettop (L) >= 5 && lua_isfunction (L, 5)) {
+		ifunc = 5;
+	} else {
+		outfile = (lua_gettop (L) < 5 || lua_isnil (L, 5)) ? NULL : luaL_checkstring (L, 5);
+	}
+	
+	errfile = (lua_gettop (L) < 6 || lua_isnil (L, 6)) ? NULL : luaL_checkstring (L, 6);
+	
+	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
+		lua_getfield (L, itable, "recursive");
+		if (lua_isboolean (L, -1)) {
+			recursive = lua_toboolean (L, -1);
+		}
+
+		lua_getfield (L, itable, "ignore_ancestry");
+		if (lua_isboolean (L, -1)) {
+			ignore_ancestry = lua_toboolean (L, -1);
+		}
+		
+		lua_getfield (L, itable, "no_diff_deleted");
+		if (lua_isboolean (L, -1)) {
+			no_diff_deleted = lua_toboolean (L, -1);
+		}
+		
+		lua_getfield (L, itable, "force");
+		if (lua_isboolean (L, -1)) {
+			force = lua_toboolean (L, -1);
+		}
+
+		lua_getfield (L, itable, "as_string");
+		if (lua_isboolean (L, -1)) {
+			as_string = lua_toboolean (L, -1);
+		}
+	} 
+
+	luaL_argcheck (L, !as_string || !outfile, 5,
+			"as_string can not be used with an output file");
+
+	if (ifunc || (as_string && !outfile)) {
+#if APR_HAS_THREADS
+		diff_pipe_t d;
+
+		memset (&d, 0, sizeof (d));
+		d.path1 = path1;
+		d.path2 = path2;
+		d.rev1 = rev1;
+		d.rev2 = rev2;
+		d.recursive = recursive;
+		d.ignore_ancestry = ignore_ancestry;
+		d.no_diff_deleted = no_diff_deleted;
+		d.force = force;
+
+		return diff_pipe_run (L, &d, ifunc, errfile);
+#else
+		return send_error (L, "diff to Lua needs APR with thread support\n");
+#endif
+	}
+
+	init_function (&ctx, &pool, L);
+
+	path1 = svn_path_canonicalize (path1, pool);
+	path2 = svn_path_canonicalize (path2, pool);
+
+	if (outfile) {
+		status = apr_file_open (&aprout, outfile, APR_READ | APR_WRITE | APR_CREATE,
+				                APR_OS_DEFAULT, pool);
+	} else {
+		status = apr_file_open_stdout(&aprout, pool);
+	}
+	if (status) {
+		IF_ERROR_RETURN (svn_error_wrap_apr(status, "Can't open output file"), pool, L);
+	}
+
+	if (errfile) {
+		status = apr_file_open (&aprerr, errfile, APR_READ | APR_WRITE | APR_CREATE,
+				                APR_OS_DEFAULT, pool);
+	} else {
+		status = apr_file_open_stderr(&aprerr, pool);
+	}
+	if (status) {
+		IF_ERROR_RETURN (svn_error_wrap_apr(status, "Can't open error file"), pool , L);
+	}
+
+	array = apr_array_make (pool, 0, sizeof (const char *));
+
+	err = svn_client_diff3 (array, path1, &rev1, path2, &rev2,
+			                recursive, ignore_ancestry, no_diff_deleted, force,
+							APR_LOCALE_CHARSET, aprout, aprerr,
+							ctx, pool);
+	IF_ERROR_RETURN (err, pool, L);	
+
+	svn_pool_destroy (pool);
+
+	return 0;
+}
+
+
+/* Collects the paths reported by svn_client_diff_summarize in a table */
+typedef struct diff_summary_bt {
+	lua_State *L;
+	int n;
+} diff_summary_bt;
+
+
+static svn_error_t *
+diff_summary_func (const svn_client_diff_summarize_t *diff, void *baton, apr_pool_t *pool) {
+	diff_summary_bt *bt = baton;
+	lua_State *L = bt->L;
+	const char *kind;
+
+	switch (diff->summarize_kind) {
+		case svn_client_diff_summarize_kind_added:
+			kind = "added";
+			break;
+		case svn_client_diff_summarize_kind_modified:
+			kind = "modified";
+			break;
+		case svn_client_diff_summarize_kind_deleted:
+			kind = "deleted";
+			break;
+		default:
+			/* a path is only reported unchanged when its properties changed */
+			kind = diff->prop_changed ? "props" : "normal";
+			break;
+	}
+
+	lua_createtable (L, 0, 4);
+
+	lua_pushstring (L, diff->path);
+	lua_setfield (L, -2, "path");
+
+	lua_pushstring (L, kind);
+	lua_setfield (L, -2, "kind");
+
+	lua_pushstring (L, svn_node_kind_to_word (diff->node_kind));
+	lua_setfield (L, -2, "node_kind");
+
+	lua_pushboolean (L, diff->prop_changed);
+	lua_setfield (L, -2, "props_changed");
+
+	lua_rawseti (L, -2, ++bt->n);
+
+	return SVN_NO_ERROR;
+}
+
+
+/* Lists the paths that differ between two trees, and how, without
+   transferring the contents of the files */
+static int
+l_diff_summary (lua_State *L) {
+	apr_pool_t *pool;
+	svn_error_t *err;
+	svn_client_ctx_t *ctx;
+
+	svn_opt_revision_t rev1;
+	svn_opt_revision_t rev2;
+	diff_summary_bt baton;
+
+	const char *path1 = NULL;
+	const char *path2 = NULL;
+	int itable = 5;
+	svn_boolean_t recursive = TRUE;
+	svn_boolean_t ignore_ancestry = TRUE;
+
+	path1 = (lua_gettop (L) < 1 || lua_isnil (L, 1)) ? "" : luaL_checkstring (L, 1);
+
+	if (lua_gettop (L) < 2 || lua_isnil (L, 2)) {
+		rev1.kind = get_revision_kind (path1);
+	} else {
+		rev1.kind = svn_opt_revision_number;
+		rev1.value.number = lua_tointeger (L, 2);
+	}
+
+	path2 = (lua_gettop (L) < 3 || lua_isnil (L, 3)) ? path1 : luaL_checkstring (L, 3);
+
+	if (lua_gettop (L) < 4 || lua_isnil (L, 4)) {
+		if (svn_path_is_url (path2)) {
+			rev2.kind = svn_opt_revision_head;
+		} else {
+			rev2.kind = svn_opt_revision_working;
+		}
+	} else {
+		rev2.kind = svn_opt_revision_number;
+		rev2.value.number = lua_tointeger (L, 4);
+	}
+
+	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
+		lua_getfield (L, itable, "recursive");
+		if (lua_isboolean (L, -1)) {
+			recursive = lua_toboolean (L, -1);
+		}
+
+		lua_getfield (L, itable, "ignore_ancestry");
+		if (lua_isboolean (L, -1)) {
+			ignore_ancestry = lua_toboolean (L, -1);
+		}
+	}
+
+	init_function (&ctx, &pool, L);
+
+	path1 = svn_path_canonicalize (path1, pool);
+	path2 = svn_path_canonicalize (path2, pool);
+
+	lua_newtable (L);
+
+	baton.L = L;
+	baton.n = 0;
+
+	err = svn_client_diff_summarize (path1, &rev1, path2, &rev2,
+			recursive, ignore_ancestry, diff_summary_func, &baton, ctx, pool);
+	IF_ERROR_RETURN (err, pool, L);
+
+	svn_pool_destroy (pool);
+
+	return 1;
+}
+
+
+/* Rebuilds every revision of a file from the deltas sent by
+   svn_ra_get_file_revs, and calls a Lua function with each of them.
+   The previous content and the one being built live in two pools that
+   are used alternately, so only two revisions are in memory at once.
+   The deltas are between untranslated contents, so the properties of
+   the file are tracked too, to translate each revision like cat */
+typedef struct file_rev_bt {
+	lua_State *L;
+	int ifunc;
+	int date_format;
+	apr_pool_t *pool;
+	apr_pool_t *pools[2];
+	int spare; /* index of the pool that does not hold content */
+	svn_stringbuf_t *content; /* previous revision */
+	svn_stringbuf_t *next; /* revision being built */
+	apr_hash_t *props; /* properties of the current revision */
+	const char *root; /* URL of the root of the repository */
+	const char *path; /* path of the file in the current revision */
+	svn_revnum_t rev;
+	const char *author;
+	const char *date;
+	svn_txdelta_window_handler_t apply;
+	void *apply_baton;
+	int count;
+	svn_boolean_t stopped; /* the function returned false */
+	svn_boolean_t failed; /* the function raised an error, which is on the stack */
+} file_rev_bt;
+
+
+/* Sets CONTENT to the current revision of FB, translated */
+static svn_error_t *
+file_rev_translate (svn_stringbuf_t **content, file_rev_bt *fb, apr_pool_t *pool) {
+	svn_stringbuf_t *translated = svn_stringbuf_create ("", pool);
+	svn_stream_t *out = svn_stream_from_stringbuf (translated, pool);
+	svn_stream_t *stream;
+	apr_size_t len = fb->content->len;
+
+	*content = fb->content;
+
+	SVN_ERR (subst_stream (&stream, out, fb->props,
+				svn_path_url_add_component (fb->root, fb->path + 1, pool),
+				apr_psprintf (pool, "%ld", fb->rev), fb->date, fb->author, pool));
+
+	if (stream == out) {
+		return SVN_NO_ERROR;
+	}
+
+	SVN_ERR (svn_stream_write (stream, fb->content->data, &len));
+	SVN_ERR (svn_stream_close (stream));
+
+	*content = translated;
+
+	return SVN_NO_ERROR;
+}
+
+
+/* Calls the Lua function of BATON with the current revision */
+static svn_error_t *
+file_rev_call (file_rev_bt *baton) {
+	lua_State *L = baton->L;
+	apr_pool_t *subpool;
+	svn_stringbuf_t *content;
+	apr_time_t when;
+	svn_error_t *err;
+
+	subpool = svn_pool_create (baton->pool);
+
+	err = file_rev_translate (&content, baton, subpool);
+	if (err) {
+		svn_pool_destroy (subpool);
+		return err;
+	}
+
+	lua_pushvalue (L, baton->ifunc);
+	lua_pushinteger (L, baton->rev);
+
+	if (baton->author) {
+		lua_pushstring (L, baton->author);
+	} else {
+		lua_pushnil (L);
+	}
+
+	if (baton->date == NULL) {
+		lua_pushnil (L);
+	} else if (baton->date_format == DATE_STRING) {
+		lua_pushstring (L, baton->date);
+	} else {
+		err = svn_time_from_cstring (&when, baton->date, subpool);
+
+		if (err) {
+			svn_error_clear (err);
+			lua_pushstring (L, baton->date);
+		} else {
+			push_date (L, when, baton->date_format);
+		}
+	}
+
+	lua_pushlstring (L, content->data, content->len);
+
+	svn_pool_destroy (subpool);
+
+	baton->count++;
+
+	if (lua_pcall (L, 4, 1, 0) != 0) {
+		baton->failed = TRUE;
+		return svn_error_create (SVN_ERR_CANCELLED, NULL, lua_tostring (L, -1));
+	}
+
+	if (lua_isboolean (L, -1) && !lua_toboolean (L, -1)) {
+		baton->stopped = TRUE;
+	}
+	lua_pop (L, 1);
+
+	if (baton->stopped) {
+		return svn_error_create (SVN_ERR_CEASE_INVOCATION, NULL, NULL);
+	}
+
+	return SVN_NO_ERROR;
+}
+
+
+static svn_error_t *
+file_rev_window (svn_txdelta_window_t *window, void *baton) {
+	file_rev_bt *fb = baton;
+
+	SVN_ERR (fb->apply (window, fb->apply_baton));
+
+	if (window != NULL) {
+		return SVN_NO_ERROR;
+	}
+
+	/* the new revision is complete, and the previous one is not needed */
+	svn_pool_clear (fb->pools[fb->spare ^ 1]);
+	fb->content = fb->next;
+	fb->spare ^= 1;
+
+	return file_rev_call (fb);
+}
+
+
+static svn_error_t *
+file_rev_handler (void *baton,
+                  const char *path,
+                  svn_revnum_t rev,
+                  apr_hash_t *rev_props,
+                  svn_txdelta_window_handler_t *delta_handler,
+                  void **delta_baton,
+                  apr_array_header_t *prop_diffs,
+                  apr_pool_t *pool)
+{
+	file_rev_bt *fb = baton;
+	apr_pool_t *subpool = fb->pools[fb->spare];
+	svn_string_t *value;
+	int i;
+
+	svn_pool_clear (subpool);
+
+	fb->rev = rev;
+	fb->path = apr_pstrdup (subpool, path);
+	fb->author = NULL;
+	fb->date = NULL;
+
+	for (i = 0; prop_diffs != NULL && i < prop_diffs->nelts; i++) {
+		const svn_prop_t *prop = &APR_ARRAY_IDX (prop_diffs, i, svn_prop_t);
+
+		apr_hash_set (fb->props, apr_pstrdup (fb->pool, prop->name), APR_HASH_KEY_STRING,
+				prop->value ? svn_string_dup (prop->value, fb->pool) : NULL);
+	}
+
+	if (rev_props != NULL) {
+		value = apr_hash_get (rev_props, SVN_PROP_REVISION_AUTHOR, APR_HASH_KEY_STRING);
+		if (value) {
+			fb->author = apr_pstrmemdup (subpool, value->data, value->len);
+		}
+
+		value = apr_hash_get (rev_props, SVN_PROP_REVISION_DATE, APR_HASH_KEY_STRING);
+		if (value) {
+			fb->date = apr_pstrmemdup (subpool, value->data, value->len);
+		}
+	}
+
+	/* only the properties changed */
+	if (delta_handler == NULL) {
+		return file_rev_call (fb);
+	}
+
+	fb->next = svn_stringbuf_create ("", subpool);
+
+	svn_txdelta_apply (svn_stream_from_stringbuf (fb->content, subpool),
+			svn_stream_from_stringbuf (fb->next, subpool),
+			NULL, NULL, subpool, &fb->apply, &fb->apply_baton);
+
+	*delta_handler = file_rev_window;
+	*delta_baton = fb;
+
+	return SVN_NO_ERROR;
+}
+
+
+static int
+l_file_revisions (lua_State *L) {
+	apr_pool_t *pool;
+	svn_error_t *err;
+	svn_client_ctx_t *ctx;
+	session_t *session;
+
+	svn_opt_revision_t start, end;
+	svn_revnum_t start_rev, end_rev;
+	svn_revnum_t head = SVN_INVALID_REVNUM;
+	ra_conn_t *conn;
+	file_rev_bt baton;
+	const char *url;
+
+	const char *path = luaL_checkstring (L, 1);
+	start.kind = svn_opt_revision_number;
+	end.kind = svn_opt_revision_head;
+
+	if (lua_gettop (L) < 2 || lua_isnil (L, 2)) {
+		start.value.number = 0;
+	} else {
+		start.value.number = lua_tointeger (L, 2);
+	}
+
+	if (lua_gettop (L) >= 3 && !lua_isnil (L, 3)) {
+		end.kind = svn_opt_revision_number;
+		end.value.number = lua_tointeger (L, 3);
+	}
+
+	luaL_checktype (L, 4, LUA_TFUNCTION);
+
+	baton.date_format = get_date_format (L, 5);
+
+	session = init_function (&ctx, &pool, L);
+
+	path = svn_path_canonicalize (path, pool);
+
+	if (svn_path_is_url (path)) {
+		url = path;
+	} else {
+		err = svn_client_url_from_path (&url, path, pool);
+		IF_ERROR_RETURN (err, pool, L);
+
+		if (url == NULL) {
+			err = svn_error_createf (SVN_ERR_ENTRY_MISSING_URL, NULL,
+					"'%s' has no URL", path);
+			IF_ERROR_RETURN (err, pool, L);
+		}
+	}
+
+	baton.L = L;
+	baton.ifunc = 4;
+	baton.pool = pool;
+	baton.pools[0] = svn_pool_create (pool);
+	baton.pools[1] = svn_pool_create (pool);
+	baton.spare = 0;
+	baton.content = svn_stringbuf_create ("", pool);
+	baton.props = apr_hash_make (pool);
+	baton.count = 0;
+	baton.stopped = FALSE;
+	baton.failed = FALSE;
+
+	err = ra_acquire (&conn, session, url, pool);
+	IF_ERROR_RETURN (err, pool, L);
+
+	baton.root = conn->root;
+
+	err = ra_revnum (&start_rev, conn->ra, &start, pool);
+
+	if (!err) {
+		err = ra_revnum (&end_rev, conn->ra, &end, pool);
+	}
+
+	/* URL is taken in HEAD, and its history is followed back from where
+	   it was in END_REV */
+	if (!err) {
+		err = ra_trace (&url, &head, session, &conn, url, end_rev, pool);
+	}
+
+	if (!err) {
+		err = svn_ra_get_file_revs (conn->ra, "", start_rev, end_rev,
+				file_rev_handler, &baton, pool);
+	}
+
+	ra_release (session, conn, err);
+
+	if (err && (baton.failed || baton.stopped)) {
+		svn_error_clear (err);
+		svn_pool_destroy (pool);
+		if (baton.failed) {
+			return lua_error (L);
+		}
+	} else {
+		IF_ERROR_RETURN (err, pool, L);
+		svn_pool_destroy (pool);
+	}
+
+	lua_pushinteger (L, baton.count);
+
+	return 1;
+}
+
+
+static int
+l_import (lua_State *L) {
+	apr_pool_t *pool;
+	svn_error_t *err;
+	svn_client_ctx_t *ctx;
+	session_t *session;
+	
+	const char *path = lua_isnil (L, 1) ? "" : luaL_checkstring (L, 1);
+	const char *url = luaL_checkstring (L, 2);
+	const char *message = (lua_gettop (L) < 3 || lua_isnil (L, 3)) ? "" : luaL_checkstring (L, 3);
+	int itable = 4;
+	svn_boolean_t recursive = TRUE;
+	svn_boolean_t no_ignore = FALSE;
+	svn_commit_info_t *commit_info = NULL;
+	
+	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
+		lua_getfield (L, itable, "recursive");
+		if (lua_isboolean (L, -1)) {
+			recursive = lua_toboolean (L, -1);
+		}
+
+		lua_getfield (L, itable, "no_ignore");
+		if (lua_isboolean (L, -1)) {
+			no_ignore = lua_toboolean (L, -1);
+		}
+	} 
+
+	session = init_function (&ctx, &pool, L);
+
+	path = svn_path_canonicalize (path, pool);
+	url = svn_path_canonicalize (url, pool);
+
+	make_log_msg_baton (&(ctx->log_msg_baton2), message, NULL, ctx->config, pool, L);
+	ctx->log_msg_func2 = log_msg_func2;
+
+	err = svn_client_import2 (&commit_info, path, url, !recursive, no_ignore, ctx, pool);
+	IF_ERROR_RETURN (err, pool, L);
+
+	if (commit_info == NULL) {
+		lua_pushnil (L);
+	} else {
+		ra_heads_expire (session);
+		lua_pushinteger (L, commit_info->revision);
+	}
+
+	svn_pool_destroy (pool);
+	
+	return 1;
+}
+
+
+/* Pops a value and stores it at position ROW of the array NAME of the
+   table at ITABLE, which is created with room for SIZE entries. This
+   builds results as parallel arrays, without a table per entry */
+static void
+column_set (lua_State *L, int itable, const char *name, int row, int size) {
+	lua_getfield (L, itable, name);
+
+	if (lua_isnil (L, -1)) {
+		lua_pop (L, 1);
+		lua_createtable (L, size, 0);
+		lua_pushvalue (L, -1);
+		lua_setfield (L, itable, name);
+	}
+
+	lua_insert (L, -2);
+	lua_rawseti (L, -2, row);
+	lua_pop (L, 1);
+}
+
+
+/* Creates the array NAME in the table at ITABLE, unless it exists, so
+   that an empty result in columnar mode still has all its arrays */
+static void
+column_create (lua_State *L, int itable, const char *name, int size) {
+	lua_getfield (L, itable, name);
+
+	if (lua_isnil (L, -1)) {
+		lua_createtable (L, size, 0);
+		lua_setfield (L, itable, name);
+	}
+
+	lua_pop (L, 1);
+}
+
+
+/* Fields of the entries of a list, with the dirent fields they need and
+   the names of their arrays in columnar mode */
+static const struct {
+	const char *name;
+	const char *column;
+	apr_uint32_t dirent_field;
+} list_fields[] = {
+	{"kind", "kinds", SVN_DIRENT_KIND},
+	{"size", "sizes", SVN_DIRENT_SIZE},
+	{"has_props", "has_props", SVN_DIRENT_HAS_PROPS},
+	{"revision", "revisions", SVN_DIRENT_CREATED_REV},
+	{"date", "dates", SVN_DIRENT_TIME},
+	{"author", "authors", SVN_DIRENT_LAST_AUTHOR},
+	{NULL, NULL, 0}
+};
+
+#define LIST_DEFAULT_FIELDS (SVN_DIRENT_SIZE | SVN_DIRENT_CREATED_REV \
+		| SVN_DIRENT_TIME | SVN_DIRENT_LAST_AUTHOR)
+
+
+/* Reads the list in the field fields of the table at index ITABLE, and
+   returns the dirent fields needed for it */
+static apr_uint32_t
+get_list_fields (lua_State *L, int itable) {
+	apr_uint32_t dirent_fields = 0;
+	int i, j, n;
+
+	lua_getfield (L, itable, "fields");
+
+	if (!lua_istable (L, -1)) {
+		lua_pop (L, 1);
+		return LIST_DEFAULT_FIELDS;
+	}
+
+	n = lua_objlen (L, -1);
+
+	for (i = 1; i <= n; i++) {
+		const char *name;
+
+		lua_rawgeti (L, -1, i);
+		name = luaL_checkstring (L, -1);
+
+		for (j = 0; list_fields[j].name != NULL; j++) {
+			if (strcmp (name, list_fields[j].name) == 0) {
+				break;
+			}
+		}
+
+		if (list_fields[j].name == NULL) {
+			luaL_error (L, "invalid list field '%s'", name);
+		}
+
+		dirent_fields |= list_fields[j].dirent_field;
+		lua_pop (L, 1);
+	}
+
+	lua_pop (L, 1);
+
+	return dirent_fields;
+}
+
+
+/* Passes the entries of a list to Lua. They are stored in the table at
+   ITABLE, indexed by name, appended as name, entry pairs when APPEND is
+   set, or as parallel arrays when COLUMNAR is set. They are passed to
+   the function at IFUNC instead when there is one. Only the fields in
+   DIRENT_FIELDS are set */
+typedef struct list_bt {
+	lua_State *L;
+	int itable;
+	int ifunc;
+	svn_boolean_t append;
+	svn_boolean_t columnar;
+	int date_format;
+	apr_uint32_t dirent_fields;
+	int count;
+	svn_boolean_t stopped; /* the function returned false */
+	svn_boolean_t failed; /* the function raised an error, which is on the stack */
+} list_bt;
+
+
+/* Creates the arrays of the fields of the entries of LB */
+static void
+list_columns (list_bt *lb) {
+	int i;
+
+	column_create (lb->L, lb->itable, "names", 0);
+
+	for (i = 0; list_fields[i].name != NULL; i++) {
+		if (lb->dirent_fields & list_fields[i].dirent_field) {
+			column_create (lb->L, lb->itable, list_fields[i].column, 0);
+		}
+	}
+}
+
+
+/* Pops the value of the field number FIELD of list_fields for the
+   current entry of LB */
+static void
+list_set (list_bt *lb, int field) {
+	if (lb->columnar) {
+		column_set (lb->L, lb->itable, list_fields[field].column, lb->count, 0);
+	} else {
+		lua_setfield (lb->L, -2, list_fields[field].name);
+	}
+}
+
+
+static svn_error_t *
+list_func (void *baton,
+		   const char *path,
+		   const svn_dirent_t *dirent,
+		   const svn_lock_t *lock,
+		   const char *abs_path,
+		   apr_pool_t *pool)
+{
+	list_bt *lb = baton;
+	lua_State *L = lb->L;
+	int i;
+
+	if (strcmp (path, "") == 0) {
+		if (dirent->kind == svn_node_file) {
+			path = svn_path_basename (abs_path, pool);
+		} else {
+			return SVN_NO_ERROR;
+		}
+	} 	
+	
+	lb->count++;
+
+	if (lb->ifunc) {
+		lua_pushvalue (L, lb->ifunc);
+	}
+
+	lua_pushfstring (L, "%s%s", path, dirent->kind == svn_node_dir ? "/" : "");
+	
+	if (lb->columnar) {
+		column_set (L, lb->itable, "names", lb->count, 0);
+	} else {
+		lua_newtable (L);
+	}
+	
+	for (i = 0; list_fields[i].name != NULL; i++) {
+		if (!(lb->dirent_fields & list_fields[i].dirent_field)) {
+			continue;
+		}
+
+		switch (list_fields[i].dirent_field) {
+		case SVN_DIRENT_KIND:
+			lua_pushstring (L, dirent->kind == svn_node_dir ? "dir" : "file");
+			break;
+		case SVN_DIRENT_SIZE:
+			if (dirent->kind == svn_node_file)
+				lua_pushinteger (L, dirent->size);
+			else
+				lua_pushnil (L);
+			break;
+		case SVN_DIRENT_HAS_PROPS:
+			lua_pushboolean (L, dirent->has_props);
+			break;
+		case SVN_DIRENT_CREATED_REV:
+			lua_pushinteger (L, dirent->created_rev);
+			break;
+		case SVN_DIRENT_TIME:
+			if (lb->date_format == DATE_STRING) {
+				lua_pushstring (L, svn_time_to_human_cstring (dirent->time, pool));
+			} else {
+				push_date (L, dirent->time, lb->date_format);
+			}
+			break;
+		case SVN_DIRENT_LAST_AUTHOR:
+			if (dirent->last_author)
+				lua_pushstring (L, dirent->last_author);
+			else
+				lua_pushnil (L);
+			break;
+		}
+
+		list_set (lb, i);
+	}
+
+	if (lb->ifunc) {
+		if (lua_pcall (L, 2, 1, 0) != 0) {
+			lb->failed = TRUE;
+			return svn_error_create (SVN_ERR_CANCELLED, NULL, lua_tostring (L, -1));
+		}
+
+		if (lua_isboolean (L, -1) && !lua_toboolean (L, -1)) {
+			lb->stopped = TRUE;
+		}
+		lua_pop (L, 1);
+
+		if (lb->stopped) {
+			return svn_error_create (SVN_ERR_CEASE_INVOCATION, NULL, NULL);
+		}
+	} else if (lb->append) {
+		lua_rawseti (L, lb->itable, 2 * lb->count);
+		lua_rawseti (L, lb->itable, 2 * lb->count - 1);
+	} else if (!lb->columnar) {
+		lua_settable (L, lb->itable);
+	}
+
+	return SVN_NO_ERROR;
+}
+
+/* The fixed part of an entry of a listing in the cache of listings,
+   followed by the name and the author of the entry */
+typedef struct list_cache_rec_t {
+	apr_size_t name_len;
+	apr_size_t author_len; /* 0 when there is no author, its length plus one otherwise */
+	svn_node_kind_t kind;
+	svn_boolean_t has_props;
+	svn_revnum_t created_rev;
+	svn_filesize_t size;
+	apr_time_t time;
+} list_cache_rec_t;
+
+
+/* Where the directories of a listing come from. The connection is only
+   acquired when a directory is not in the cache */
+typedef struct list_source_t {
+	session_t *session;
+	ra_conn_t *conn;
+	const char *url;
+	svn_revnum_t rev;
+	svn_boolean_t cached;
+} list_source_t;
+
+
+/* The fields of a listing are part of its key, since a listing with few
+   fields can not serve a request for more */
+static const char *
+list_cache_key (const char *url, const char *dir, svn_revnum_t rev,
+                apr_uint32_t dirent_fields, apr_pool_t *pool) {
+	return apr_psprintf (pool, "%s@%ld:%x",
+			svn_path_url_add_component (url, dir, pool), rev,
+			(unsigned int) (dirent_fields | SVN_DIRENT_KIND));
+}
+
+
+/* Returns the key of the listing of the directory DIR of SRC with the
+   fields DIRENT_FIELDS, which is the key of the listing with all the
+   fields when the cache holds one, as it serves any subset of them */
+static const char *
+list_cache_find (list_source_t *src, const char *dir, apr_uint32_t dirent_fields,
+                 apr_pool_t *pool) {
+	const char *key = list_cache_key (src->url, dir, src->rev, SVN_DIRENT_ALL, pool);
+
+	if (apr_hash_get (src->session->list_cache.index, key, APR_HASH_KEY_STRING) != NULL) {
+		return key;
+	}
+
+	return list_cache_key (src->url, dir, src->rev, dirent_fields, pool);
+}
+
+
+static svn_stringbuf_t *
+list_cache_encode (apr_hash_t *dirents, apr_pool_t *pool) {
+	svn_stringbuf_t *buffer = svn_stringbuf_create ("", pool);
+	apr_hash_index_t *hi;
+
+	for (hi = apr_hash_first (pool, dirents); hi; hi = apr_hash_next (hi)) {
+		const void *key;
+		apr_ssize_t klen;
+		void *val;
+		svn_dirent_t *dirent;
+		list_cache_rec_t rec;
+
+		apr_hash_this (hi, &key, &klen, &val);
+		dirent = val;
+
+		memset (&rec, 0, sizeof (rec));
+		rec.name_len = klen;
+		rec.author_len = dirent->last_author ? strlen (dirent->last_author) + 1 : 0;
+		rec.kind = dirent->kind;
+		rec.has_props = dirent->has_props;
+		rec.created_rev = dirent->created_rev;
+		rec.size = dirent->size;
+		rec.time = dirent->time;
+
+		svn_stringbuf_appendbytes (buffer, (const char *) &rec, sizeof (rec));
+		svn_stringbuf_appendbytes (buffer, key, klen);
+		if (rec.author_len > 0) {
+			svn_stringbuf_appendbytes (buffer, dirent->last_author, rec.author_len - 1);
+		}
+	}
+
+	return buffer;
+}
+
+
+static svn_error_t *
+list_cache_decode (apr_hash_t **dirents, const char *data, apr_size_t len,
+                   apr_pool_t *pool) {
+	apr_size_t offset = 0;
+
+	*dirents = apr_hash_make (pool);
+
+	while (offset < len) {
+		list_cache_rec_t rec;
+		svn_dirent_t *dirent;
+		const char *name;
+
+		if (len - offset < sizeof (rec)) {
+			break;
+		}
+
+		memcpy (&rec, data + offset, sizeof (rec));
+		offset += sizeof (rec);
+
+		if (len - offset < rec.name_len
+				|| len - offset - rec.name_len < (rec.author_len ? rec.author_len - 1 : 0)) {
+			break;
+		}
+
+		name = apr_pstrmemdup (pool, data + offset, rec.name_len);
+		offset += rec.name_len;
+
+		dirent = apr_pcalloc (pool, sizeof (*dirent));
+		dirent->kind = rec.kind;
+		dirent->has_props = rec.has_props;
+		dirent->created_rev = rec.created_rev;
+		dirent->size = rec.size;
+		dirent->time = rec.time;
+
+		if (rec.author_len > 0) {
+			dirent->last_author = apr_pstrmemdup (pool, data + offset, rec.author_len - 1);
+			offset += rec.author_len - 1;
+		}
+
+		apr_hash_set (*dirents, name, rec.name_len, dirent);
+	}
+
+	if (offset != len) {
+		return svn_error_create (SVN_ERR_MALFORMED_FILE, NULL,
+				"Malformed entry in the list cache");
+	}
+
+	return SVN_NO_ERROR;
+}
+
+
+/* Gets the entries of the directory DIR, relative to the URL of SRC, with
+   at least the fields DIRENT_FIELDS */
+static svn_error_t *
+list_get_dir (apr_hash_t **dirents, list_source_t *src, const char *dir,
+              apr_uint32_t dirent_fields, apr_pool_t *pool) {
+	lru_t *cache = &src->session->list_cache;
+	const char *key = NULL;
+	const char *data;
+	apr_size_t len;
+
+	if (src->cached) {
+		key = list_cache_find (src, dir, dirent_fields, pool);
+
+		if (lru_get (cache, key, &data, &len, pool)) {
+			return list_cache_decode (dirents, data, len, pool);
+		}
+
+		key = list_cache_key (src->url, dir, src->rev, dirent_fields, pool);
+	}
+
+	if (src->conn == NULL) {
+		SVN_ERR (ra_acquire (&src->conn, src->session, src->url, pool));
+	}
+
+	SVN_ERR (svn_ra_get_dir2 (src->conn->ra, dirents, NULL, NULL, dir, src->rev,
+				dirent_fields | SVN_DIRENT_KIND, pool));
+
+	if (key != NULL) {
+		svn_stringbuf_t *buffer = list_cache_encode (*dirents, pool);
+		lru_put (cache, key, buffer->data, buffer->len, pool);
+	}
+
+	return SVN_NO_ERROR;
+}
+
+
+/* Calls LIST_FUNC for the entries of the directory DIR, relative to the
+   URL of SRC, descending into subdirectories when RECURSIVE is set */
+static svn_error_t *
+ra_list_dir (list_source_t *src, const char *dir,
+             svn_boolean_t recursive, apr_uint32_t dirent_fields,
+             svn_client_list_func_t list_func, void *baton, apr_pool_t *pool) {
+	apr_hash_t *dirents;
+	apr_hash_index_t *hi;
+	apr_pool_t *subpool;
+
+	SVN_ERR (list_get_dir (&dirents, src, dir, dirent_fields, pool));
+
+	subpool = svn_pool_create (pool);
+
+	for (hi = apr_hash_first (pool, dirents); hi; hi = apr_hash_next (hi)) {
+		const void *key;
+		void *val;
+		const char *path;
+		svn_dirent_t *dirent;
+
+		svn_pool_clear (subpool);
+
+		apr_hash_this (hi, &key, NULL, &val);
+
+		path = svn_path_join (dir, key, subpool);
+		dirent = val;
+
+		SVN_ERR (list_func (baton, path, dirent, NULL, path, subpool));
+
+		if (recursive && dirent->kind == svn_node_dir) {
+			SVN_ERR (ra_list_dir (src, path, recursive, dirent_fields,
+						list_func, baton, subpool));
+		}
+	}
+
+	svn_pool_destroy (subpool);
+
+	return SVN_NO_ERROR;
+}
+
+
+/* Lists URL at REVISION like svn_client_list, using a pooled connection
+   of SESSION, or the cache of listings of SESSION when it is enabled */
+static svn_error_t *
+list_url (session_t *session, const char *url, const svn_opt_revision_t *revision,
+          svn_boolean_t recursive, apr_uint32_t dirent_fields,
+          svn_client_list_func_t list_func, void *baton, apr_pool_t *pool) {
+	list_source_t src;
+	svn_dirent_t *dirent = NULL;
+	svn_boolean_t is_dir = TRUE;
+	svn_error_t *err = SVN_NO_ERROR;
+
+	src.session = session;
+	src.conn = NULL;
+	src.url = url;
+	src.rev = SVN_INVALID_REVNUM;
+	src.cached = session->list_cache.max_bytes > 0;
+
+	/* listings at HEAD may be served from the cache for a while */
+	if (src.cached && revision->kind != svn_opt_revision_number) {
+		src.rev = ra_head_get (session, url, session->list_head_ttl);
+	}
+
+	/* URL is taken in HEAD, and listed where it was in the revision */
+	if (!SVN_IS_VALID_REVNUM (src.rev)) {
+		err = ra_resolve (&src.rev, &src.url, session, &src.conn, url, revision, pool);
+	}
+
+	/* a directory in the cache exists, there is no need to stat it */
+	if (!err && (!src.cached || apr_hash_get (session->list_cache.index,
+					list_cache_find (&src, "", dirent_fields, pool), APR_HASH_KEY_STRING) == NULL)) {
+		if (src.conn == NULL) {
+			err = ra_acquire (&src.conn, session, src.url, pool);
+		}
+
+		if (!err) {
+			err = svn_ra_stat (src.conn->ra, "", src.rev, &dirent, pool);
+		}
+
+		if (!err && dirent == NULL) {
+			err = svn_error_createf (SVN_ERR_FS_NOT_FOUND, NULL,
+					"URL '%s' non-existent in that revision", url);
+		}
+
+		if (!err) {
+			err = list_func (baton, "", dirent, NULL, svn_path_uri_decode (src.url, pool), pool);
+			is_dir = dirent->kind == svn_node_dir;
+		}
+	}
+
+	if (!err && is_dir) {
+		err = ra_list_dir (&src, "", recursive, dirent_fields,
+				list_func, baton, pool);
+	}
+
+	if (src.conn != NULL) {
+		ra_release (session, src.conn, err);
+	}
+
+	return err;
+}
+
+
+static int
+l_list (lua_State *L) {
+	apr_pool_t *pool;
+	svn_error_t *err;
+	svn_client_ctx_t *ctx;
+	session_t *session;
+
+	svn_opt_revision_t revision;
+	svn_opt_revision_t peg_revision;
+
+	const char *path = (lua_gettop (L) < 1 || lua_isnil (L, 1)) ? "" : luaL_checkstring (L, 1);
+	int itable = 3;
+	svn_boolean_t recursive = FALSE;
+	svn_boolean_t fetch_locks = FALSE;
+	list_bt baton;
+	peg_revision.kind = svn_opt_revision_unspecified;
+
+	memset (&baton, 0, sizeof (baton));
+	baton.dirent_fields = LIST_DEFAULT_FIELDS;
+
+	if (lua_gettop (L) < 2 || lua_isnil (L, 2)) {
+		revision.kind = get_revision_kind (path);
+	} else {
+		revision.kind = svn_opt_revision_number;
+		revision.value.number = lua_tointeger (L, 2);
+	}
+
+	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
+		lua_getfield (L, itable, "recursive");
+		if (lua_isboolean (L, -1)) {
+			recursive = lua_toboolean (L, -1);
+		}
+
+		lua_getfield (L, itable, "fetch_locks");
+		if (lua_isboolean (L, -1)) {
+			fetch_locks = lua_toboolean (L, -1);
+		}
+
+		lua_getfield (L, itable, "columnar");
+		if (lua_isboolean (L, -1)) {
+			baton.columnar = lua_toboolean (L, -1);
+		}
+
+		baton.date_format = get_date_format (L, itable);
+		baton.dirent_fields = get_list_fields (L, itable);
+	}
+
+	if (lua_gettop (L) >= 4 && lua_isfunction (L, 4)) {
+		baton.ifunc = 4;
+		baton.columnar = FALSE;
+	}
+
+	session = init_function (&ctx, &pool, L);
+	path = svn_path_canonicalize (path, pool);
+
+	baton.L = L;
+
+	if (!baton.ifunc) {
+		lua_newtable (L);
+		baton.itable = lua_gettop (L);
+	}
+
+	if (baton.columnar) {
+		list_columns (&baton);
+	}
+
+	if (svn_path_is_url (path) && !fetch_locks) {
+		err = list_url (session, path, &revision, recursive, baton.dirent_fields,
+				list_func, &baton, pool);
+	} else {
+		/* the kind is needed to name directories and to recurse */
+		err = svn_client_list (path, &peg_revision, &revision, recursive,
+				baton.dirent_fields | SVN_DIRENT_KIND, fetch_locks, list_func, &baton, ctx, pool);
+	}
+
+	if (err && (baton.failed || baton.stopped)) {
+		svn_error_clear (err);
+		svn_pool_destroy (pool);
+		if (baton.failed) {
+			return lua_error (L);
+		}
+	} else {
+		IF_ERROR_RETURN (err, pool, L);
+		svn_pool_destroy (pool);
+	}
+
+	if (baton.ifunc) {
+		lua_pushinteger (L, baton.count);
+	}
+
+	return 1;
+}
+
+
+static int
+l_list_cache (lua_State *L) {
+	session_t *session = get_session (L);
+	apr_pool_t *pool = svn_pool_create (session->pool);
+
+	if (lua_istable (L, 1)) {
+		lua_getfield (L, 1, "head_ttl");
+		if (lua_isnumber (L, -1)) {
+			session->list_head_ttl = (apr_interval_time_t) (lua_tonumber (L, -1) * APR_USEC_PER_SEC);
+		}
+
+		lua_getfield (L, 1, "reset");
+		if (lua_toboolean (L, -1)) {
+			ra_heads_expire (session);
+		}
+
+		lua_pop (L, 2);
+	}
+
+	lru_config (&session->list_cache, 1, L, pool);
+
+	lua_pushnumber (L, (lua_Number) session->list_head_ttl / APR_USEC_PER_SEC);
+	lua_setfield (L, -2, "head_ttl");
+
+	svn_pool_destroy (pool);
+
+	return 1;
+}
+
+
+/* State of the iterator returned by list_iter, which lists a directory
+   at a time and keeps a stack of the directories still to be listed.
+   The session, the URL, the entries of the current directory and the
+   stack are upvalues of the iterator */
+typedef struct list_iter_t {
+	svn_opt_revision_t revision;
+	svn_revnum_t rev;
+	apr_uint32_t dirent_fields;
+	int date_format;
+	svn_boolean_t recursive;
+	svn_boolean_t started;
+	svn_boolean_t peg_head; /* the URL is taken in HEAD, see ra_locate */
+	int index; /* position of the next entry in the current directory */
+	int count; /* number of entries in the current directory */
+} list_iter_t;
+
+
+/* Lists the directory DIR, relative to the session URL of RA, pushing
+   its subdirectories on the stack of the iterator when it is recursive */
+static svn_error_t *
+list_iter_dir (list_iter_t *iter, list_bt *baton, svn_ra_session_t *ra,
+               const char *dir, apr_pool_t *pool) {
+	lua_State *L = baton->L;
+	apr_hash_t *dirents;
+	apr_hash_index_t *hi;
+	apr_pool_t *subpool;
+
+	SVN_ERR (svn_ra_get_dir2 (ra, &dirents, NULL, NULL, dir, iter->rev,
+				iter->dirent_fields | SVN_DIRENT_KIND, pool));
+
+	subpool = svn_pool_create (pool);
+
+	for (hi = apr_hash_first (pool, dirents); hi; hi = apr_hash_next (hi)) {
+		const void *key;
+		void *val;
+		const char *path;
+		svn_dirent_t *dirent;
+
+		svn_pool_clear (subpool);
+
+		apr_hash_this (hi, &key, NULL, &val);
+
+		path = svn_path_join (dir, key, subpool);
+		dirent = val;
+
+		SVN_ERR (list_func (baton, path, dirent, NULL, path, subpool));
+
+		if (iter->recursive && dirent->kind == svn_node_dir) {
+			lua_pushstring (L, path);
+			lua_rawseti (L, lua_upvalueindex (5), lua_objlen (L, lua_upvalueindex (5)) + 1);
+		}
+	}
+
+	svn_pool_destroy (subpool);
+
+	return SVN_NO_ERROR;
+}
+
+
+/* Replaces the entries of the current directory of the iterator by the
+   ones of the next directory on the stack. The first call lists the URL
+   of the iterator itself */
+static int
+list_iter_fetch (lua_State *L, list_iter_t *iter) {
+	apr_pool_t *pool;
+	svn_error_t *err;
+	session_t *session = lua_touserdata (L, lua_upvalueindex (2));
+	const char *url = lua_tostring (L, lua_upvalueindex (3));
+	ra_conn_t *conn;
+	list_bt baton;
+	svn_dirent_t *dirent = NULL;
+	int n;
+
+	if (session->pool == NULL) {
+		return send_error (L, "Session is closed\n");
+	}
+
+	pool = svn_pool_create (session->pool);
+
+	memset (&baton, 0, sizeof (baton));
+	baton.L = L;
+	baton.append = TRUE;
+	baton.date_format = iter->date_format;
+	baton.dirent_fields = iter->dirent_fields;
+
+	lua_newtable (L);
+	baton.itable = lua_gettop (L);
+
+	err = ra_acquire (&conn, session, url, pool);
+	IF_ERROR_RETURN (err, pool, L);
+
+	if (!iter->started) {
+		iter->started = TRUE;
+
+		if (iter->peg_head) {
+			err = ra_resolve (&iter->rev, &url, session, &conn, url, &iter->revision, pool);
+		} else {
+			err = ra_revnum (&iter->rev, conn->ra, &iter->revision, pool);
+		}
+
+		/* the next directories are listed from where URL was */
+		if (!err) {
+			lua_pushstring (L, url);
+			lua_replace (L, lua_upvalueindex (3));
+		}
+
+		if (!err) {
+			err = svn_ra_stat (conn->ra, "", iter->rev, &dirent, pool);
+		}
+
+		if (!err && dirent == NULL) {
+			err = svn_error_createf (SVN_ERR_FS_NOT_FOUND, NULL,
+					"URL '%s' non-existent in that revision", url);
+		}
+
+		if (!err) {
+			err = list_func (&baton, "", dirent, NULL, svn_path_uri_decode (url, pool), pool);
+		}
+
+		if (!err && dirent->kind == svn_node_dir) {
+			err = list_iter_dir (iter, &baton, conn->ra, "", pool);
+		}
+	} else {
+		n = lua_objlen (L, lua_upvalueindex (5));
+
+		lua_rawgeti (L, lua_upvalueindex (5), n);
+		lua_pushnil (L);
+		lua_rawseti (L, lua_upvalueindex (5), n);
+
+		err = list_iter_dir (iter, &baton, conn->ra, lua_tostring (L, -1), pool);
+		lua_pop (L, 1);
+	}
+
+	ra_release (session, conn, err);
+	IF_ERROR_RETURN (err, pool, L);
+
+	svn_pool_destroy (pool);
+
+	lua_replace (L, lua_upvalueindex (4));
+
+	iter->index = 0;
+	iter->count = baton.count;
+
+	return 0;
+}
+
+
+static int
+list_iter_next (lua_State *L) {
+	list_iter_t *iter = lua_touserdata (L, lua_upvalueindex (1));
+
+	while (iter->index == iter->count) {
+		if (iter->started && lua_objlen (L, lua_upvalueindex (5)) == 0) {
+			return 0;
+		}
+
+		list_iter_fetch (L, iter);
+	}
+
+	iter->index++;
+
+	lua_rawgeti (L, lua_upvalueindex (4), 2 * iter->index - 1);
+	lua_rawgeti (L, lua_upvalueindex (4), 2 * iter->index);
+
+	return 2;
+}
+
+
+/* Sets REV to the revision of the working copy PATH, the one its BASE
+   stands for */
+static svn_error_t *
+wc_base_revnum (svn_revnum_t *rev, const char *path, apr_pool_t *pool) {
+	svn_wc_adm_access_t *adm_access;
+	const svn_wc_entry_t *entry;
+
+	SVN_ERR (svn_wc_adm_probe_open3 (&adm_access, NULL, path, FALSE, 0,
+				NULL, NULL, pool));
+	SVN_ERR (svn_wc_entry (&entry, path, adm_access, FALSE, pool));
+	SVN_ERR (svn_wc_adm_close (adm_access));
+
+	if (entry == NULL || !SVN_IS_VALID_REVNUM (entry->revision)) {
+		return svn_error_createf (SVN_ERR_UNVERSIONED_RESOURCE, NULL,
+				"'%s' is not under version control", path);
+	}
+
+	*rev = entry->revision;
+
+	return SVN_NO_ERROR;
+}
+
+
+static int
+l_list_iter (lua_State *L) {
+	apr_pool_t *pool;
+	svn_error_t *err;
+	svn_client_ctx_t *ctx;
+	list_iter_t iter;
+	list_iter_t *it;
+
+	const char *path = (lua_gettop (L) < 1 || lua_isnil (L, 1)) ? "" : luaL_checkstring (L, 1);
+	const char *url;
+	int itable = 3;
+
+	memset (&iter, 0, sizeof (list_iter_t));
+	iter.dirent_fields = LIST_DEFAULT_FIELDS;
+	iter.peg_head = svn_path_is_url (path);
+
+	if (lua_gettop (L) < 2 || lua_isnil (L, 2)) {
+		iter.revision.kind = get_revision_kind (path);
+	} else {
+		iter.revision.kind = svn_opt_revision_number;
+		iter.revision.value.number = lua_tointeger (L, 2);
+	}
+
+	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
+		lua_getfield (L, itable, "recursive");
+		if (lua_isboolean (L, -1)) {
+			iter.recursive = lua_toboolean (L, -1);
+		}
+		lua_pop (L, 1);
+
+		iter.date_format = get_date_format (L, itable);
+		iter.dirent_fields = get_list_fields (L, itable);
+	}
+
+	it = lua_newuserdata (L, sizeof (list_iter_t));
+	*it = iter;
+
+	/* the session must outlive the iterator */
+	lua_getfield (L, LUA_REGISTRYINDEX, SESSION_CURRENT);
+	init_function (&ctx, &pool, L);
+	if (lua_isnil (L, -1)) {
+		lua_pop (L, 1);
+		lua_getfield (L, LUA_REGISTRYINDEX, SESSION_DEFAULT);
+	}
+
+	path = svn_path_canonicalize (path, pool);
+
+	if (svn_path_is_url (path)) {
+		url = path;
+	} else {
+		err = svn_client_url_from_path (&url, path, pool);
+		IF_ERROR_RETURN (err, pool, L);
+
+		if (url == NULL) {
+			err = svn_error_createf (SVN_ERR_ENTRY_MISSING_URL, NULL,
+					"'%s' has no URL", path);
+			IF_ERROR_RETURN (err, pool, L);
+		}
+
+		/* the repository does not know the BASE of the working copy, so
+		   it is resolved here, as svn.list does */
+		if (it->revision.kind == svn_opt_revision_base) {
+			err = wc_base_revnum (&it->revision.value.number, path, pool);
+			IF_ERROR_RETURN (err, pool, L);
+
+			it->revision.kind = svn_opt_revision_number;
+		}
+	}
+
+	lua_pushstring (L, url);
+	svn_pool_destroy (pool);
+
+	lua_newtable (L);
+	lua_newtable (L);
+
+	lua_pushcclosure (L, list_iter_next, 5);
+
+	return 1;
+}
+
+
+#if APR_HAS_THREADS
+
+#define WALK_MT "svn.walk"
+#define WALK_THREADS 4
+#define WALK_QUEUE_LEN 64
+
+
+/* An entry found by a walk thread, copied with malloc since it is read
+   by the Lua thread */
+typedef struct walk_entry_t {
+	char *path;
+	char *author;
+	svn_node_kind_t kind;
+	svn_filesize_t size;
+	svn_boolean_t has_props;
+	svn_revnum_t created_rev;
+	apr_time_t time;
+} walk_entry_t;
+
+
+/* The entries of a directory, queued as a whole so that the threads take
+   the lock once per directory */
+typedef struct walk_batch_t {
+	walk_entry_t *entries;
+	int count;
+	struct walk_batch_t *next;
+} walk_batch_t;
+
+
+/* A directory still to be listed, relative to the URL of the walk */
+typedef struct walk_dir_t {
+	char *path;
+	struct walk_dir_t *next;
+} walk_dir_t;
+
+
+typedef struct walk_worker_t {
+	struct walk_t *walk;
+	session_t *session; /* worker session used by this thread */
+	apr_thread_t *thread;
+	svn_boolean_t finished;
+} walk_worker_t;
+
+
+/* State of the iterator returned by walk. The threads take directories
+   from DIRS, list them with a connection of their worker session, push
+   the directories they find back to DIRS and queue their entries for the
+   iterator. The walk is released by the last of the iterator and the
+   threads to let it go, see walk_close */
+typedef struct walk_t {
+	apr_pool_t *pool;
+	apr_pool_t *scratch; /* only used by the Lua thread */
+	apr_thread_mutex_t *mutex;
+	apr_thread_cond_t *cond;
+	session_t *session; /* session the worker sessions are given back to */
+	int refs; /* the iterator and the threads not finished yet */
+	svn_boolean_t closed; /* the iterator is gone */
+	const char *url;
+	svn_revnum_t rev;
+	apr_uint32_t dirent_fields;
+	int date_format;
+	walk_worker_t *workers;
+	int threads; /* number of threads started */
+	int running; /* number of threads not finished yet */
+	int busy; /* number of threads listing a directory */
+	walk_dir_t *dirs;
+	walk_batch_t *first;
+	walk_batch_t *last;
+	int queued;
+	walk_batch_t *current; /* batch being returned by the iterator */
+	int index;
+	svn_boolean_t cancelled;
+	char *error;
+} walk_t;
+
+
+static void
+walk_batch_free (walk_batch_t *batch) {
+	int i;
+
+	if (batch == NULL) {
+		return;
+	}
+
+	for (i = 0; i < batch->count; i++) {
+		free (batch->entries[i].path);
+		free (batch->entries[i].author);
+	}
+
+	free (batch->entries);
+	free (batch);
+}
+
+
+/* Lists the directory DIR with RA, returning its entries in BATCH and
+   prepending its subdirectories to SUBDIRS */
+static svn_error_t *
+walk_dir (walk_t *w, svn_ra_session_t *ra, const char *dir,
+          walk_batch_t **batch, walk_dir_t **subdirs, apr_pool_t *pool) {
+	apr_hash_t *dirents;
+	apr_hash_index_t *hi;
+	walk_batch_t *b;
+
+	SVN_ERR (svn_ra_get_dir2 (ra, &dirents, NULL, NULL, dir, w->rev,
+				w->dirent_fields | SVN_DIRENT_KIND, pool));
+
+	b = calloc (1, sizeof (walk_batch_t));
+	if (b != NULL) {
+		b->entries = calloc (apr_hash_count (dirents) + 1, sizeof (walk_entry_t));
+	}
+	if (b == NULL || b->entries == NULL) {
+		free (b);
+		return svn_error_create (APR_ENOMEM, NULL, NULL);
+	}
+
+	for (hi = apr_hash_first (pool, dirents); hi; hi = apr_hash_next (hi)) {
+		const void *key;
+		void *val;
+		svn_dirent_t *dirent;
+		walk_entry_t *e = &b->entries[b->count];
+		walk_dir_t *d = NULL;
+
+		apr_hash_this (hi, &key, NULL, &val);
+		dirent = val;
+
+		e->path = strdup (svn_path_join (dir, key, pool));
+		e->author = dirent->last_author ? strdup (dirent->last_author) : NULL;
+		e->kind = dirent->kind;
+		e->size = dirent->size;
+		e->has_props = dirent->has_props;
+		e->created_rev = dirent->created_rev;
+		e->time = dirent->time;
+		b->count++;
+
+		if (dirent->kind == svn_node_dir && e->path != NULL) {
+			d = malloc (sizeof (walk_dir_t));
+			if (d != NULL && (d->path = strdup (e->path)) != NULL) {
+				d->next = *subdirs;
+				*subdirs = d;
+			} else {
+				free (d);
+				d = NULL;
+			}
+		}
+
+		if (e->path == NULL || (dirent->last_author && e->author == NULL)
+				|| (dirent->kind == svn_node_dir && d == NULL)) {
+			walk_batch_free (b);
+			return svn_error_create (APR_ENOMEM, NULL, NULL);
+		}
+	}
+
+	*batch = b;
+
+	return SVN_NO_ERROR;
+}
+
+
+/* Releases the memory of W, once the iterator and the threads are done */
+static void
+walk_free (walk_t *w) {
+	while (w->dirs != NULL) {
+		walk_dir_t *dir = w->dirs;
+		w->dirs = dir->next;
+		free (dir->path);
+		free (dir);
+	}
+
+	while (w->first != NULL) {
+		walk_batch_t *batch = w->first;
+		w->first = batch->next;
+		walk_batch_free (batch);
+	}
+
+	walk_batch_free (w->current);
+	free (w->error);
+
+	svn_pool_destroy (w->pool);
+
+	root_release ();
+}
+
+
+/* The threads are detached and never call apr_thread_exit, since the
+   last one to finish destroys the pool the threads were created in */
+static void * APR_THREAD_FUNC
+walk_thread (apr_thread_t *thread, void *data) {
+	walk_worker_t *worker = data;
+	walk_t *w = worker->walk;
+	session_t *session = worker->session;
+	ra_conn_t *conn = NULL;
+	apr_pool_t *iterpool;
+	svn_error_t *err;
+	svn_boolean_t last;
+	char buf[256];
+
+	iterpool = svn_pool_create (session->pool);
+
+	err = ra_acquire (&conn, session, w->url, iterpool);
+
+	apr_thread_mutex_lock (w->mutex);
+
+	while (!err && !w->cancelled) {
+		walk_dir_t *dir, *subdirs = NULL;
+		walk_batch_t *batch = NULL;
+
+		/* the walk is over when no directory is left and no other thread
+		   may find new ones */
+		while (w->dirs == NULL && w->busy > 0 && !w->cancelled) {
+			apr_thread_cond_wait (w->cond, w->mutex);
+		}
+
+		if (w->dirs == NULL || w->cancelled) {
+			break;
+		}
+
+		dir = w->dirs;
+		w->dirs = dir->next;
+		w->busy++;
+
+		apr_thread_mutex_unlock (w->mutex);
+
+		svn_pool_clear (iterpool);
+		err = walk_dir (w, conn->ra, dir->path, &batch, &subdirs, iterpool);
+		free (dir->path);
+		free (dir);
+
+		apr_thread_mutex_lock (w->mutex);
+
+		while (batch != NULL && w->queued == WALK_QUEUE_LEN && !w->cancelled) {
+			apr_thread_cond_wait (w->cond, w->mutex);
+		}
+
+		/* released by walk_free when the walk was cancelled */
+		while (subdirs != NULL) {
+			dir = subdirs;
+			subdirs = dir->next;
+			dir->next = w->dirs;
+			w->dirs = dir;
+		}
+
+		if (batch != NULL) {
+			if (w->last != NULL) {
+				w->last->next = batch;
+			} else {
+				w->first = batch;
+			}
+			w->last = batch;
+			w->queued++;
+		}
+
+		w->busy--;
+		apr_thread_cond_broadcast (w->cond);
+	}
+
+	apr_thread_mutex_unlock (w->mutex);
+
+	if (conn != NULL) {
+		ra_release (session, conn, err);
+	}
+
+	svn_pool_destroy (iterpool);
+
+	apr_thread_mutex_lock (w->mutex);
+
+	/* a failure stops the other threads too */
+	if (err && !w->cancelled) {
+		w->error = strdup (svn_err_best_message (err, buf, sizeof (buf)));
+		w->cancelled = TRUE;
+	}
+
+	/* the iterator gives the worker session back, unless it is gone */
+	if (!w->closed) {
+		session = NULL;
+	}
+
+	worker->finished = TRUE;
+	w->running--;
+	last = --w->refs == 0;
+	apr_thread_cond_broadcast (w->cond);
+	apr_thread_mutex_unlock (w->mutex);
+
+	svn_error_clear (err);
+
+	if (session != NULL) {
+		svn_pool_destroy (session->pool);
+	}
+
+	if (last) {
+		walk_free (w);
+	}
+
+	return NULL;
+}
+
+
+/* Lets the walk in BOX go on behalf of the iterator. The worker sessions
+   of the threads that are finished go back to the session, the others
+   are cancelled and release the walk when they finish, so this never
+   waits for a thread */
+static void
+walk_close (walk_t **box) {
+	walk_t *w = *box;
+	svn_boolean_t last;
+	int i;
+
+	if (w == NULL) {
+		return;
+	}
+
+	*box = NULL;
+
+	apr_thread_mutex_lock (w->mutex);
+
+	w->cancelled = TRUE;
+	w->closed = TRUE;
+
+	for (i = 0; i < w->threads; i++) {
+		if (w->workers[i].finished) {
+			session_give_worker (w->session, w->workers[i].session);
+		}
+	}
+
+	last = --w->refs == 0;
+	apr_thread_cond_broadcast (w->cond);
+	apr_thread_mutex_unlock (w->mutex);
+
+	if (last) {
+		walk_free (w);
+	}
+}
+
+
+static int
+walk_gc (lua_State *L) {
+	walk_close (luaL_checkudata (L, 1, WALK_MT));
+	return 0;
+}
+
+
+/* The iterator returned by walk. Returns the name and the entry of the
+   next path, in the order the threads list them, or nil at the end */
+static int
+walk_next (lua_State *L) {
+	walk_t **box = luaL_checkudata (L, lua_upvalueindex (1), WALK_MT);
+	walk_t *w = *box;
+	walk_entry_t *e;
+	svn_dirent_t dirent;
+	list_bt baton;
+
+	if (w == NULL) {
+		return 0;
+	}
+
+	while (w->current == NULL || w->index == w->current->count) {
+		walk_batch_t *batch;
+
+		walk_batch_free (w->current);
+		w->current = NULL;
+
+		apr_thread_mutex_lock (w->mutex);
+
+		while (w->first == NULL && w->running > 0) {
+			apr_thread_cond_wait (w->cond, w->mutex);
+		}
+
+		batch = w->first;
+		if (batch != NULL) {
+			w->first = batch->next;
+			if (w->first == NULL) {
+				w->last = NULL;
+			}
+			w->queued--;
+			apr_thread_cond_broadcast (w->cond);
+		}
+
+		apr_thread_mutex_unlock (w->mutex);
+
+		if (batch == NULL) {
+			if (w->error != NULL) {
+				lua_pushstring (L, w->error);
+				walk_close (box);
+				return lua_error (L);
+			}
+
+			walk_close (box);
+			return 0;
+		}
+
+		w->current = batch;
+		w->index = 0;
+		svn_pool_clear (w->scratch);
+	}
+
+	e = &w->current->entries[w->index++];
+
+	memset (&dirent, 0, sizeof (dirent));
+	dirent.kind = e->kind;
+	dirent.size = e->size;
+	dirent.has_props = e->has_props;
+	dirent.created_rev = e->created_rev;
+	dirent.time = e->time;
+	dirent.last_author = e->author;
+
+	memset (&baton, 0, sizeof (baton));
+	baton.L = L;
+	baton.itable = lua_upvalueindex (2);
+	baton.append = TRUE;
+	baton.date_format = w->date_format;
+	baton.dirent_fields = w->dirent_fields;
+
+	list_func (&baton, e->path, &dirent, NULL, e->path, w->scratch);
+
+	lua_rawgeti (L, lua_upvalueindex (2), 1);
+	lua_rawgeti (L, lua_upvalueindex (2), 2);
+
+	return 2;
+}
+
+
+static int
+l_walk (lua_State *L) {
+	apr_allocator_t *allocator;
+	apr_thread_mutex_t *mutex;
+	apr_status_t status;
+	apr_pool_t *pool;
+	svn_error_t *err;
+	svn_client_ctx_t *ctx;
+	session_t *session;
+	ra_conn_t *conn;
+	svn_dirent_t *dirent = NULL;
+	svn_opt_revision_t revision;
+	svn_revnum_t rev;
+	apr_pool_t *walk_pool;
+	apr_threadattr_t *attr;
+	walk_t **box;
+	walk_t *w = NULL;
+	int i;
+
+	const char *path = luaL_checkstring (L, 1);
+	const char *url;
+	int itable = 3;
+	int threads = WALK_THREADS;
+	int date_format = DATE_STRING;
+	apr_uint32_t dirent_fields = LIST_DEFAULT_FIELDS;
+
+	if (lua_gettop (L) < 2 || lua_isnil (L, 2)) {
+		revision.kind = svn_opt_revision_head;
+	} else {
+		revision.kind = svn_opt_revision_number;
+		revision.value.number = lua_tointeger (L, 2);
+	}
+
+	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
+		lua_getfield (L, itable, "threads");
+		if (lua_isnumber (L, -1)) {
+			threads = lua_tointeger (L, -1);
+		}
+		lua_pop (L, 1);
+
+		date_format = get_date_format (L, itable);
+		dirent_fields = get_list_fields (L, itable);
+	}
+
+	luaL_argcheck (L, threads > 0, itable, "the number of threads must be positive");
+
+	session = init_function (&ctx, &pool, L);
+
+	path = svn_path_canonicalize (path, pool);
+
+	if (svn_path_is_url (path)) {
+		url = path;
+	} else {
+		err = svn_client_url_from_path (&url, path, pool);
+		IF_ERROR_RETURN (err, pool, L);
+
+		if (url == NULL) {
+			err = svn_error_createf (SVN_ERR_ENTRY_MISSING_URL, NULL,
+					"'%s' has no URL", path);
+			IF_ERROR_RETURN (err, pool, L);
+		}
+	}
+
+	/* the revision is resolved once, so that all the threads see the
+	   same tree */
+	err = ra_acquire (&conn, session, url, pool);
+	IF_ERROR_RETURN (err, pool, L);
+
+	/* a URL is taken in HEAD and walked where it was in the revision */
+	if (svn_path_is_url (path)) {
+		err = ra_resolve (&rev, &url, session, &conn, url, &revision, pool);
+	} else {
+		err = ra_revnum (&rev, conn->ra, &revision, pool);
+	}
+
+	if (!err) {
+		err = svn_ra_stat (conn->ra, "", rev, &dirent, pool);
+	}
+
+	if (!err && dirent == NULL) {
+		err = svn_error_createf (SVN_ERR_FS_NOT_FOUND, NULL,
+				"URL '%s' non-existent in that revision", url);
+	}
+
+	ra_release (session, conn, err);
+	IF_ERROR_RETURN (err, pool, L);
+
+	box = lua_newuserdata (L, sizeof (walk_t *));
+	*box = NULL;
+	luaL_getmetatable (L, WALK_MT);
+	lua_setmetatable (L, -2);
+
+	if (apr_allocator_create (&allocator)) {
+		svn_pool_destroy (pool);
+		return send_error (L, "Error creating allocator\n");
+	}
+
+	/* not derived from the root pool, since it may outlive the Lua state
+	   until the last thread finishes. The pools of the threads are
+	   created from it, so its allocator needs a mutex */
+	walk_pool = svn_pool_create_ex (NULL, allocator);
+	apr_allocator_owner_set (allocator, walk_pool);
+
+	status = apr_thread_mutex_create (&mutex, APR_THREAD_MUTEX_DEFAULT, walk_pool);
+	if (status == APR_SUCCESS) {
+		apr_allocator_mutex_set (allocator, mutex);
+		w = apr_pcalloc (walk_pool, sizeof (walk_t));
+		status = apr_thread_mutex_create (&w->mutex, APR_THREAD_MUTEX_DEFAULT, walk_pool);
+	}
+	if (status == APR_SUCCESS) {
+		status = apr_thread_cond_create (&w->cond, walk_pool);
+	}
+	if (status == APR_SUCCESS) {
+		status = apr_threadattr_create (&attr, walk_pool);
+	}
+	if (status == APR_SUCCESS) {
+		status = apr_threadattr_detach_set (attr, 1);
+	}
+
+	if (status != APR_SUCCESS) {
+		svn_pool_destroy (walk_pool);
+		svn_pool_destroy (pool);
+		return send_error (L, "Error starting the walk threads\n");
+	}
+
+	root_retain ();
+
+	w->pool = walk_pool;
+	w->refs = 1;
+	*box = w;
+
+	w->scratch = svn_pool_create (w->pool);
+	w->session = session;
+	w->url = apr_pstrdup (w->pool, url);
+	w->rev = rev;
+	w->date_format = date_format;
+	w->dirent_fields = dirent_fields;
+
+	if (dirent->kind == svn_node_file) {
+		/* a single entry, no thread needed */
+		w->first = calloc (1, sizeof (walk_batch_t));
+		if (w->first != NULL) {
+			w->first->entries = calloc (1, sizeof (walk_entry_t));
+		}
+		if (w->first == NULL || w->first->entries == NULL) {
+			svn_pool_destroy (pool);
+			walk_close (box);
+			return send_error (L, "Out of memory\n");
+		}
+		w->last = w->first;
+		w->queued = 1;
+		w->first->count = 1;
+		w->first->entries[0].path = strdup (svn_path_basename (svn_path_uri_decode (url, pool), pool));
+		w->first->entries[0].author = dirent->last_author ? strdup (dirent->last_author) : NULL;
+		w->first->entries[0].kind = dirent->kind;
+		w->first->entries[0].size = dirent->size;
+		w->first->entries[0].has_props = dirent->has_props;
+		w->first->entries[0].created_rev = dirent->created_rev;
+		w->first->entries[0].time = dirent->time;
+		threads = 0;
+	} else {
+		w->dirs = calloc (1, sizeof (walk_dir_t));
+		if (w->dirs == NULL || (w->dirs->path = strdup ("")) == NULL) {
+			svn_pool_destroy (pool);
+			walk_close (box);
+			return send_error (L, "Out of memory\n");
+		}
+	}
+
+	w->workers = apr_pcalloc (w->pool, (threads + 1) * sizeof (walk_worker_t));
+
+	for (i = 0; i < threads; i++) {
+		walk_worker_t *worker = &w->workers[i];
+
+		worker->walk = w;
+
+		err = session_take_worker (&worker->session, session);
+		if (err) {
+			walk_close (box);
+			IF_ERROR_RETURN (err, pool, L);
+		}
+
+		apr_thread_mutex_lock (w->mutex);
+		status = apr_thread_create (&worker->thread, attr, walk_thread, worker, w->pool);
+		if (status == APR_SUCCESS) {
+			w->threads++;
+			w->running++;
+			w->refs++;
+		}
+		apr_thread_mutex_unlock (w->mutex);
+
+		if (status != APR_SUCCESS) {
+			session_give_worker (session, worker->session);
+			svn_pool_destroy (pool);
+			walk_close (box);
+			return send_error (L, "Error starting the walk threads\n");
+		}
+	}
+
+	svn_pool_destroy (pool);
+
+	lua_newtable (L);
+	push_session (L, session);
+	lua_pushcclosure (L, walk_next, 3);
+
+	return 1;
+}
+
+#else
+
+static int
+l_walk (lua_State *L) {
+	return send_error (L, "walk needs APR with thread support\n");
+}
+
+#endif
+
+
+#define LOG_PAGE_MIN 16
+#define LOG_PAGE_MAX 1024
+
+/* the log functions that take a list of revprops are new in 1.5 */
+#if SVN_VER_MAJOR > 1 || SVN_VER_MINOR >= 5
+#define HAVE_LOG_REVPROPS 1
+#endif
+
+
+/* Passes the entries of a log to Lua. They are stored in the table at
+   ITABLE, indexed by revision, appended as revision, entry pairs when
+   APPEND is set, or as parallel arrays when COLUMNAR is set. They are
+   passed to the function at IFUNC instead when there is one */
+typedef struct log_bt {
+	lua_State *L;
+	int itable;
+	int ifunc;
+	svn_boolean_t append;
+	svn_boolean_t columnar;
+	int date_format;
+	int size; /* expected number of entries, 0 if unknown */
+	const apr_array_header_t *revprops; /* names of the revprops to return */
+	int count;
+	svn_revnum_t last; /* revision of the last entry */
+	svn_boolean_t stopped; /* the function returned false */
+	svn_boolean_t failed; /* the function raised an error, which is on the stack */
+} log_bt;
+
+
+/* Name of the array of the field NAME of the log entries in columnar mode */
+static const char *
+log_column (const char *name) {
+	if (strcmp (name, "author") == 0) {
+		return "authors";
+	} else if (strcmp (name, "date") == 0) {
+		return "dates";
+	} else if (strcmp (name, "message") == 0) {
+		return "messages";
+	}
+
+	return name;
+}
+
+
+/* Pops the value of the field NAME of the current entry of LB, which is
+   on the top of the stack, or in an array of the result in columnar mode */
+static void
+log_set (log_bt *lb, const char *name) {
+	if (lb->columnar) {
+		column_set (lb->L, lb->itable, log_column (name), lb->count, lb->size);
+	} else {
+		lua_setfield (lb->L, -2, name);
+	}
+}
+
+
+static int
+log_compare_paths (const void *a, const void *b) {
+	return svn_sort_compare_items_as_paths (a, b);
+}
+
+
+/* Sets the changed paths of the current log entry of LB, as parallel
+   arrays instead of a table per path: "paths" holds the sorted paths,
+   "actions" a string with the action of each path, and the sparse arrays
+   "copyfrom_paths" and "copyfrom_revs" hold the sources of the copies */
+static void
+log_changed_paths (log_bt *lb, apr_hash_t *changed_paths, apr_pool_t *pool) {
+	lua_State *L = lb->L;
+	apr_array_header_t *sorted;
+	apr_hash_index_t *hi;
+	char *actions;
+	int has_copies = 0;
+	int i;
+
+	sorted = apr_array_make (pool, apr_hash_count (changed_paths), sizeof (svn_sort__item_t));
+
+	for (hi = apr_hash_first (pool, changed_paths); hi; hi = apr_hash_next (hi)) {
+		svn_sort__item_t *item = apr_array_push (sorted);
+
+		apr_hash_this (hi, &item->key, &item->klen, &item->value);
+	}
+
+	qsort (sorted->elts, sorted->nelts, sizeof (svn_sort__item_t), log_compare_paths);
+
+	actions = apr_palloc (pool, sorted->nelts + 1);
+
+	lua_createtable (L, sorted->nelts, 0);
+
+	for (i = 0; i < sorted->nelts; i++) {
+		svn_sort__item_t *item = &APR_ARRAY_IDX (sorted, i, svn_sort__item_t);
+		svn_log_changed_path_t *changed = item->value;
+
+		lua_pushlstring (L, item->key, item->klen);
+		lua_rawseti (L, -2, i + 1);
+
+		actions[i] = changed->action;
+
+		if (changed->copyfrom_path != NULL) {
+			has_copies = 1;
+		}
+	}
+
+	log_set (lb, "paths");
+
+	lua_pushlstring (L, actions, sorted->nelts);
+	log_set (lb, "actions");
+
+	if (!has_copies) {
+		return;
+	}
+
+	lua_newtable (L);
+
+	for (i = 0; i < sorted->nelts; i++) {
+		svn_log_changed_path_t *changed = APR_ARRAY_IDX (sorted, i, svn_sort__item_t).value;
+
+		if (changed->copyfrom_path != NULL) {
+			lua_pushstring (L, changed->copyfrom_path);
+			lua_rawseti (L, -2, i + 1);
+		}
+	}
+
+	log_set (lb, "copyfrom_paths");
+
+	lua_newtable (L);
+
+	for (i = 0; i < sorted->nelts; i++) {
+		svn_log_changed_path_t *changed = APR_ARRAY_IDX (sorted, i, svn_sort__item_t).value;
+
+		if (changed->copyfrom_path != NULL) {
+			lua_pushinteger (L, changed->copyfrom_rev);
+			lua_rawseti (L, -2, i + 1);
+		}
+	}
+
+	log_set (lb, "copyfrom_revs");
+}
+
+
+/* Name of the field of a log entry that holds the revprop NAME */
+static const char *
+log_field (const char *name) {
+	if (strcmp (name, SVN_PROP_REVISION_AUTHOR) == 0) {
+		return "author";
+	} else if (strcmp (name, SVN_PROP_REVISION_DATE) == 0) {
+		return "date";
+	} else if (strcmp (name, SVN_PROP_REVISION_LOG) == 0) {
+		return "message";
+	}
+
+	return name;
+}
+
+
+/* Creates the arrays of the fields of the entries of LB, with the ones
+   of the changed paths when DISCOVER_CHANGED_PATHS is set */
+static void
+log_columns (log_bt *lb, svn_boolean_t discover_changed_paths) {
+	int i;
+
+	column_create (lb->L, lb->itable, "revs", lb->size);
+
+	for (i = 0; lb->revprops != NULL && i < lb->revprops->nelts; i++) {
+		const char *name = APR_ARRAY_IDX (lb->revprops, i, const char *);
+		column_create (lb->L, lb->itable, log_column (log_field (name)), lb->size);
+	}
+
+	if (discover_changed_paths) {
+		column_create (lb->L, lb->itable, "paths", lb->size);
+		column_create (lb->L, lb->itable, "actions", lb->size);
+		column_create (lb->L, lb->itable, "copyfrom_paths", 0);
+		column_create (lb->L, lb->itable, "copyfrom_revs", 0);
+	}
+}
+
+
+/* The revprops of a log entry when no list is given */
+static apr_array_header_t *
+log_default_revprops (apr_pool_t *pool) {
+	apr_array_header_t *revprops = apr_array_make (pool, 3, sizeof (const char *));
+
+	APR_ARRAY_PUSH (revprops, const char *) = SVN_PROP_REVISION_AUTHOR;
+	APR_ARRAY_PUSH (revprops, const char *) = SVN_PROP_REVISION_DATE;
+	APR_ARRAY_PUSH (revprops, const char *) = SVN_PROP_REVISION_LOG;
+
+	return revprops;
+}
+
+
+/* Raises an error unless the table at index IDX, if any, is a list of
+   strings. This runs before the pool of the call is created, since
+   raising afterwards would leak it */
+static void
+log_check_revprops (lua_State *L, int idx) {
+	int i, n;
+
+	if (!lua_istable (L, idx)) {
+		return;
+	}
+
+	n = lua_objlen (L, idx);
+
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti (L, idx, i);
+		if (!lua_isstring (L, -1)) {
+			luaL_error (L, "revprop %d is not a string", i);
+		}
+		lua_pop (L, 1);
+	}
+}
+
+
+/* Builds the list of revprops to fetch from the table at index IDX,
+   which may name them by their field. The list must have been checked by
+   log_check_revprops */
+static apr_array_header_t *
+log_revprops (lua_State *L, int idx, apr_pool_t *pool) {
+	apr_array_header_t *revprops;
+	int i, n;
+
+	if (!lua_istable (L, idx)) {
+		return log_default_revprops (pool);
+	}
+
+	n = lua_objlen (L, idx);
+	revprops = apr_array_make (pool, n, sizeof (const char *));
+
+	for (i = 1; i <= n; i++) {
+		const char *name;
+
+		lua_rawgeti (L, idx, i);
+		name = lua_tostring (L, -1);
+
+		if (strcmp (name, "author") == 0) {
+			name = SVN_PROP_REVISION_AUTHOR;
+		} else if (strcmp (name, "date") == 0) {
+			name = SVN_PROP_REVISION_DATE;
+		} else if (strcmp (name, "message") == 0) {
+			name = SVN_PROP_REVISION_LOG;
+		} else {
+			name = apr_pstrdup (pool, name);
+		}
+
+		APR_ARRAY_PUSH (revprops, const char *) = name;
+		lua_pop (L, 1);
+	}
+
+	return revprops;
+}
+
+
+/* Passes a log entry to Lua, with the revprops of LB that are set */
+static svn_error_t *
+log_entry (log_bt *lb,
+           svn_revnum_t revision,
+           apr_hash_t *changed_paths,
+           apr_hash_t *revprops,
+           apr_pool_t *pool)
+{
+	lua_State *L = lb->L;
+	int i;
+
+	lb->count++;
+	lb->last = revision;
+
+	if (lb->ifunc) {
+		lua_pushvalue (L, lb->ifunc);
+	}
+
+	lua_pushinteger (L, revision);
+	
+	if (lb->columnar) {
+		column_set (L, lb->itable, "revs", lb->count, lb->size);
+	} else {
+		lua_newtable (L);
+	}
+
+	for (i = 0; revprops != NULL && i < lb->revprops->nelts; i++) {
+		const char *name = APR_ARRAY_IDX (lb->revprops, i, const char *);
+		svn_string_t *value = apr_hash_get (revprops, name, APR_HASH_KEY_STRING);
+
+		if (value == NULL) {
+			continue;
+		}
+
+		if (lb->date_format != DATE_STRING && strcmp (name, SVN_PROP_REVISION_DATE) == 0) {
+			apr_time_t when;
+			svn_error_t *err = svn_time_from_cstring (&when, value->data, pool);
+
+			if (err) {
+				svn_error_clear (err);
+				lua_pushlstring (L, value->data, value->len);
+			} else {
+				push_date (L, when, lb->date_format);
+			}
+		} else {
+			lua_pushlstring (L, value->data, value->len);
+		}
+
+		log_set (lb, log_field (name));
+	}
+
+	if (changed_paths != NULL) {
+		log_changed_paths (lb, changed_paths, pool);
+	}
+
+	if (lb->columnar) {
+		return NULL;
+	} else if (lb->ifunc) {
+		if (lua_pcall (L, 2, 1, 0) != 0) {
+			lb->failed = TRUE;
+			return svn_error_create (SVN_ERR_CANCELLED, NULL, lua_tostring (L, -1));
+		}
+
+		if (lua_isboolean (L, -1) && !lua_toboolean (L, -1)) {
+			lb->stopped = TRUE;
+		}
+		lua_pop (L, 1);
+
+		if (lb->stopped) {
+			return svn_error_create (SVN_ERR_CEASE_INVOCATION, NULL, NULL);
+		}
+	} else if (lb->append) {
+		lua_rawseti (L, lb->itable, 2 * lb->count);
+		lua_rawseti (L, lb->itable, 2 * lb->count - 1);
+	} else {
+		lua_settable (L, lb->itable);
+	}
+
+	return NULL;
+}
+
+
+#ifdef HAVE_LOG_REVPROPS
+
+static svn_error_t *
+log_entry_receiver (void *baton, svn_log_entry_t *entry, apr_pool_t *pool) {
+	return log_entry (baton, entry->revision, entry->changed_paths,
+			entry->revprops, pool);
+}
+
+#else
+
+/* Older servers send every revprop, so the filtering happens here */
+static svn_error_t *
+log_receiver (void *baton,
+			  apr_hash_t *changed_paths,
+			  svn_revnum_t revision,
+			  const char *author,
+			  const char *date,
+			  const char *message,
+			  apr_pool_t *pool) 
+{
+	apr_hash_t *revprops = apr_hash_make (pool);
+
+	if (author) {
+		apr_hash_set (revprops, SVN_PROP_REVISION_AUTHOR, APR_HASH_KEY_STRING,
+				svn_string_create (author, pool));
+	}
+
+	if (date) {
+		apr_hash_set (revprops, SVN_PROP_REVISION_DATE, APR_HASH_KEY_STRING,
+				svn_string_create (date, pool));
+	}
+
+	if (message) {
+		apr_hash_set (revprops, SVN_PROP_REVISION_LOG, APR_HASH_KEY_STRING,
+				svn_string_create (message, pool));
+	}
+
+	return log_entry (baton, revision, changed_paths, revprops, pool);
+}
+
+#endif
+
+
+/* The log of a path of a repository, cached in an append-only file.
+   The file is a sequence of entry records, "E rev author_len date_len
+   message_len\n" followed by the three values and a newline, of head
+   records, "H rev\n", and of base records, "B rev\n", telling that the
+   entries of every revision from the lowest base up to the highest head
+   precede them. A file without base records covers from revision 0.
+   A length of -1 stands for a missing value. The last entry record of a
+   revision is the one that counts, and a reset record, "X\n", drops the
+   records before it, when the node of the path was replaced */
+typedef struct log_cache_t {
+	const char *path;
+	apr_hash_t *offsets; /* revision -> offset of its entry record */
+	apr_array_header_t *revs; /* revisions with an entry, sorted */
+	svn_revnum_t head; /* youngest revision covered, -1 if none */
+	svn_revnum_t base; /* oldest revision covered, -1 if none */
+	apr_off_t size;
+	apr_pool_t *pool;
+} log_cache_t;
+
+
+/* Appends the entries of a log to a log_cache_t */
+typedef struct log_cache_bt {
+	log_cache_t *lc;
+	apr_file_t *file;
+	int count;
+	svn_revnum_t oldest; /* revision of the oldest entry appended */
+} log_cache_bt;
+
+
+#define LOG_CACHE_LEN(s) ((s) ? (long) (s)->len : -1L)
+
+
+static int
+log_cache_compare (const void *a, const void *b) {
+	svn_revnum_t ra = *((const svn_revnum_t *) a);
+	svn_revnum_t rb = *((const svn_revnum_t *) b);
+
+	return ra < rb ? -1 : ra > rb;
+}
+
+
+/* Rebuilds the sorted list of revisions of LC */
+static void
+log_cache_sort (log_cache_t *lc) {
+	apr_hash_index_t *hi;
+
+	lc->revs = apr_array_make (lc->pool, apr_hash_count (lc->offsets),
+			sizeof (svn_revnum_t));
+
+	for (hi = apr_hash_first (NULL, lc->offsets); hi; hi = apr_hash_next (hi)) {
+		const void *key;
+
+		apr_hash_this (hi, &key, NULL, NULL);
+		APR_ARRAY_PUSH (lc->revs, svn_revnum_t) = *((const svn_revnum_t *) key);
+	}
+
+	qsort (lc->revs->elts, lc->revs->nelts, sizeof (svn_revnum_t), log_cache_compare);
+}
+
+
+static void
+log_cache_set (log_cache_t *lc, svn_revnum_t rev, apr_off_t offset) {
+	apr_off_t *value = apr_hash_get (lc->offsets, &rev, sizeof (rev));
+
+	if (value == NULL) {
+		svn_revnum_t *key = apr_palloc (lc->pool, sizeof (rev));
+
+		*key = rev;
+		value = apr_palloc (lc->pool, sizeof (apr_off_t));
+		apr_hash_set (lc->offsets, key, sizeof (rev), value);
+	}
+
+	*value = offset;
+}
+
+
+/* Forgets the records of LC read so far */
+static void
+log_cache_forget (log_cache_t *lc) {
+	lc->offsets = apr_hash_make (lc->pool);
+	lc->head = SVN_INVALID_REVNUM;
+	lc->base = SVN_INVALID_REVNUM;
+}
+
+
+/* Reads the records of the file of LC, open in FILE, that follow the
+   ones already read, which may have been appended by another process.
+   Entries that are not followed by a head record are kept, since they
+   are complete; a record cut short by a failed write is removed from
+   the file. FILE must be locked */
+static svn_error_t *
+log_cache_scan (log_cache_t *lc, apr_file_t *file, apr_pool_t *pool) {
+	apr_finfo_t finfo;
+	apr_off_t offset = lc->size;
+	apr_status_t status;
+	svn_error_t *err;
+
+	SVN_ERR (svn_io_file_info_get (&finfo, APR_FINFO_SIZE, file, pool));
+
+	if (offset >= finfo.size) {
+		return SVN_NO_ERROR;
+	}
+
+	SVN_ERR (svn_io_file_seek (file, APR_SET, &offset, pool));
+
+	while (offset < finfo.size) {
+		char line[128];
+		apr_size_t len = sizeof (line);
+		long rev, alen, dlen, mlen;
+		apr_off_t next;
+
+		err = svn_io_read_length_line (file, line, &len, pool);
+		if (err) {
+			svn_error_clear (err);
+			break;
+		}
+
+		next = offset + len + 1;
+
+		if (sscanf (line, "H %ld", &rev) == 1) {
+			if (rev > lc->head) {
+				lc->head = rev;
+			}
+		} else if (sscanf (line, "B %ld", &rev) == 1) {
+			if (!SVN_IS_VALID_REVNUM (lc->base) || rev < lc->base) {
+				lc->base = rev;
+			}
+		} else if (strcmp (line, "X") == 0) {
+			log_cache_forget (lc);
+		} else if (sscanf (line, "E %ld %ld %ld %ld", &rev, &alen, &dlen, &mlen) == 4) {
+			next += (alen > 0 ? alen : 0) + (dlen > 0 ? dlen : 0) + (mlen > 0 ? mlen : 0) + 1;
+			if (next > finfo.size) {
+				break;
+			}
+
+			log_cache_set (lc, rev, offset);
+			SVN_ERR (svn_io_file_seek (file, APR_SET, &next, pool));
+		} else {
+			break;
+		}
+
+		offset = next;
+	}
+
+	if (offset < finfo.size) {
+		status = apr_file_trunc (file, offset);
+		if (status) {
+			return svn_error_wrap_apr (status, "Can't truncate '%s'", lc->path);
+		}
+	}
+
+	/* written before base records existed */
+	if (SVN_IS_VALID_REVNUM (lc->head) && !SVN_IS_VALID_REVNUM (lc->base)) {
+		lc->base = 0;
+	}
+
+	lc->size = offset;
+	log_cache_sort (lc);
+
+	return SVN_NO_ERROR;
+}
+
+
+/* Opens the file of LC, creating it if needed, and locks it against
+   the other processes that use the same cache */
+static svn_error_t *
+log_cache_open (apr_file_t **file, log_cache_t *lc, apr_int32_t flags, apr_pool_t *pool) {
+	apr_status_t status;
+
+	SVN_ERR (svn_io_file_open (file, lc->path,
+			flags | APR_READ | APR_WRITE | APR_CREATE | APR_BINARY, APR_OS_DEFAULT, pool));
+
+	status = apr_file_lock (*file, APR_FLOCK_EXCLUSIVE);
+	if (status) {
+		svn_error_clear (svn_io_file_close (*file, pool));
+		return svn_error_wrap_apr (status, "Can't lock '%s'", lc->path);
+	}
+
+	return SVN_NO_ERROR;
+}
+
+
+/* Reads the file of LC */
+static svn_error_t *
+log_cache_load (log_cache_t *lc, apr_pool_t *pool) {
+	apr_file_t *file;
+	svn_error_t *err;
+
+	SVN_ERR (log_cache_open (&file, lc, 0, pool));
+
+	err = log_cache_scan (lc, file, pool);
+
+	/* closing the file releases the lock */
+	if (err) {
+		svn_error_clear (svn_io_file_close (file, pool));
+		return err;
+	}
+
+	return svn_io_file_close (file, pool);
+}
+
+
+/* Gets the cache of the log of URL, reading it on first use. The file
+   is named after the path of URL in the repository, in a directory
+   named after the UUID of the repository */
+static svn_error_t *
+log_cache_get (log_cache_t **result, session_t *session, ra_conn_t *conn,
+               const char *url, apr_pool_t *pool) {
+	apr_pool_t *lc_pool;
+	log_cache_t *lc;
+	svn_error_t *err;
+	const char *uuid;
+	const char *dir;
+	unsigned char digest[APR_MD5_DIGESTSIZE];
+	const char *relpath;
+
+	lc = apr_hash_get (session->log_caches, url, APR_HASH_KEY_STRING);
+	if (lc != NULL) {
+		*result = lc;
+		return SVN_NO_ERROR;
+	}
+
+	SVN_ERR (svn_ra_get_uuid (conn->ra, &uuid, pool));
+
+	dir = svn_path_join (session->log_cache_dir, uuid, pool);
+	SVN_ERR (svn_io_make_dir_recursively (dir, pool));
+
+	relpath = url + strlen (conn->root);
+	apr_md5 (digest, relpath, strlen (relpath));
+
+	/* a pool of its own, so that a cache that fails to load is released */
+	lc_pool = svn_pool_create (session->log_cache_pool);
+	lc = apr_pcalloc (lc_pool, sizeof (log_cache_t));
+	lc->pool = lc_pool;
+	lc->path = svn_path_join (dir,
+			apr_pstrcat (pool, svn_md5_digest_to_cstring_display (digest, pool), ".log", NULL),
+			lc->pool);
+	log_cache_forget (lc);
+
+	err = log_cache_load (lc, pool);
+	if (err) {
+		svn_pool_destroy (lc_pool);
+		return err;
+	}
+
+	apr_hash_set (session->log_caches, apr_pstrdup (lc->pool, url), APR_HASH_KEY_STRING, lc);
+
+	*result = lc;
+	return SVN_NO_ERROR;
+}
+
+
+static svn_error_t *
+log_cache_write (log_cache_bt *lb, svn_revnum_t rev, const svn_string_t *author,
+                 const svn_string_t *date, const svn_string_t *message, apr_pool_t *pool) {
+	const char *header;
+	apr_size_t len;
+
+	header = apr_psprintf (pool, "E %ld %ld %ld %ld\n", rev,
+			LOG_CACHE_LEN (author), LOG_CACHE_LEN (date), LOG_CACHE_LEN (message));
+	len = strlen (header);
+
+	SVN_ERR (svn_io_file_write_full (lb->file, header, len, NULL, pool));
+
+	if (author) {
+		SVN_ERR (svn_io_file_write_full (lb->file, author->data, author->len, NULL, pool));
+	}
+	if (date) {
+		SVN_ERR (svn_io_file_write_full (lb->file, date->data, date->len, NULL, pool));
+	}
+	if (message) {
+		SVN_ERR (svn_io_file_write_full (lb->file, message->data, message->len, NULL, pool));
+	}
+	SVN_ERR (svn_io_file_write_full (lb->file, "\n", 1, NULL, pool));
+
+	log_cache_set (lb->lc, rev, lb->lc->size);
+
+	if (!SVN_IS_VALID_REVNUM (lb->oldest) || rev < lb->oldest) {
+		lb->oldest = rev;
+	}
+
+	lb->lc->size += len + 1;
+	lb->lc->size += author ? author->len : 0;
+	lb->lc->size += date ? date->len : 0;
+	lb->lc->size += message ? message->len : 0;
+	lb->count++;
+
+	return SVN_NO_ERROR;
+}
+
+
+#ifdef HAVE_LOG_REVPROPS
+
+static svn_error_t *
+log_cache_receiver (void *baton, svn_log_entry_t *entry, apr_pool_t *pool) {
+	return log_cache_write (baton, entry->revision,
+			apr_hash_get (entry->revprops, SVN_PROP_REVISION_AUTHOR, APR_HASH_KEY_STRING),
+			apr_hash_get (entry->revprops, SVN_PROP_REVISION_DATE, APR_HASH_KEY_STRING),
+			apr_hash_get (entry->revprops, SVN_PROP_REVISION_LOG, APR_HASH_KEY_STRING),
+			pool);
+}
+
+#else
+
+static svn_error_t *
+log_cache_receiver (void *baton,
+                    apr_hash_t *changed_paths,
+                    svn_revnum_t revision,
+                    const char *author,
+                    const char *date,
+                    const char *message,
+                    apr_pool_t *pool)
+{
+	return log_cache_write (baton, revision,
+			author ? svn_string_create (author, pool) : NULL,
+			date ? svn_string_create (date, pool) : NULL,
+			message ? svn_string_create (message, pool) : NULL,
+			pool);
+}
+
+#endif
+
+
+/* Appends to the file of LC, open in FILE, the youngest LIMIT entries of
+   the log of the session URL of RA between START and END, or all of them
+   when LIMIT is 0. Sets COUNT to the number of entries fetched, and OLDEST
+   to the revision of the oldest one */
+static svn_error_t *
+log_cache_fetch (int *count, svn_revnum_t *oldest, log_cache_t *lc, apr_file_t *file,
+                 svn_ra_session_t *ra, svn_revnum_t start, svn_revnum_t end, int limit,
+                 apr_pool_t *pool) {
+	apr_array_header_t *paths;
+	log_cache_bt baton;
+	svn_error_t *err;
+
+	paths = apr_array_make (pool, 1, sizeof (const char *));
+	APR_ARRAY_PUSH (paths, const char *) = "";
+
+	baton.lc = lc;
+	baton.file = file;
+	baton.count = 0;
+	baton.oldest = SVN_INVALID_REVNUM;
+
+#ifdef HAVE_LOG_REVPROPS
+	err = svn_ra_get_log2 (ra, paths, end, start, limit, FALSE, FALSE, FALSE,
+			log_default_revprops (pool), log_cache_receiver, &baton, pool);
+#else
+	err = svn_ra_get_log (ra, paths, end, start, limit, FALSE, FALSE,
+			log_cache_receiver, &baton, pool);
+#endif
+
+	*count = baton.count;
+	*oldest = baton.oldest;
+
+	return err;
+}
+
+
+/* Appends RECORD to the file of LC, open in FILE */
+static svn_error_t *
+log_cache_record (log_cache_t *lc, apr_file_t *file, const char *record, apr_pool_t *pool) {
+	SVN_ERR (svn_io_file_write_full (file, record, strlen (record), NULL, pool));
+
+	lc->size += strlen (record);
+
+	return SVN_NO_ERROR;
+}
+
+
+/* Extends the range covered by LC, open in FILE, to BASE and HEAD. The
+   records are only written when the range grows, so polling a cache that
+   is up to date does not make its file grow */
+static svn_error_t *
+log_cache_cover (log_cache_t *lc, apr_file_t *file, svn_revnum_t base,
+                 svn_revnum_t head, apr_pool_t *pool) {
+	if (!SVN_IS_VALID_REVNUM (lc->base) || base < lc->base) {
+		SVN_ERR (log_cache_record (lc, file, apr_psprintf (pool, "B %ld\n", base), pool));
+		lc->base = base;
+	}
+
+	if (!SVN_IS_VALID_REVNUM (lc->head) || head > lc->head) {
+		SVN_ERR (log_cache_record (lc, file, apr_psprintf (pool, "H %ld\n", head), pool));
+		lc->head = head;
+	}
+
+	return SVN_NO_ERROR;
+}
+
+
+/* Returns the number of entries of LC between START and END */
+static int
+log_cache_count (log_cache_t *lc, svn_revnum_t start, svn_revnum_t end) {
+	int count = 0;
+	int i;
+
+	for (i = 0; i < lc->revs->nelts; i++) {
+		svn_revnum_t rev = APR_ARRAY_IDX (lc->revs, i, svn_revnum_t);
+
+		if (rev >= start && rev <= end) {
+			count++;
+		}
+	}
+
+	return count;
+}
+
+
+/* Fetches into LC what a log of the session URL of RA between START and
+   END, of at most LIMIT entries when it is not 0, needs. All the
+   revisions newer than the ones covered are fetched, so that LC covers a
+   single range, but the older ones only as far back as the log goes.
+   When RESET is set, the node of the path was replaced, and the records
+   of LC are dropped first. Sets COUNT to the number of entries fetched */
+static svn_error_t *
+log_cache_fill (int *count, log_cache_t *lc, svn_ra_session_t *ra,
+                svn_revnum_t start, svn_revnum_t end, int limit,
+                svn_boolean_t reset, apr_pool_t *pool) {
+	apr_file_t *file;
+	svn_error_t *err;
+	svn_revnum_t oldest;
+	int n;
+
+	*count = 0;
+
+	SVN_ERR (log_cache_open (&file, lc, APR_APPEND | APR_BUFFERED, pool));
+
+	/* another process may have appended to the file meanwhile */
+	err = log_cache_scan (lc, file, pool);
+
+	if (!err && reset && SVN_IS_VALID_REVNUM (lc->head)) {
+		err = log_cache_record (lc, file, "X\n", pool);
+		log_cache_forget (lc);
+		log_cache_sort (lc);
+	}
+
+	if (!err && !SVN_IS_VALID_REVNUM (lc->head)) {
+		/* the first log seeds the cache with what it asks for */
+		err = log_cache_fetch (&n, &oldest, lc, file, ra, start, end, limit, pool);
+		*count += n;
+
+		if (!err) {
+			err = log_cache_cover (lc, file,
+					(limit > 0 && n == limit) ? oldest : start, end, pool);
+		}
+	} else if (!err) {
+		if (end > lc->head) {
+			err = log_cache_fetch (&n, &oldest, lc, file, ra, lc->head + 1, end, 0, pool);
+			*count += n;
+
+			if (!err) {
+				err = log_cache_cover (lc, file, lc->base, end, pool);
+			}
+		}
+
+		if (!err) {
+			log_cache_sort (lc);
+		}
+
+		/* the log goes on from the base, where the node of the cache is
+		   known to be, so it follows that node. The entry of the base is
+		   fetched again, if there is one */
+		if (!err && start < lc->base) {
+			int wanted = limit - log_cache_count (lc, lc->base, end);
+
+			if (limit == 0 || wanted > 0) {
+				err = log_cache_fetch (&n, &oldest, lc, file, ra, start, lc->base,
+						limit > 0 ? wanted + 1 : 0, pool);
+				*count += n;
+
+				if (!err) {
+					err = log_cache_cover (lc, file,
+							(limit > 0 && n == wanted + 1) ? oldest : start, lc->head, pool);
+				}
+			}
+		}
+	}
+
+	if (!err) {
+		err = svn_io_file_close (file, pool);
+	} else {
+		svn_error_clear (svn_io_file_close (file, pool));
+	}
+
+	log_cache_sort (lc);
+
+	return err;
+}
+
+
+/* Fetches again the entries of LC between START and END, after a change
+   of their revision properties. Sets COUNT to the number of entries fetched */
+static svn_error_t *
+log_cache_refetch (int *count, log_cache_t *lc, svn_ra_session_t *ra,
+                   svn_revnum_t start, svn_revnum_t end, apr_pool_t *pool) {
+	apr_file_t *file;
+	svn_error_t *err;
+	svn_revnum_t oldest;
+
+	*count = 0;
+
+	SVN_ERR (log_cache_open (&file, lc, APR_APPEND | APR_BUFFERED, pool));
+
+	err = log_cache_scan (lc, file, pool);
+
+	if (!err && SVN_IS_VALID_REVNUM (lc->head)) {
+		if (start < lc->base) {
+			start = lc->base;
+		}
+		if (end > lc->head) {
+			end = lc->head;
+		}
+
+		if (start <= end) {
+			err = log_cache_fetch (count, &oldest, lc, file, ra, start, end, 0, pool);
+		}
+	}
+
+	if (!err) {
+		err = svn_io_file_close (file, pool);
+	} else {
+		svn_error_clear (svn_io_file_close (file, pool));
+	}
+
+	log_cache_sort (lc);
+
+	return err;
+}
+
+
+/* Passes the entries of LC between START and END to BATON, from the
+   youngest to the oldest one */
+static svn_error_t *
+log_cache_read (log_cache_t *lc, svn_revnum_t start, svn_revnum_t end,
+                int limit, log_bt *baton, apr_pool_t *pool) {
+	apr_file_t *file;
+	apr_pool_t *subpool;
+	svn_error_t *err = SVN_NO_ERROR;
+	int i;
+
+	static const char *names[3] = {
+		SVN_PROP_REVISION_AUTHOR, SVN_PROP_REVISION_DATE, SVN_PROP_REVISION_LOG
+	};
+
+	SVN_ERR (svn_io_file_open (&file, lc->path, APR_READ | APR_BUFFERED | APR_BINARY,
+			APR_OS_DEFAULT, pool));
+
+	subpool = svn_pool_create (pool);
+
+	for (i = lc->revs->nelts - 1; i >= 0 && !err; i--) {
+		svn_revnum_t rev = APR_ARRAY_IDX (lc->revs, i, svn_revnum_t);
+		apr_off_t offset;
+		apr_hash_t *revprops;
+		char line[128];
+		apr_size_t len = sizeof (line);
+		long lens[4];
+		int j;
+
+		if (rev > end) {
+			continue;
+		}
+		if (rev < start || (limit > 0 && baton->count >= limit)) {
+			break;
+		}
+
+		svn_pool_clear (subpool);
+
+		offset = *((apr_off_t *) apr_hash_get (lc->offsets, &rev, sizeof (rev)));
+
+		err = svn_io_file_seek (file, APR_SET, &offset, subpool);
+		if (!err) {
+			err = svn_io_read_length_line (file, line, &len, subpool);
+		}
+		/* the revision, and the lengths of the values */
+		if (!err && sscanf (line, "E %ld %ld %ld %ld", &lens[0], &lens[1], &lens[2], &lens[3]) != 4) {
+			err = svn_error_createf (SVN_ERR_MALFORMED_FILE, NULL,
+					"Corrupt log cache '%s'", lc->path);
+		}
+
+		revprops = apr_hash_make (subpool);
+
+		for (j = 1; j < 4 && !err; j++) {
+			char *data;
+
+			if (lens[j] < 0) {
+				continue;
+			}
+
+			data = apr_palloc (subpool, lens[j] + 1);
+			err = svn_io_file_read_full (file, data, lens[j], NULL, subpool);
+			data[lens[j]] = '\0';
+
+			apr_hash_set (revprops, names[j - 1], APR_HASH_KEY_STRING,
+					svn_string_ncreate (data, lens[j], subpool));
+		}
+
+		if (!err) {
+			err = log_entry (baton, rev, NULL, revprops, subpool);
+		}
+	}
+
+	svn_pool_destroy (subpool);
+	svn_error_clear (svn_io_file_close (file, pool));
+
+	return err;
+}
+
+
+/* Tells whether the log cache holds every revprop in REVPROPS */
+static svn_boolean_t
+log_cacheable (const apr_array_header_t *revprops) {
+	int i;
+
+	for (i = 0; i < revprops->nelts; i++) {
+		const char *name = APR_ARRAY_IDX (revprops, i, const char *);
+
+		if (strcmp (name, SVN_PROP_REVISION_AUTHOR) != 0
+				&& strcmp (name, SVN_PROP_REVISION_DATE) != 0
+				&& strcmp (name, SVN_PROP_REVISION_LOG) != 0) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+
+/* Tells whether ERR says that a node is not where it was looked for */
+static svn_boolean_t
+log_cache_moved (svn_error_t *err) {
+	for (; err != NULL; err = err->child) {
+		if (err->apr_err == SVN_ERR_CLIENT_UNRELATED_RESOURCES
+				|| err->apr_err == SVN_ERR_FS_NOT_FOUND) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+
+/* Tells in SAME whether the node at URL in revision PEG was at URL in
+   revision REV too. CONN, at URL, is left there */
+static svn_error_t *
+log_cache_same_node (svn_boolean_t *same, session_t *session, ra_conn_t **conn,
+                     const char *url, svn_revnum_t peg, svn_revnum_t rev,
+                     apr_pool_t *pool) {
+	const char *located;
+	svn_error_t *err;
+
+	err = ra_locate (&located, session, conn, url, peg, rev, pool);
+
+	if (err && log_cache_moved (err)) {
+		svn_error_clear (err);
+		*same = FALSE;
+		return SVN_NO_ERROR;
+	}
+	SVN_ERR (err);
+
+	*same = strcmp (located, url) == 0;
+
+	if (!*same) {
+		SVN_ERR (svn_ra_reparent ((*conn)->ra, url, pool));
+	}
+
+	return SVN_NO_ERROR;
+}
+
+
+/* Gets the log of URL from the log cache of SESSION, fetching first the
+   revisions it needs, see log_cache_fill. The cache holds the history of
+   the node at URL in its head, so CACHED is set to FALSE, and nothing is
+   done, when the log is about another node that was at URL before */
+static svn_error_t *
+log_cache_url (svn_boolean_t *cached, session_t *session, ra_conn_t **conn,
+               const char *url, svn_revnum_t start, svn_revnum_t end, int limit,
+               log_bt *baton, apr_pool_t *pool) {
+	log_cache_t *lc;
+	svn_boolean_t same = TRUE;
+	svn_boolean_t reset = FALSE;
+	int count = 0;
+
+	*cached = FALSE;
+
+	SVN_ERR (log_cache_get (&lc, session, *conn, url, pool));
+
+	if (SVN_IS_VALID_REVNUM (lc->head) && end > lc->head) {
+		/* the node may have been replaced since the head */
+		SVN_ERR (log_cache_same_node (&same, session, conn, url, end, lc->head, pool));
+		reset = !same;
+	} else if (SVN_IS_VALID_REVNUM (lc->head) && end < lc->base) {
+		SVN_ERR (log_cache_same_node (&same, session, conn, url, lc->base, end, pool));
+	} else if (lc->base == 0 && lc->revs->nelts > 0
+			&& end < APR_ARRAY_IDX (lc->revs, 0, svn_revnum_t)) {
+		/* the whole history is cached, and the node did not exist yet */
+		same = FALSE;
+	}
+
+	if (!same && !reset) {
+		return SVN_NO_ERROR;
+	}
+
+	SVN_ERR (log_cache_fill (&count, lc, (*conn)->ra, start, end, limit, reset, pool));
+	session->log_fetched += count;
+
+	SVN_ERR (log_cache_read (lc, start, end, limit, baton, pool));
+	session->log_hits += baton->count;
+
+	*cached = TRUE;
+
+	return SVN_NO_ERROR;
+}
+
+
+/* Gets the log of URL between START and END, from the youngest to the
+   oldest revision, using a pooled connection of SESSION. URL is taken in
+   the revision PEG, or in HEAD when PEG is NULL or not valid, and PEG is
+   then set to that revision, so that the pages of a log follow the same
+   node across its copies and renames */
+static svn_error_t *
+log_url (session_t *session, const char *url, svn_revnum_t *peg,
+         const svn_opt_revision_t *start, const svn_opt_revision_t *end,
+         int limit, svn_boolean_t discover_changed_paths, svn_boolean_t stop_on_copy,
+         log_bt *baton, apr_pool_t *pool) {
+	ra_conn_t *conn;
+	svn_revnum_t start_rev, end_rev;
+	apr_array_header_t *paths;
+	svn_boolean_t cached = FALSE;
+	svn_error_t *err;
+
+	SVN_ERR (ra_acquire (&conn, session, url, pool));
+
+	paths = apr_array_make (pool, 1, sizeof (const char *));
+	(*((const char **) apr_array_push (paths))) = "";
+
+	err = ra_revnum (&start_rev, conn->ra, start, pool);
+
+	if (!err) {
+		err = ra_revnum (&end_rev, conn->ra, end, pool);
+	}
+
+	/* the log starts where URL was in the youngest revision asked for */
+	if (!err) {
+		svn_revnum_t head = (peg != NULL) ? *peg : SVN_INVALID_REVNUM;
+
+		if (!SVN_IS_VALID_REVNUM (head)) {
+			if (end->kind != svn_opt_revision_number) {
+				head = end_rev;
+			} else if (start->kind != svn_opt_revision_number) {
+				head = start_rev;
+			}
+
+			if (SVN_IS_VALID_REVNUM (head)) {
+				ra_head_set (session, conn->root, head);
+			}
+		}
+
+		err = ra_trace (&url, &head, session, &conn, url,
+				start_rev > end_rev ? start_rev : end_rev, pool);
+
+		if (!err && peg != NULL) {
+			*peg = head;
+		}
+	}
+
+	if (!err && session->log_cache_dir != NULL && !discover_changed_paths
+			&& !stop_on_copy && start_rev <= end_rev && log_cacheable (baton->revprops)) {
+		err = log_cache_url (&cached, session, &conn, url, start_rev, end_rev, limit, baton, pool);
+	}
+
+	if (!err && !cached) {
+#ifdef HAVE_LOG_REVPROPS
+		err = svn_ra_get_log2 (conn->ra, paths, end_rev, start_rev, limit,
+				discover_changed_paths, stop_on_copy, FALSE, baton->revprops,
+				log_entry_receiver, baton, pool);
+#else
+		err = svn_ra_get_log (conn->ra, paths, end_rev, start_rev, limit,
+				discover_changed_paths, stop_on_copy, log_receiver, baton, pool);
+#endif
+	}
+
+	ra_release (session, conn, err);
+
+	return err;
+}
+
+
+/* Gets the log of PATH, a URL or a working copy path, between START
+   and END, from the youngest to the oldest revision. PEG is used for
+   URLs, see log_url */
+static svn_error_t *
+log_path (session_t *session, const char *path, svn_revnum_t *peg,
+          const svn_opt_revision_t *start, const svn_opt_revision_t *end,
+          int limit, svn_boolean_t discover_changed_paths, svn_boolean_t stop_on_copy,
+          log_bt *baton, apr_pool_t *pool) {
+	apr_array_header_t *array;
+	svn_opt_revision_t peg_revision;
+
+	if (svn_path_is_url (path)) {
+		return log_url (session, path, peg, start, end, limit,
+				discover_changed_paths, stop_on_copy, baton, pool);
+	}
+
+	peg_revision.kind = svn_opt_revision_unspecified;
+
+	array = apr_array_make (pool, 1, sizeof (const char *));
+	(*((const char **) apr_array_push (array))) = path;
+
+#ifdef HAVE_LOG_REVPROPS
+	return svn_client_log4 (array, &peg_revision, end, start, limit, 
+			discover_changed_paths, stop_on_copy, FALSE, baton->revprops,
+			log_entry_receiver, baton, session->ctx, pool);
+#else
+	return svn_client_log3 (array, &peg_revision, end, start, limit, 
+			discover_changed_paths, stop_on_copy, log_receiver, baton, session->ctx, pool);
+#endif
+}
+
+
+/* Reads the arguments shared by log and log_iter, and pushes the
+   revprops field of the config table */
+static void
+log_args (lua_State *L, const char **path,
+          svn_opt_revision_t *start, svn_opt_revision_t *end, int *limit,
+          svn_boolean_t *discover_changed_paths, svn_boolean_t *stop_on_copy) {
+	int itable = 5;
+
+	*path = (lua_gettop (L) < 1 || lua_isnil (L, 1)) ? "" : luaL_checkstring (L, 1);
+	*limit = 0; 
+	*discover_changed_paths = FALSE;
+	*stop_on_copy = FALSE;
+	start->kind = svn_opt_revision_number;
+	
+	if (lua_gettop (L) < 2 || lua_isnil (L, 2)) {
+		start->value.number = 0;
+	} else {
+		start->value.number = lua_tointeger (L, 2);
+	}
+
+	if (lua_gettop (L) < 3 || lua_isnil (L, 3)) {
+		end->kind = get_revision_kind (*path);
+	} else {
+		end->kind = svn_opt_revision_number;
+		end->value.number = lua_tointeger (L, 3);
+	}
+
+	if (lua_gettop (L) >= 4) {
+		*limit = lua_tointeger (L, 4);
+	}
+	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
+		lua_getfield (L, itable, "discover_changed_paths");
+		if (lua_isboolean (L, -1)) {
+			*discover_changed_paths = lua_toboolean (L, -1);
+		}
+
+		lua_getfield (L, itable, "stop_on_copy");
+		if (lua_isboolean (L, -1)) {
+			*stop_on_copy = lua_toboolean (L, -1);
+		}
+
+		lua_pop (L, 2);
+
+		lua_getfield (L, itable, "revprops");
+		log_check_revprops (L, lua_gettop (L));
+	} else {
+		lua_pushnil (L);
+	}
+}
+
+
+static int
+l_log (lua_State *L) {
+	apr_pool_t *pool;
+	svn_error_t *err;
+	svn_client_ctx_t *ctx;
+	session_t *session;
+	
+	svn_opt_revision_t start, end;
+	const char *path;
+	int limit;
+	svn_boolean_t discover_changed_paths;
+	svn_boolean_t stop_on_copy;
+	log_bt baton;
+	int irevprops;
+
+	memset (&baton, 0, sizeof (baton));
+	baton.L = L;
+
+	if (lua_gettop (L) >= 6 && !lua_isnil (L, 6)) {
+		luaL_checktype (L, 6, LUA_TFUNCTION);
+		baton.ifunc = 6;
+	} else if (lua_gettop (L) >= 5 && lua_istable (L, 5)) {
+		lua_getfield (L, 5, "columnar");
+		baton.columnar = lua_toboolean (L, -1);
+		lua_pop (L, 1);
+	}
+
+	baton.date_format = get_date_format (L, 5);
+
+	log_args (L, &path, &start, &end, &limit, &discover_changed_paths, &stop_on_copy);
+	irevprops = lua_gettop (L);
+
+	session = init_function (&ctx, &pool, L);
+
+	path = svn_path_canonicalize (path, pool);
+
+	baton.revprops = log_revprops (L, irevprops, pool);
+
+	if (!baton.ifunc) {
+		lua_newtable (L);
+		baton.itable = lua_gettop (L);
+		baton.size = limit;
+	}
+
+	if (baton.columnar) {
+		log_columns (&baton, discover_changed_paths);
+	}
+
+	err = log_path (session, path, NULL, &start, &end, limit,
+			discover_changed_paths, stop_on_copy, &baton, pool);
+
+	if (err && (baton.failed || baton.stopped)) {
+		svn_error_clear (err);
+		svn_pool_destroy (pool);
+		if (baton.failed) {
+			return lua_error (L);
+		}
+	} else {
+		IF_ERROR_RETURN (err, pool, L);
+		svn_pool_destroy (pool);
+	}
+
+	if (baton.ifunc) {
+		lua_pushinteger (L, baton.count);
+	}
+
+	return 1;
+}
+
+
+/* State of the iterator returned by log_iter, which fetches the log in
+   pages of growing size, each one starting below the last revision of
+   the previous page. The session, the path, the current page and the
+   list of revprops are upvalues of the iterator */
+typedef struct log_iter_t {
+	svn_opt_revision_t start;
+	svn_opt_revision_t end;
+	int limit; /* entries still to be returned, 0 for no limit */
+	int page; /* size of the next page */
+	int index; /* position of the next entry in the current page */
+	int count; /* number of entries in the current page */
+	int date_format;
+	svn_boolean_t discover_changed_paths;
+	svn_boolean_t stop_on_copy;
+	svn_boolean_t done;
+	svn_revnum_t peg; /* revision the URL is taken in, set by the first page */
+} log_iter_t;
+
+
+/* Replaces the current page of the iterator by the next one */
+static int
+log_iter_fetch (lua_State *L, log_iter_t *iter) {
+	apr_pool_t *pool;
+	svn_error_t *err;
+	session_t *session = lua_touserdata (L, lua_upvalueindex (2));
+	const char *path = lua_tostring (L, lua_upvalueindex (3));
+	int limit = iter->page;
+	log_bt baton;
+
+	if (session->pool == NULL) {
+		return send_error (L, "Session is closed\n");
+	}
+
+	if (iter->limit > 0 && iter->limit < limit) {
+		limit = iter->limit;
+	}
+
+	/* the list may have been changed since log_iter was called */
+	log_check_revprops (L, lua_upvalueindex (5));
+
+	pool = svn_pool_create (session->pool);
+
+	memset (&baton, 0, sizeof (baton));
+	baton.L = L;
+	baton.append = TRUE;
+	baton.revprops = log_revprops (L, lua_upvalueindex (5), pool);
+	baton.date_format = iter->date_format;
+
+	lua_newtable (L);
+	baton.itable = lua_gettop (L);
+
+	err = log_path (session, path, &iter->peg, &iter->start, &iter->end, limit,
+			iter->discover_changed_paths, iter->stop_on_copy, &baton, pool);
+
+	if (err) {
+		iter->done = TRUE;
+	}
+	IF_ERROR_RETURN (err, pool, L);
+
+	svn_pool_destroy (pool);
+
+	lua_replace (L, lua_upvalueindex (4));
+
+	iter->index = 0;
+	iter->count = baton.count;
+
+	if (iter->limit > 0) {
+		iter->limit -= baton.count;
+		iter->done = (iter->limit <= 0);
+	}
+
+	if (baton.count < limit || baton.last <= iter->start.value.number) {
+		iter->done = TRUE;
+	}
+
+	if (!iter->done) {
+		iter->end.kind = svn_opt_revision_number;
+		iter->end.value.number = baton.last - 1;
+
+		if (iter->page < LOG_PAGE_MAX) {
+			iter->page *= 2;
+		}
+	}
+
+	return 0;
+}
+
+
+static int
+log_iter_next (lua_State *L) {
+	log_iter_t *iter = lua_touserdata (L, lua_upvalueindex (1));
+
+	if (iter->index == iter->count) {
+		if (iter->done) {
+			return 0;
+		}
+
+		log_iter_fetch (L, iter);
+
+		if (iter->count == 0) {
+			return 0;
+		}
+	}
+
+	iter->index++;
+
+	lua_rawgeti (L, lua_upvalueindex (4), 2 * iter->index - 1);
+	lua_rawgeti (L, lua_upvalueindex (4), 2 * iter->index);
+
+	return 2;
+}
+
+
+static int
+l_log_cache (lua_State *L) {
+	session_t *session = get_session (L);
+
+	if (lua_gettop (L) >= 1 && lua_istable (L, 1)) {
+		lua_getfield (L, 1, "dir");
+		if (lua_isstring (L, -1) || (lua_isboolean (L, -1) && !lua_toboolean (L, -1))) {
+			if (session->log_cache_pool != NULL) {
+				svn_pool_destroy (session->log_cache_pool);
+				session->log_cache_pool = NULL;
+				session->log_caches = NULL;
+				session->log_cache_dir = NULL;
+			}
+
+			if (lua_isstring (L, -1)) {
+				session->log_cache_pool = svn_pool_create (session->pool);
+				session->log_caches = apr_hash_make (session->log_cache_pool);
+				session->log_cache_dir = svn_path_canonicalize (
+						apr_pstrdup (session->log_cache_pool, lua_tostring (L, -1)),
+						session->log_cache_pool);
+			}
+		}
+
+		lua_getfield (L, 1, "reset");
+		if (lua_toboolean (L, -1)) {
+			session->log_hits = session->log_fetched = 0;
+		}
+
+		lua_pop (L, 2);
+	}
+
+	lua_newtable (L);
+
+	lua_pushnumber (L, session->log_hits);
+	lua_setfield (L, -2, "hits");
+
+	lua_pushnumber (L, session->log_fetched);
+	lua_setfield (L, -2, "fetched");
+
+	if (session->log_cache_dir) {
+		lua_pushstring (L, session->log_cache_dir);
+		lua_setfield (L, -2, "dir");
+	}
+
+	return 1;
+}
+
+
+static int
+l_log_iter (lua_State *L) {
+	apr_pool_t *pool;
+	session_t *session;
+	log_iter_t *iter;
+	int irevprops;
+	int date_format = get_date_format (L, 5);
+	int page = LOG_PAGE_MIN;
+
+	const char *path;
+	svn_opt_revision_t start, end;
+	int limit;
+	svn_boolean_t discover_changed_paths;
+	svn_boolean_t stop_on_copy;
+
+	if (lua_gettop (L) >= 5 && lua_istable (L, 5)) {
+		lua_getfield (L, 5, "page");
+		if (lua_isnumber (L, -1)) {
+			page = lua_tointeger (L, -1);
+		}
+		lua_pop (L, 1);
+
+		luaL_argcheck (L, page > 0, 5, "page must be positive");
+	}
+
+	log_args (L, &path, &start, &end, &limit, &discover_changed_paths, &stop_on_copy);
+	irevprops = lua_gettop (L);
+
+	/* the session must outlive the iterator */
+	lua_getfield (L, LUA_REGISTRYINDEX, SESSION_CURRENT);
+	session = get_session (L);
+	if (lua_isnil (L, -1)) {
+		lua_pop (L, 1);
+		lua_getfield (L, LUA_REGISTRYINDEX, SESSION_DEFAULT);
+	}
+
+	iter = lua_newuserdata (L, sizeof (log_iter_t));
+	memset (iter, 0, sizeof (log_iter_t));
+	iter->start = start;
+	iter->end = end;
+	iter->limit = limit;
+	iter->page = page;
+	iter->peg = SVN_INVALID_REVNUM;
+	iter->date_format = date_format;
+	iter->discover_changed_paths = discover_changed_paths;
+	iter->stop_on_copy = stop_on_copy;
+
+	lua_insert (L, -2);
+
+	pool = svn_pool_create (session->pool);
+	lua_pushstring (L, svn_path_canonicalize (path, pool));
+	svn_pool_destroy (pool);
+
+	lua_newtable (L);
+	lua_pushvalue (L, irevprops);
+
+	lua_pushcclosure (L, log_iter_next, 5);
+
+	return 1;
+}
+
+
+static int
+l_log_refresh (lua_State *L) {
+	apr_pool_t *pool;
+	svn_error_t *err;
+	svn_client_ctx_t *ctx;
+	session_t *session;
+
+	svn_opt_revision_t start, end;
+	svn_revnum_t start_rev, end_rev;
+	svn_revnum_t head = SVN_INVALID_REVNUM;
+	ra_conn_t *conn;
+	log_cache_t *lc;
+	int count = 0;
+
+	const char *url = luaL_checkstring (L, 1);
+	start.kind = svn_opt_revision_number;
+	end.kind = svn_opt_revision_head;
+
+	if (lua_gettop (L) < 2 || lua_isnil (L, 2)) {
+		start.value.number = 0;
+	} else {
+		start.value.number = lua_tointeger (L, 2);
+	}
+
+	if (lua_gettop (L) >= 3 && !lua_isnil (L, 3)) {
+		end.kind = svn_opt_revision_number;
+		end.value.number = lua_tointeger (L, 3);
+	}
+
+	session = init_function (&ctx, &pool, L);
+
+	if (session->log_cache_dir == NULL) {
+		svn_pool_destroy (pool);
+		return send_error (L, "The log cache is disabled\n");
+	}
+
+	url = svn_path_canonicalize (url, pool);
+
+	if (!svn_path_is_url (url)) {
+		err = svn_error_createf (SVN_ERR_RA_ILLEGAL_URL, NULL, "'%s' is not a URL", url);
+		IF_ERROR_RETURN (err, pool, L);
+	}
+
+	err = ra_acquire (&conn, session, url, pool);
+	IF_ERROR_RETURN (err, pool, L);
+
+	err = ra_revnum (&start_rev, conn->ra, &start, pool);
+
+	if (!err) {
+		err = ra_revnum (&end_rev, conn->ra, &end, pool);
+	}
+
+	/* the cache is the one log uses, that of the location of URL, taken
+	   in HEAD, in the youngest revision asked for */
+	if (!err) {
+		err = ra_trace (&url, &head, session, &conn, url,
+				start_rev > end_rev ? start_rev : end_rev, pool);
+	}
+
+	if (!err) {
+		err = log_cache_get (&lc, session, conn, url, pool);
+	}
+
+	/* only the revisions already cached are fetched again */
+	if (!err) {
+		err = log_cache_refetch (&count, lc, conn->ra, start_rev, end_rev, pool);
+	}
+
+	ra_release (session, conn, err);
+	IF_ERROR_RETURN (err, pool, L);
+
+	svn_pool_destroy (pool);
+
+	lua_pushinteger (L, count);
+
+	return 1;
+}
+
+
+static int
+l_merge (lua_State *L) {
+	apr_pool_t *pool;
+	svn_error_t *err;
+	svn_client_ctx_t *ctx;
+
+	svn_opt_revision_t rev1;
+	svn_opt_revision_t rev2;
+
+	const char *source1 = NULL;
+	const char *source2 = NULL;
+	const char *wcpath = NULL;
+	int itable = 6;
+	svn_boolean_t recursive = TRUE;
+	svn_boolean_t ignore_ancestry = FALSE;
+	svn_boolean_t force = FALSE;
+	svn_boolean_t dry_run = FALSE;
+
+	source1 = luaL_checkstring (L, 1);
+		
+	if (lua_isnil (L, 2)) {
+		rev1.kind = svn_opt_revision_head;
+	} else {
+		rev1.kind = svn_opt_revision_number;
+		rev1.value.number = lua_tointeger (L, 2);
+	}
+
+	source2 = luaL_checkstring (L, 3);
+
+	if (lua_isnil (L, 4)) {
+		rev2.kind = svn_opt_revision_head;
+	} else {
+		rev2.kind = svn_opt_revision_number;
+		rev2.value.number = lua_tointeger (L, 4);
+	}
+
+	if (lua_gettop (L) < 5 || lua_isnil (L, 5)) {
+		wcpath = "";
+	} else {
+		wcpath = luaL_checkstring (L, 5);
+	}
+
+	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
+		lua_getfield (L, itable, "recursive");
+		if (lua_isboolean (L, -1)) {
+			recursive = lua_toboolean (L, -1);
+		}
+
+		lua_getfield (L, itable, "ignore_ancestry");
+		if (lua_isboolean (L, -1)) {
+			ignore_ancestry = lua_toboolean (L, -1);
+		}
+		
+		lua_getfield (L, itable, "force");
+		if (lua_isboolean (L, -1)) {
+			force = lua_toboolean (L, -1);
+		}
+		
+		lua_getfield (L, itable, "dry_run");
+		if (lua_isboolean (L, -1)) {
+			dry_run = lua_toboolean (L, -1);
+		}
+	}
+
+	init_function (&ctx, &pool, L);
+
+	source1 = svn_path_canonicalize (source1, pool);
+	source2 = svn_path_canonicalize (source2, pool);
+	wcpath = svn_path_canonicalize (wcpath, pool);
+
+	err = svn_client_merge2 (source1, &rev1, source2, &rev2, wcpath,
+			recursive, ignore_ancestry, force, dry_run, NULL, ctx, pool);
+	IF_ERROR_RETURN (err, pool, L);	
+
+	svn_pool_destroy (pool);
+
+	return 0;
+}
+
+
+static int
+l_mkdir (lua_State *L) {
+	apr_pool_t *pool;
+	svn_error_t *err;
+	svn_client_ctx_t *ctx;
+	session_t *session;
+	
+	apr_array_header_t *array;
+	
+	const char *path = luaL_checkstring (L, 1);
+	const char *message = (lua_gettop (L) < 2 || lua_isnil (L, 2)) ? "" : luaL_checkstring (L, 2);
+	svn_commit_info_t *commit_info = NULL;
+
+	session = init_function (&ctx, &pool, L);
+
+	path = svn_path_canonicalize (path, pool);
+
+	array = apr_array_make (pool, 1, sizeof (const char *));
+	(*((const char **) apr_array_push (array))) = path;
+
+	if (svn_path_is_url (path)) {
+		make_log_msg_baton (&(ctx->log_msg_baton2), message, NULL, ctx->config, pool, L);
+		ctx->log_msg_func2 = log_msg_func2;
+	}
+
+	err = svn_client_mkdir2 (&commit_info, array, ctx, pool);
+	IF_ERROR_RETURN (err, pool, L);
+
+	if (commit_info == NULL) {
+		lua_pushnil (L);
+	} else {
+		ra_heads_expire (session);
+		lua_pushinteger (L, commit_info->revision);
+	}
+
+	svn_pool_destroy (pool);
+
+	return 1;
+}
+
+
+static int
+l_move (lua_State *L) {
+	apr_pool_t *pool;
+	svn_error_t *err;
+	svn_client_ctx_t *ctx;
+	session_t *session;
+	
+	const char *src_path = luaL_checkstring (L, 1);
+	const char *dest_path = luaL_checkstring (L, 2);
+	const char *message = (lua_gettop (L) < 3 || lua_isnil (L, 3)) ? "" : luaL_checkstring (L, 3);
+	int itable = 4;
+	svn_boolean_t force = FALSE;
+	svn_commit_info_t *commit_info = NULL;
+	
+	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
+		lua_getfield (L, itable, "force");
+		if (lua_isboolean (L, -1)) {
+			force = lua_toboolean (L, -1);
+		}
+	} 
+
+	session = init_function (&ctx, &pool, L);
+
+	src_path = svn_path_canonicalize (src_path, pool);
+	dest_path = svn_path_canonicalize (dest_path, pool);
+	
+	if (svn_path_is_url (dest_path)) {
+		make_log_msg_baton (&(ctx->log_msg_baton2), message, NULL, ctx->config, pool, L);
+		ctx->log_msg_func2 = log_msg_func2;
+	}
+
+	err = svn_client_move4 (&commit_info, src_path, dest_path, force, ctx, pool);
+	IF_ERROR_RETURN (err, pool, L);	
+
+	if (commit_info == NULL) {
+		lua_pushnil (L);
+	} else {
+		ra_heads_expire (session);
+		lua_pushinteger (L, commit_info->revision);
+	}
+
+	svn_pool_destroy (pool);
+
+	return 1;
+}
+
+
+static int
+l_propget (lua_State *L) {
+	apr_pool_t *pool;
+	svn_error_t *err;
+	svn_client_ctx_t *ctx;
+
+	apr_hash_t *props;
+	const char *propname_utf8;
+	const void *key;
+	void *val;
+	apr_hash_index_t *hi;
+	svn_opt_revision_t peg_revision;
+	svn_opt_revision_t revision;
+
+	const char *path = luaL_checkstring (L, 1);
+	const char *propname = luaL_checkstring (L, 2);
+	int itable = 4;
+	svn_boolean_t recursive = FALSE;
+	peg_revision.kind = svn_opt_revision_unspecified;
+
+	if (lua_gettop (L) < 3 || lua_isnil (L, 3)) {
+		revision.kind = svn_opt_revision_unspecified;
+	} else {
+		revision.kind = svn_opt_revision_number;
+		revision.value.number = lua_tointeger (L, 3);
+	}
+
+	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
+		lua_getfield (L, itable, "recursive");
+		if (lua_isboolean (L, -1)) {
+			recursive = lua_toboolean (L, -1);
+		}
+	} 
+
+	init_function (&ctx, &pool, L);
+
+	path = svn_path_canonicalize (path, pool);
+	
+	err = svn_utf_cstring_to_utf8 (&propname_utf8, propname, pool);
+	IF_ERROR_RETURN (err, pool, L);
+
+	err = svn_client_propget2 (&props, propname_utf8, path, &peg_revision, &revision, recursive, ctx, pool);
+	IF_ERROR_RETURN (err, pool, L);
+
+	lua_newtable (L);
+
+	for (hi = apr_hash_first (pool, props); hi; hi = apr_hash_next (hi)) {
+	  svn_string_t *s;
+	  apr_hash_this (hi, &key, NULL, &val);
+	  s = (svn_string_t *) val;
+	  
+	  lua_pushstring (L, s->data);
+	  lua_setfield (L, -2, (char *) key);
+	}
+
+	svn_pool_destroy (pool);
+
+	return 1;
+}
+
+
+static int
+l_proplist (lua_State *L) {
+	apr_pool_t *pool;
+	svn_error_t *err;
+	svn_client_ctx_t *ctx;
+
+	apr_array_header_t *props;
+	svn_opt_revision_t peg_revision;
+	svn_opt_revision_t revision;
+	int is_url;
+	int i;
+
+	const char *path = (lua_gettop (L) < 1 || lua_isnil (L, 1)) ? "" : luaL_checkstring (L, 1);
+	int itable = 3;
+	svn_boolean_t recursive = FALSE;
+	peg_revision.kind = svn_opt_revision_unspecified;
+
+	if (lua_gettop (L) < 2 || lua_isnil (L, 2)) {
+		revision.kind = svn_opt_revision_unspecified;
+	} else {
+		revision.kind = svn_opt_revision_number;
+		revision.value.number = lua_tointeger (L, 2);
+	}	
+
+	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
+		lua_getfield (L, itable, "recursive");
+		if (lua_isboolean (L, -1)) {
+			recursive = lua_toboolean (L, -1);
+		}
+	}
+
+	init_function (&ctx, &pool, L);
+
+	path = svn_path_canonicalize (path, pool);
+
+	is_url = svn_path_is_url (path);
+
+	err = svn_client_proplist2 (&props, path, &peg_revision, &revision, recursive, ctx, pool);
+	IF_ERROR_RETURN (err, pool, L);
+
+	lua_newtable (L);
+
+	for (i = 0; i < props->nelts; ++i)
+	{
+		const void *key;
+		void *val;
+		svn_client_proplist_item_t *item = ((svn_client_proplist_item_t **)props->elts)[i];
+		apr_hash_index_t *hi;
+		const char *name_local;
+
+		if (is_url) {
+			name_local = svn_path_local_style (item->node_name->data, pool);
+		} else {
+			name_local = item->node_name->data;
+		}
+
+		lua_pushstring (L, name_local);
+
+		lua_newtable (L);
+
+		for (hi = apr_hash_first (pool, item->prop_hash); hi; hi = apr_hash_next (hi)) {
+			const char *pname;
+			svn_string_t *pval;
+			
+			apr_hash_this (hi, &key, NULL, &val);
+
+			pname = key;
+			pval = (svn_string_t *) val;
+
+			err = svn_cmdline_cstring_from_utf8 (&pname, pname, pool);
+			IF_ERROR_RETURN (err, pool, L);
+
+			lua_pushstring (L, pval->data);
+			lua_setfield (L, -2, pname);
+		}
+
+		lua_settable (L, -3);
+
+	}
+
+	svn_pool_destroy (pool);
+
+	return 1;
+}
+
+static int
+l_propset (lua_State *L) {
+	apr_pool_t *pool;
+	svn_error_t *err;
+	svn_client_ctx_t *ctx;
+
+	const char *path = luaL_checkstring (L, 1);
+	const char *propname = luaL_checkstring (L, 2);
+	const char *propval = lua_isnil (L, 3) ? NULL : luaL_checkstring (L, 3);
+	const char *propname_utf8 = NULL;
+	int itable = 4;
+	svn_boolean_t recursive = FALSE;
+	svn_boolean_t force = FALSE;
+
+	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
+		
+		lua_getfield (L, itable, "recursive");
+		if (lua_isboolean (L, -1)) {
+			recursive = lua_toboolean (L, -1);
+		}
+		
+		lua_getfield (L, itable, "force");
+		if (lua_isboolean (L, -1)) {
+			force = lua_toboolean (L, -1);
+		}
+	} 
+
+	init_function (&ctx, &pool, L);
+
+	path = svn_path_canonicalize (path, pool);
+
+	err = svn_utf_cstring_to_utf8 (&propname_utf8, propname, pool);
+	IF_ERROR_RETURN (err, pool, L);
+
+	if (propval != NULL) {
+		svn_string_t *sstring = svn_string_create (propval, pool);
+
+		err = svn_client_propset2 (propname_utf8, sstring, path, recursive, force, ctx, pool);
+	} else {
+		err = svn_client_propset2 (propname_utf8, NULL, path, recursive, force, ctx, pool);
+	}
+	IF_ERROR_RETURN (err, pool, L);
+	
+	svn_pool_destroy (pool);
+
+	return 0;
+}
+
+
+static int
+l_repos_create (lua_State *L) {
+	apr_pool_t *pool;
+	svn_error_t *err;
+	svn_repos_t *repos_p;
+	
+	const char *path = luaL_checkstring (L, 1);
+
+	pool = svn_pool_create (root_pool);
+
+	path = svn_path_canonicalize (path, pool);
+
+	err = svn_repos_create (&repos_p, path, NULL, NULL, NULL, NULL, pool);
+	IF_ERROR_RETURN (err, pool, L);
+
+	svn_pool_destroy (pool);
+
+	return 0;
+}
+
+
+static int
+l_repos_delete (lua_State *L) {
+	apr_pool_t *pool;
+	svn_error_t *err;
+	
+	const char *path = luaL_checkstring (L, 1);
+
+	pool = svn_pool_create (root_pool);
+	
+	path = svn_path_canonicalize (path, pool);
+
+	err = svn_repos_delete (path, pool);
+	IF_ERROR_RETURN (err, pool, L);
+
+	svn_pool_destroy (pool);
+
+	return 0;
+}
+
+
+static int
+l_revprop_get (lua_State *L) {
+	apr_pool_t *pool;
+	svn_error_t *err;
+	svn_client_ctx_t *ctx;
+
+	svn_opt_revision_t revision;
+	svn_string_t *propval;
+	svn_revnum_t rev;
+	svn_string_t *printable_val;
+	session_t *session;
+	ra_conn_t *conn;
+
+	const char *url = luaL_checkstring (L, 1);
+	const char *propname = luaL_checkstring (L, 2);
+	const char *propname_utf8 = NULL;
+		
+	if (lua_gettop (L) < 3 || lua_isnil (L, 3)) {
+		revision.kind = get_revision_kind (url);
+	} else {
+		revision.kind = svn_opt_revision_number;
+		revision.value.number = lua_tointeger (L, 3);
+	}
+
+	session = init_function (&ctx, &pool, L);
+
+	url = svn_path_canonicalize (url, pool);
+
+	err = svn_utf_cstring_to_utf8 (&propname_utf8, propname, pool);
+	IF_ERROR_RETURN (err, pool, L);
+
+	if (svn_path_is_url (url)) {
+		err = ra_acquire (&conn, session, url, pool);
+		IF_ERROR_RETURN (err, pool, L);
+
+		err = ra_revnum (&rev, conn->ra, &revision, pool);
+		if (!err) {
+			err = svn_ra_rev_prop (conn->ra, rev, propname_utf8, &propval, pool);
+		}
+
+		ra_release (session, conn, err);
+	} else {
+		err = svn_client_revprop_get (propname_utf8, &propval, url, &revision, &rev, ctx, pool);
+	}
+	IF_ERROR_RETURN (err, pool, L);
+
+	if (propval == NULL) {
+		svn_pool_destroy (pool);
+		lua_pushnil (L);
+		return 1;
+	}
+
+	printable_val = propval;
+	if (svn_prop_needs_translation (propname_utf8)) {
+		err = svn_subst_detranslate_string (&printable_val, propval, TRUE, pool);
+		IF_ERROR_RETURN (err, pool, L);
+	}
+
+	lua_pushstring (L, printable_val->data);
+
+	svn_pool_destroy (pool);
+
+	return 1;
+}
+
+
+static int
+l_revprop_list (lua_State *L) {
+	apr_pool_t *pool;
+	svn_error_t *err;
+	svn_client_ctx_t *ctx;
+
+	apr_hash_t *entries;
+	apr_hash_index_t *hi;
+	void *val;
+	const void *key;
+	svn_revnum_t rev;
+	svn_opt_revision_t revision;
+	
+	const char *url = luaL_checkstring (L, 1);
+
+	if (lua_gettop (L) < 2 || lua_isnil (L, 2)) {
+		revision.kind = get_revision_kind (url);
+	} else {
+		revision.kind = svn_opt_revision_number;
+		revision.value.number = lua_tointeger (L, 2);
+	}
+
+	init_function (&ctx, &pool, L);
+
+	url = svn_path_canonicalize (url, pool);
+	err = svn_client_revprop_list (&entries, url, &revision, &rev, ctx, pool);
+	IF_ERROR_RETURN (err, pool, L);
+
+	lua_newtable (L);
+
+	for (hi = apr_hash_first (pool, entries); hi; hi = apr_hash_next (hi)) {
+		const char *pname;
+		svn_string_t *pval;
+
+		apr_hash_this (hi, &key, NULL, &val);
+	
+		pname = key;
+
+		pval = (svn_string_t *) val;
+		if (svn_prop_needs_translation (pname)) {
+			err = svn_subst_translate_string (&pval, pval, APR_LOCALE_CHARSET, pool);
+			IF_ERROR_RETURN (err, pool, L);
+		}
+
+		err = svn_cmdline_cstring_from_utf8 (&pname, pname, pool);
+		IF_ERROR_RETURN (err, pool, L);
+
+		lua_pushstring (L, pval->data);
+		lua_setfield (L, -2, pname);
+	}
+
+	svn_pool_destroy (pool);
+
+	return 1;
+}
+
+
+static int
+l_revprop_set (lua_State *L) {
+	apr_pool_t *pool;
+	svn_error_t *err;
+	svn_client_ctx_t *ctx;
+
+	svn_opt_revision_t revision;
+   	svn_revnum_t rev;	
+	
+	const char *url = luaL_checkstring (L, 1);
+	const char *propname = luaL_checkstring (L, 2);
+	const char *propval = lua_isnil (L, 3) ? NULL : luaL_checkstring (L, 3);
+	const char *propname_utf8 = NULL;
+	int itable = 5;
+	svn_boolean_t force = FALSE;
+
+	if (lua_gettop (L) < 4 || lua_isnil (L, 4)) {
+		revision.kind = get_revision_kind (url);
+	} else {
+		revision.kind = svn_opt_revision_number;
+		revision.value.number = lua_tointeger (L, 4);
+	}
+
+	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
+		lua_getfield (L, itable, "force");
+		if (lua_isboolean (L, -1)) {
+			force = lua_toboolean (L, -1);
+		}
+	} 
+
+	init_function (&ctx, &pool, L);
+
+	url = svn_path_canonicalize (url, pool);
+
+	err = svn_utf_cstring_to_utf8 (&propname_utf8, propname, pool);
+	IF_ERROR_RETURN (err, pool, L);
+
+	if (propval != NULL) {
+		svn_string_t *sstring = svn_string_create (propval, pool);
+
+		if (svn_prop_needs_translation (propname_utf8)) {
+			err = svn_subst_translate_string (&sstring, sstring, APR_LOCALE_CHARSET, pool);
+			IF_ERROR_RETURN (err, pool, L);
+		}
+	
+		err = svn_client_revprop_set (propname_utf8, sstring, url, &revision, &rev, force, ctx, pool);
+	} else {
+		err = svn_client_revprop_set (propname_utf8, NULL, url, &revision, &rev, force, ctx, pool);
+	}
+	IF_ERROR_RETURN (err, pool, L);
+	
+	svn_pool_destroy (pool);
+
+	return 0;
+}
+
+
+static int
+l_session (lua_State *L) {
+	session_t *session = new_session (L);
+
+	open_session (session, 1, L);
+
+	return 1;
+}
+
+
+/* Passes the status of the items of a working copy to Lua. They are
+   stored in the table on the top of the stack, or passed to the function
+   at IFUNC when there is one. Only the items with a status kind in FILTER
+   are passed, unless it is 0. POOL is cleared after each item */
+typedef struct status_bt {
+	lua_State *L;
+	int ifunc;
+	svn_boolean_t detailed;
+	svn_boolean_t show_last_committed;
+	svn_boolean_t repos_locks;
+	svn_boolean_t structured; /* records instead of svn status lines */
+	apr_uint32_t filter;
+	int count;
+	svn_boolean_t stopped; /* the function returned false */
+	svn_boolean_t failed; /* the function raised an error, which is on the stack */
+	apr_pool_t *pool;
+} status_bt;
+
+
+#define STATUS_BIT(kind) (((apr_uint32_t) 1) << (kind))
+
+/* Names of the status kinds that can be used in the filter of status */
+static const struct {
+	const char *name;
+	enum svn_wc_status_kind kind;
+} status_kinds[] = {
+	{"unversioned", svn_wc_status_unversioned},
+	{"normal", svn_wc_status_normal},
+	{"added", svn_wc_status_added},
+	{"missing", svn_wc_status_missing},
+	{"deleted", svn_wc_status_deleted},
+	{"replaced", svn_wc_status_replaced},
+	{"modified", svn_wc_status_modified},
+	{"merged", svn_wc_status_merged},
+	{"conflicted", svn_wc_status_conflicted},
+	{"ignored", svn_wc_status_ignored},
+	{"obstructed", svn_wc_status_obstructed},
+	{"external", svn_wc_status_external},
+	{"incomplete", svn_wc_status_incomplete},
+	{NULL, svn_wc_status_none}
+};
+
+
+/* Reads the list in the field filter of the table at index ITABLE, and
+   returns the status kinds in it as a mask of STATUS_BIT, or 0 */
+static apr_uint32_t
+get_status_filter (lua_State *L, int itable) {
+	apr_uint32_t filter = 0;
+	int i, j, n;
+
+	lua_getfield (L, itable, "filter");
+
+	if (!lua_istable (L, -1)) {
+		lua_pop (L, 1);
+		return 0;
+	}
+
+	n = lua_objlen (L, -1);
+
+	for (i = 1; i <= n; i++) {
+		const char *name;
+
+		lua_rawgeti (L, -1, i);
+		name = luaL_checkstring (L, -1);
+
+		for (j = 0; status_kinds[j].name != NULL; j++) {
+			if (strcmp (name, status_kinds[j].name) == 0) {
+				break;
+			}
+		}
+
+		if (status_kinds[j].name == NULL) {
+			luaL_error (L, "invalid status kind '%s'", name);
+		}
+
+		filter |= STATUS_BIT (status_kinds[j].kind);
+		lua_pop (L, 1);
+	}
+
+	lua_pop (L, 1);
+
+	return filter;
+}
+
+
+/* ====================================================================
+ * Copyright (c) 2000-2004 CollabNet.  All rights reserved.
+ * 
+ * The code of "generate_status_code" is from status.c
+ * "print_status" is based on the code of the function with the
+ * same name in status.c
+ */
+
+
+/* Return the single character representation of STATUS */
+static char
+generate_status_code(enum svn_wc_status_kind status)
+{
+  	switch (status)
+  	{
+	  	case svn_wc_status_none:        return ' ';
+		case svn_wc_status_normal:      return ' ';
+		case svn_wc_status_added:       return 'A';
+		case svn_wc_status_missing:     return '!';
+		case svn_wc_status_incomplete:  return '!';
+		case svn_wc_status_deleted:     return 'D';
+		case svn_wc_status_replaced:    return 'R';
+		case svn_wc_status_modified:    return 'M';
+		case svn_wc_status_merged:      return 'G';
+		case svn_wc_status_conflicted:  return 'C';
+		case svn_wc_status_obstructed:  return '~';
+		case svn_wc_status_ignored:     return 'I';
+		case svn_wc_status_external:    return 'X';
+		case svn_wc_status_unversioned: return '?';
+		default:                        return '?';
+	}
+}
+
+
+/* Returns the character of the lock column of svn status for STATUS,
+   which tells about the lock in the repository when REPOS_LOCKS is set */
+static char
+lock_status_code (svn_wc_status2_t *status, svn_boolean_t repos_locks) {
+	svn_boolean_t has_token = status->entry && status->entry->lock_token;
+
+	if (!repos_locks) {
+		return has_token ? 'K' : ' ';
+	}
+
+	if (status->repos_lock) {
+		if (!has_token) {
+			return 'O';
+		}
+
+		return strcmp (status->repos_lock->token, status->entry->lock_token) == 0 ? 'K' : 'T';
+	}
+
+	return has_token ? 'B' : ' ';
+}
+
+
+/* Print STATUS and PATH in a format determined by DETAILED and
+   SHOW_LAST_COMMITTED. */
+static svn_error_t *
+print_status(const char *path,
+             svn_boolean_t detailed,
+             svn_boolean_t show_last_committed,
+             svn_boolean_t repos_locks,
+             svn_wc_status2_t *status,
+             lua_State *L,
+			 apr_pool_t *pool)
+{	
+	const char *info;
+	
+	if (detailed)
+	{
+		char ood_status, lock_status;
+		const char *working_rev;
+
+		if (! status->entry)
+			working_rev = "";
+		else if (! SVN_IS_VALID_REVNUM(status->entry->revision))
+			working_rev = " ? ";
+		else if (status->copied)
+			working_rev = "-";
+		else
+			working_rev = apr_psprintf(pool, "%ld", status->entry->revision);
+
+		if (status->repos_text_status != svn_wc_status_none
+				|| status->repos_prop_status != svn_wc_status_none)
+			ood_status = '*';
+		else
+			ood_status = ' ';
+
+		lock_status = lock_status_code (status, repos_locks);
+
+
+		if (show_last_committed)
+		{
+		   	const char *commit_rev;
+			const char *commit_author;
+
+			if (status->entry && SVN_IS_VALID_REVNUM(status->entry->cmt_rev))
+				commit_rev = apr_psprintf(pool, "%ld", status->entry->cmt_rev);
+			else if (status->entry) 
+				commit_rev = " ? ";
+			else 
+				commit_rev = "";
+
+
+			if (status->entry && status->entry->cmt_author)
+				commit_author = status->entry->cmt_author;
+			else if (status->entry)
+				commit_author = " ? ";
+			else
+				commit_author = "";
+
+
+			info = apr_psprintf(pool, 			
+					"%c%c%c%c%c%c %c   %6s   %6s %-12s %s",
+					generate_status_code(status->text_status),
+					generate_status_code(status->prop_status),
+					status->locked ? 'L' : ' ',
+					status->copied ? '+' : ' ',
+					status->switched ? 'S' : ' ',
+					lock_status,
+					ood_status,
+					working_rev,
+					commit_rev,
+					commit_author,
+					path);
+
+		}
+		else {
+			info = apr_psprintf(pool, 
+					"%c%c%c%c%c%c %c   %6s   %s\n",
+					generate_status_code(status->text_status),
+					generate_status_code(status->prop_status),
+					status->locked ? 'L' : ' ',
+					status->copied ? '+' : ' ',
+					status->switched ? 'S' : ' ',
+					lock_status,
+					ood_status,
+					working_rev,
+					path);
+		}
+	}
+	else {
+		info = apr_psprintf(pool,
+			   	"%c%c%c%c%c%c %s\n",
+				generate_status_code(status->text_status),
+				generate_status_code(status->prop_status),
+				status->locked ? 'L' : ' ',
+				status->copied ? '+' : ' ',
+				status->switched ? 'S' : ' ',
+				lock_status_code (status, FALSE),
+				path);
+	}
+
+	lua_pushstring (L, info);
+
+	return SVN_NO_ERROR;
+}
+
+
+/* Pushes the status code C as a one character string */
+static void
+push_status_code (lua_State *L, char c) {
+	lua_pushlstring (L, &c, 1);
+}
+
+
+/* Pushes a table with the fields of STATUS. Nothing is formatted: the
+   revisions are numbers, the flags booleans and the statuses single
+   characters */
+static void
+status_record (svn_boolean_t repos_locks, svn_wc_status2_t *status, lua_State *L) {
+	const svn_wc_entry_t *entry = status->entry;
+	char lock_status;
+
+	lua_createtable (L, 0, 8);
+
+	push_status_code (L, generate_status_code (status->text_status));
+	lua_setfield (L, -2, "text_status");
+
+	push_status_code (L, generate_status_code (status->prop_status));
+	lua_setfield (L, -2, "prop_status");
+
+	lua_pushboolean (L, status->locked);
+	lua_setfield (L, -2, "locked");
+
+	lua_pushboolean (L, status->copied);
+	lua_setfield (L, -2, "copied");
+
+	lua_pushboolean (L, status->switched);
+	lua_setfield (L, -2, "switched");
+
+	lock_status = lock_status_code (status, repos_locks);
+	if (lock_status != ' ') {
+		push_status_code (L, lock_status);
+		lua_setfield (L, -2, "lock_status");
+	}
+
+	if (repos_locks) {
+		push_status_code (L, generate_status_code (status->repos_text_status));
+		lua_setfield (L, -2, "repos_text_status");
+
+		push_status_code (L, generate_status_code (status->repos_prop_status));
+		lua_setfield (L, -2, "repos_prop_status");
+	}
+
+	if (entry) {
+		lua_pushstring (L, entry->kind == svn_node_dir ? "dir" : "file");
+		lua_setfield (L, -2, "kind");
+
+		if (SVN_IS_VALID_REVNUM (entry->revision)) {
+			lua_pushinteger (L, entry->revision);
+			lua_setfield (L, -2, "revision");
+		}
+
+		if (SVN_IS_VALID_REVNUM (entry->cmt_rev)) {
+			lua_pushinteger (L, entry->cmt_rev);
+			lua_setfield (L, -2, "commit_revision");
+		}
+
+		if (entry->cmt_author) {
+			lua_pushstring (L, entry->cmt_author);
+			lua_setfield (L, -2, "author");
+		}
+	}
+}
+
+
+static void
+status_func (void *baton, const char *path, svn_wc_status2_t *status) {
+	struct status_bt *sb = baton;
+	apr_pool_t *pool = ((status_bt *)baton)->pool;
+	lua_State *L = sb->L;
 
-	if (init_pool (&pool) != 0) {
-		return init_pool_error (L);
+	/* the rest of the items are skipped until status_cancel stops the walk */
+	if (sb->stopped || sb->failed) {
+		return;
 	}
-	
-	path = svn_path_canonicalize (path, pool);
 
-	err = svn_repos_delete (path, pool);
-	IF_ERROR_RETURN (err, pool, L);
+	/* properties in their normal state do not make an item match */
+	if (sb->filter && !(sb->filter & STATUS_BIT (status->text_status))
+			&& (status->prop_status == svn_wc_status_none
+				|| status->prop_status == svn_wc_status_normal
+				|| !(sb->filter & STATUS_BIT (status->prop_status)))) {
+		return;
+	}
 
-	return 0;
+	path = svn_path_local_style (path, pool);
+
+	sb->count++;
+
+	if (sb->ifunc) {
+		lua_pushvalue (L, sb->ifunc);
+		lua_pushstring (L, path);
+	}
+
+	if (sb->structured) {
+		status_record (sb->repos_locks, status, L);
+	} else {
+		print_status (path, sb->detailed, sb->show_last_committed,
+				sb->repos_locks, status, L, pool);
+	}
+
+	if (sb->ifunc) {
+		if (lua_pcall (L, 2, 1, 0) != 0) {
+			sb->failed = TRUE;
+		} else {
+			if (lua_isboolean (L, -1) && !lua_toboolean (L, -1)) {
+				sb->stopped = TRUE;
+			}
+			lua_pop (L, 1);
+		}
+	} else {
+		lua_setfield (L, -2, path);
+	}
+
+	svn_pool_clear (pool);
+}
+
+
+/* Stops svn_client_status2 once the function of the status_bt BATON
+   failed or returned false, since status_func can not */
+static svn_error_t *
+status_cancel (void *baton) {
+	status_bt *sb = baton;
+
+	if (sb->stopped || sb->failed) {
+		return svn_error_create (SVN_ERR_CANCELLED, NULL, NULL);
+	}
+
+	return SVN_NO_ERROR;
 }
 
 
 static int
-l_revprop_get (lua_State *L) {
+l_status (lua_State *L) {
 	apr_pool_t *pool;
 	svn_error_t *err;
 	svn_client_ctx_t *ctx;
-
+	
+	svn_revnum_t rev;	
+	status_bt baton;
 	svn_opt_revision_t revision;
-	svn_string_t *propval;
-	svn_revnum_t rev;
-	svn_string_t *printable_val;
+	
+	const char *path = (lua_gettop (L) < 1 || lua_isnil (L, 1)) ? "" : luaL_checkstring (L, 1);
+	int itable = 3;
+	svn_boolean_t recursive = TRUE;
+	svn_boolean_t verbose = FALSE;
+	svn_boolean_t show_updates = FALSE;
+	svn_boolean_t no_ignore = FALSE;
+	svn_boolean_t ignore_externals = FALSE;
+	svn_boolean_t structured = FALSE;
 
-	const char *url = luaL_checkstring (L, 1);
-	const char *propname = luaL_checkstring (L, 2);
-	const char *propname_utf8 = NULL;
-		
-	if (lua_gettop (L) < 3 || lua_isnil (L, 3)) {
-		revision.kind = get_revision_kind (url);
+	memset (&baton, 0, sizeof (baton));
+
+	if (lua_gettop (L) < 2 || lua_isnil (L, 2)) {
+		revision.kind = svn_opt_revision_head;
 	} else {
 		revision.kind = svn_opt_revision_number;
-		revision.value.number = lua_tointeger (L, 3);
+		revision.value.number = lua_tointeger (L, 2);
+	}
+
+	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
+		lua_getfield (L, itable, "recursive");
+		if (lua_isboolean (L, -1)) {
+			recursive = lua_toboolean (L, -1);
+		}
+		
+		lua_getfield (L, itable, "verbose");
+		if (lua_isboolean (L, -1)) {
+			verbose = lua_toboolean (L, -1);
+		}
+		
+		lua_getfield (L, itable, "show_updates");
+		if (lua_isboolean (L, -1)) {
+			show_updates = lua_toboolean (L, -1);
+		}
+
+		lua_getfield (L, itable, "no_ignore");
+		if (lua_isboolean (L, -1)) {
+			no_ignore = lua_toboolean (L, -1);
+		}
+		
+		lua_getfield (L, itable, "ignore_externals");
+		if (lua_isboolean (L, -1)) {
+			ignore_externals = lua_toboolean (L, -1);
+		}
+
+		lua_getfield (L, itable, "structured");
+		if (lua_isboolean (L, -1)) {
+			structured = lua_toboolean (L, -1);
+		}
+
+		baton.filter = get_status_filter (L, itable);
+	} 
+
+	if (lua_gettop (L) >= 4 && lua_isfunction (L, 4)) {
+		baton.ifunc = 4;
 	}
 
 	init_function (&ctx, &pool, L);
 
-	url = svn_path_canonicalize (url, pool);
+	path = svn_path_canonicalize (path, pool);
 
-	err = svn_utf_cstring_to_utf8 (&propname_utf8, propname, pool);
-	IF_ERROR_RETURN (err, pool, L);
+	baton.L = L;
+	baton.detailed = (verbose || show_updates);
+	baton.show_last_committed = verbose;
+	baton.repos_locks = show_updates;
+	baton.structured = structured;
+	baton.pool = svn_pool_create (pool);
 
-	err = svn_client_revprop_get (propname_utf8, &propval, url, &revision, &rev, ctx, pool);
-	IF_ERROR_RETURN (err, pool, L);
+	if (!baton.ifunc) {
+		lua_newtable (L);
+	}
 
-	printable_val = propval;
-	if (svn_prop_needs_translation (propname_utf8)) {
-		err = svn_subst_detranslate_string (&printable_val, propval, TRUE, pool);
+	/* the context is a copy for this call */
+	ctx->cancel_func = status_cancel;
+	ctx->cancel_baton = &baton;
+
+	err = svn_client_status2 (&rev, path, &revision, status_func, &baton, 
+			                  recursive, verbose, show_updates, no_ignore, ignore_externals, ctx, pool);
+
+	if (baton.failed || baton.stopped) {
+		svn_error_clear (err);
+		svn_pool_destroy (pool);
+		if (baton.failed) {
+			return lua_error (L);
+		}
+	} else {
 		IF_ERROR_RETURN (err, pool, L);
+		svn_pool_destroy (pool);
 	}
 
-	lua_pushstring (L, printable_val->data);
-
-	svn_pool_destroy (pool);
+	if (baton.ifunc) {
+		lua_pushinteger (L, baton.count);
+	}
 
 	return 1;
 }
 
 
-static int
-l_revprop_list (lua_State *L) {
+#ifdef HAVE_INOTIFY
+
+#define WATCHER_MT "svn.status_watcher"
+
+/* events that can change the status of the items of a directory */
+#define WATCHER_EVENTS (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE \
+		| IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+
+struct watch_dir_t;
+
+/* An inotify watch of a directory of the working copy or of its
+   administrative area */
+typedef struct watch_t {
+	int wd; /* -1 when unused */
+	struct watch_dir_t *dir;
+	svn_boolean_t adm;
+} watch_t;
+
+
+/* A watched directory of the working copy. It has watches on itself,
+   on .svn and on .svn/props. Allocated with malloc, since directories
+   come and go while the watcher lives */
+typedef struct watch_dir_t {
+	char *path;
+	watch_t watches[3];
+	svn_boolean_t dirty; /* its status must be read again */
+	svn_boolean_t unwatched; /* the limit of watches was reached, it is read on every refresh */
+} watch_dir_t;
+
+
+/* A status snapshot of a working copy, kept up to date by rescanning
+   only the directories inotify reported changes in. The status of the
+   items of each directory is a table in the environment of the userdata,
+   indexed by the path of the directory, and the status of all the items
+   is the table at index 1 of the environment, see watcher_set_dir */
+typedef struct watcher_t {
 	apr_pool_t *pool;
-	svn_error_t *err;
 	svn_client_ctx_t *ctx;
+	int fd;
+	const char *root;
+	apr_hash_t *dirs; /* path -> watch_dir_t */
+	apr_hash_t *wds; /* watch descriptor -> watch_t */
+	svn_boolean_t verbose;
+	svn_boolean_t no_ignore;
+	svn_boolean_t structured;
+	apr_uint32_t filter;
+} watcher_t;
 
-	apr_hash_t *entries;
+
+static svn_error_t *
+watcher_add_dir (watcher_t *w, const char *path, apr_pool_t *pool);
+
+
+/* Watches PATH in the slot I of the watches of DIR. An optional watch
+   is silently skipped when PATH can not be watched, and DIR is marked as
+   unwatched when the limit of inotify watches is reached */
+static svn_error_t *
+watcher_watch (watcher_t *w, watch_dir_t *dir, int i, const char *path,
+               svn_boolean_t optional, apr_pool_t *pool) {
+	watch_t *watch = &dir->watches[i];
+	const char *native;
+
+	SVN_ERR (svn_utf_cstring_from_utf8 (&native, path, pool));
+
+	watch->wd = inotify_add_watch (w->fd, *native ? native : ".",
+			WATCHER_EVENTS | IN_ONLYDIR);
+
+	if (watch->wd < 0) {
+		if (errno == ENOSPC) {
+			dir->unwatched = TRUE;
+			return SVN_NO_ERROR;
+		}
+
+		if (optional) {
+			return SVN_NO_ERROR;
+		}
+
+		return svn_error_wrap_apr (apr_get_os_error (), "Can't watch '%s'",
+				svn_path_local_style (path, pool));
+	}
+
+	watch->dir = dir;
+	watch->adm = i > 0;
+	apr_hash_set (w->wds, &watch->wd, sizeof (int), watch);
+
+	return SVN_NO_ERROR;
+}
+
+
+/* Adds the working copy directories in PATH that are not watched yet */
+static svn_error_t *
+watcher_find_dirs (watcher_t *w, const char *path, apr_pool_t *pool) {
+	const char *adm_dir = svn_wc_get_adm_dir (pool);
+	apr_hash_t *dirents;
 	apr_hash_index_t *hi;
-	void *val;
-	const void *key;
-	svn_revnum_t rev;
-	svn_opt_revision_t revision;
-	
-	const char *url = luaL_checkstring (L, 1);
+	apr_pool_t *subpool;
 
-	if (lua_gettop (L) < 2 || lua_isnil (L, 2)) {
-		revision.kind = get_revision_kind (url);
-	} else {
-		revision.kind = svn_opt_revision_number;
-		revision.value.number = lua_tointeger (L, 2);
+	SVN_ERR (svn_io_get_dirents2 (&dirents, path, pool));
+
+	subpool = svn_pool_create (pool);
+
+	for (hi = apr_hash_first (pool, dirents); hi; hi = apr_hash_next (hi)) {
+		const void *key;
+		void *val;
+		svn_io_dirent_t *dirent;
+		svn_node_kind_t kind;
+		const char *child;
+
+		apr_hash_this (hi, &key, NULL, &val);
+		dirent = val;
+
+		if (dirent->kind != svn_node_dir || strcmp (key, adm_dir) == 0) {
+			continue;
+		}
+
+		svn_pool_clear (subpool);
+
+		child = svn_path_join (path, key, subpool);
+
+		if (apr_hash_get (w->dirs, child, APR_HASH_KEY_STRING) != NULL) {
+			continue;
+		}
+
+		SVN_ERR (svn_io_check_path (svn_path_join (child, adm_dir, subpool), &kind, subpool));
+
+		if (kind == svn_node_dir) {
+			SVN_ERR (watcher_add_dir (w, child, subpool));
+		}
 	}
 
-	init_function (&ctx, &pool, L);
+	svn_pool_destroy (subpool);
 
-	url = svn_path_canonicalize (url, pool);
-	err = svn_client_revprop_list (&entries, url, &revision, &rev, ctx, pool);
-	IF_ERROR_RETURN (err, pool, L);
+	return SVN_NO_ERROR;
+}
 
-	lua_newtable (L);
 
-	for (hi = apr_hash_first (pool, entries); hi; hi = apr_hash_next (hi)) {
-		const char *pname;
-		svn_string_t *pval;
+/* Starts watching the working copy directory PATH and the ones below it.
+   They are dirty, so the next refresh reads their status */
+static svn_error_t *
+watcher_add_dir (watcher_t *w, const char *path, apr_pool_t *pool) {
+	const char *adm_path = svn_path_join (path, svn_wc_get_adm_dir (pool), pool);
+	watch_dir_t *dir;
+	int i;
+
+	dir = calloc (1, sizeof (watch_dir_t));
+	if (dir == NULL || (dir->path = strdup (path)) == NULL) {
+		free (dir);
+		return svn_error_create (APR_ENOMEM, NULL, NULL);
+	}
+
+	for (i = 0; i < 3; i++) {
+		dir->watches[i].wd = -1;
+	}
+	dir->dirty = TRUE;
+
+	apr_hash_set (w->dirs, dir->path, APR_HASH_KEY_STRING, dir);
+
+	SVN_ERR (watcher_watch (w, dir, 0, path, FALSE, pool));
+	SVN_ERR (watcher_watch (w, dir, 1, adm_path, FALSE, pool));
+	SVN_ERR (watcher_watch (w, dir, 2, svn_path_join (adm_path, "props", pool), TRUE, pool));
+
+	return watcher_find_dirs (w, path, pool);
+}
+
+
+/* Replaces the status of the items of the directory PATH, in the table
+   at IENV, with the table on top of the stack, or drops it if that is nil.
+   The items that the directory had and has are removed from and added to
+   the snapshot of the whole working copy, so that it is never rebuilt */
+static void
+watcher_set_dir (lua_State *L, int ienv, const char *path) {
+	int inew = lua_gettop (L);
+	int isnapshot;
+
+	lua_rawgeti (L, ienv, 1);
+	isnapshot = lua_gettop (L);
+
+	lua_getfield (L, ienv, path);
+	if (lua_istable (L, -1)) {
+		lua_pushnil (L);
+		while (lua_next (L, -2) != 0) {
+			lua_pop (L, 1);
+			lua_pushvalue (L, -1);
+			lua_pushnil (L);
+			lua_rawset (L, isnapshot);
+		}
+	}
+	lua_pop (L, 1);
+
+	if (lua_istable (L, inew)) {
+		lua_pushnil (L);
+		while (lua_next (L, inew) != 0) {
+			lua_pushvalue (L, -2);
+			lua_insert (L, -2);
+			lua_rawset (L, isnapshot);
+		}
+	}
+
+	lua_pop (L, 1);
+	lua_setfield (L, ienv, path);
+}
+
+
+/* Stops watching DIR and drops its status, which is in the table at IENV */
+static void
+watcher_remove_dir (lua_State *L, watcher_t *w, watch_dir_t *dir, int ienv) {
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		if (dir->watches[i].wd >= 0) {
+			inotify_rm_watch (w->fd, dir->watches[i].wd);
+			apr_hash_set (w->wds, &dir->watches[i].wd, sizeof (int), NULL);
+		}
+	}
+
+	lua_pushnil (L);
+	watcher_set_dir (L, ienv, dir->path);
+
+	apr_hash_set (w->dirs, dir->path, APR_HASH_KEY_STRING, NULL);
+	free (dir->path);
+	free (dir);
+}
+
+
+/* Stops watching DIR and the directories below it, which may have been
+   moved along with it */
+static void
+watcher_remove_tree (lua_State *L, watcher_t *w, watch_dir_t *dir, int ienv,
+                     apr_pool_t *pool) {
+	apr_array_header_t *dirs = apr_array_make (pool, 1, sizeof (watch_dir_t *));
+	apr_hash_index_t *hi;
+	int i;
+
+	APR_ARRAY_PUSH (dirs, watch_dir_t *) = dir;
+
+	for (hi = apr_hash_first (pool, w->dirs); hi; hi = apr_hash_next (hi)) {
+		const void *key;
+		void *val;
 
 		apr_hash_this (hi, &key, NULL, &val);
-	
-		pname = key;
+		if (svn_path_is_child (dir->path, key, pool) != NULL
+				|| (*dir->path == '\0' && val != dir)) {
+			APR_ARRAY_PUSH (dirs, watch_dir_t *) = val;
+		}
+	}
+
+	for (i = 0; i < dirs->nelts; i++) {
+		watcher_remove_dir (L, w, APR_ARRAY_IDX (dirs, i, watch_dir_t *), ienv);
+	}
+}
+
+
+/* Marks the parent of the directory PATH as dirty. The directory is
+   one of the items of its parent */
+static void
+watcher_dirty_parent (watcher_t *w, const char *path, apr_pool_t *pool) {
+	watch_dir_t *parent;
+
+	if (strcmp (path, w->root) == 0) {
+		return;
+	}
+
+	parent = apr_hash_get (w->dirs, svn_path_dirname (path, pool), APR_HASH_KEY_STRING);
+	if (parent != NULL) {
+		parent->dirty = TRUE;
+	}
+}
+
+
+/* Reads the pending inotify events and marks the directories they are
+   about as dirty. A change in the administrative area of a directory may
+   change its own status, so its parent is marked too */
+static void
+watcher_read_events (lua_State *L, watcher_t *w, int ienv, apr_pool_t *pool) {
+	union {
+		struct inotify_event event;
+		char data[4096];
+	} buf;
+	apr_hash_index_t *hi;
+
+	for (;;) {
+		ssize_t len = read (w->fd, buf.data, sizeof (buf));
+		char *p;
+
+		if (len < 0 && errno == EINTR) {
+			continue;
+		}
 
-		pval = (svn_string_t *) val;
-		if (svn_prop_needs_translation (pname)) {
-			err = svn_subst_translate_string (&pval, pval, APR_LOCALE_CHARSET, pool);
-			IF_ERROR_RETURN (err, pool, L);
+		if (len <= 0) {
+			break;
 		}
 
-		err = svn_cmdline_cstring_from_utf8 (&pname, pname, pool);
-		IF_ERROR_RETURN (err, pool, L);
+		for (p = buf.data; p < buf.data + len;
+				p += sizeof (struct inotify_event) + ((struct inotify_event *) p)->len) {
+			struct inotify_event *event = (struct inotify_event *) p;
+			watch_t *watch;
+
+			/* events were lost, everything must be read again */
+			if (event->mask & IN_Q_OVERFLOW) {
+				for (hi = apr_hash_first (pool, w->dirs); hi; hi = apr_hash_next (hi)) {
+					void *val;
+					apr_hash_this (hi, NULL, NULL, &val);
+					((watch_dir_t *) val)->dirty = TRUE;
+				}
+				continue;
+			}
 
-		lua_pushstring (L, pval->data);
-		lua_setfield (L, -2, pname);
-	}
+			watch = apr_hash_get (w->wds, &event->wd, sizeof (int));
+			if (watch == NULL) {
+				continue;
+			}
 
-	svn_pool_destroy (pool);
+			watch->dir->dirty = TRUE;
+			if (watch->adm) {
+				watcher_dirty_parent (w, watch->dir->path, pool);
+			}
 
-	return 1;
+			if (event->mask & (IN_IGNORED | IN_MOVE_SELF)) {
+				if (watch->adm) {
+					apr_hash_set (w->wds, &watch->wd, sizeof (int), NULL);
+					watch->wd = -1;
+				} else {
+					/* the directory is gone, its parent tells how */
+					watcher_dirty_parent (w, watch->dir->path, pool);
+					watcher_remove_tree (L, w, watch->dir, ienv, pool);
+				}
+			}
+		}
+	}
 }
 
 
-static int
-l_revprop_set (lua_State *L) {
-	apr_pool_t *pool;
+/* Reads the status of the items of DIR into the table at IENV. A
+   directory that is no longer a working copy directory is dropped */
+static svn_error_t *
+watcher_scan (lua_State *L, watcher_t *w, watch_dir_t *dir, int ienv, apr_pool_t *pool) {
+	svn_opt_revision_t revision;
+	svn_revnum_t rev;
+	svn_node_kind_t kind;
+	status_bt baton;
 	svn_error_t *err;
-	svn_client_ctx_t *ctx;
 
-	svn_opt_revision_t revision;
-   	svn_revnum_t rev;	
-	
-	const char *url = luaL_checkstring (L, 1);
-	const char *propname = luaL_checkstring (L, 2);
-	const char *propval = lua_isnil (L, 3) ? NULL : luaL_checkstring (L, 3);
-	const char *propname_utf8 = NULL;
-	int itable = 5;
-	svn_boolean_t force = FALSE;
+	memset (&baton, 0, sizeof (baton));
+	baton.L = L;
+	baton.detailed = w->verbose;
+	baton.show_last_committed = w->verbose;
+	baton.structured = w->structured;
+	baton.filter = w->filter;
+	baton.pool = svn_pool_create (pool);
 
-	if (lua_gettop (L) < 4 || lua_isnil (L, 4)) {
-		revision.kind = get_revision_kind (url);
-	} else {
-		revision.kind = svn_opt_revision_number;
-		revision.value.number = lua_tointeger (L, 4);
-	}
+	revision.kind = svn_opt_revision_head;
+	dir->dirty = FALSE;
 
-	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
-		lua_getfield (L, itable, "force");
-		if (lua_isboolean (L, -1)) {
-			force = lua_toboolean (L, -1);
-		}
-	} 
+	lua_newtable (L);
 
-	init_function (&ctx, &pool, L);
+	err = svn_client_status2 (&rev, dir->path, &revision, status_func, &baton,
+			FALSE, w->verbose, FALSE, w->no_ignore, TRUE, w->ctx, pool);
 
-	url = svn_path_canonicalize (url, pool);
+	if (err) {
+		lua_pop (L, 1);
 
-	err = svn_utf_cstring_to_utf8 (&propname_utf8, propname, pool);
-	IF_ERROR_RETURN (err, pool, L);
+		kind = svn_node_dir;
 
-	if (propval != NULL) {
-		svn_string_t *sstring = svn_string_create (propval, pool);
+		if (strcmp (dir->path, w->root) != 0) {
+			svn_error_clear (svn_io_check_path (svn_path_join (dir->path,
+							svn_wc_get_adm_dir (pool), pool), &kind, pool));
 
-		if (svn_prop_needs_translation (propname_utf8)) {
-			err = svn_subst_translate_string (&sstring, sstring, APR_LOCALE_CHARSET, pool);
-			IF_ERROR_RETURN (err, pool, L);
+			if (kind != svn_node_dir) {
+				svn_error_clear (err);
+				watcher_dirty_parent (w, dir->path, pool);
+				watcher_remove_tree (L, w, dir, ienv, pool);
+				return SVN_NO_ERROR;
+			}
 		}
-	
-		err = svn_client_revprop_set (propname_utf8, sstring, url, &revision, &rev, force, ctx, pool);
-	} else {
-		err = svn_client_revprop_set (propname_utf8, NULL, url, &revision, &rev, force, ctx, pool);
+
+		/* tried again by the next refresh */
+		dir->dirty = TRUE;
+		return err;
 	}
-	IF_ERROR_RETURN (err, pool, L);
-	
-	svn_pool_destroy (pool);
 
-	return 0;
+	/* the directory itself is one of the items of its parent */
+	if (strcmp (dir->path, w->root) != 0) {
+		lua_pushnil (L);
+		lua_setfield (L, -2, svn_path_local_style (dir->path, pool));
+	}
+
+	watcher_set_dir (L, ienv, dir->path);
+
+	return watcher_find_dirs (w, dir->path, pool);
 }
 
 
-typedef struct status_bt {
-	lua_State *L;
-	svn_boolean_t detailed;
-	svn_boolean_t show_last_committed;
-	svn_boolean_t repos_locks;
-	apr_pool_t *pool;
-} status_bt;
+/* Rescans the directories that changed since the last refresh, and
+   returns their number in COUNT */
+static svn_error_t *
+watcher_refresh (lua_State *L, watcher_t *w, int ienv, int *count, apr_pool_t *pool) {
+	apr_array_header_t *dirty = apr_array_make (pool, 16, sizeof (const char *));
+	apr_pool_t *passpool = svn_pool_create (pool);
+	apr_pool_t *subpool = svn_pool_create (pool);
+	apr_hash_index_t *hi;
+	int i;
 
+	*count = 0;
 
-/* ====================================================================
- * Copyright (c) 2000-2004 CollabNet.  All rights reserved.
- * 
- * The code of "generate_status_code" is from status.c
- * "print_status" is based on the code of the function with the
- * same name in status.c
- */
+	watcher_read_events (L, w, ienv, pool);
 
+	/* no event tells whether they changed */
+	for (hi = apr_hash_first (pool, w->dirs); hi; hi = apr_hash_next (hi)) {
+		void *val;
 
-/* Return the single character representation of STATUS */
-static char
-generate_status_code(enum svn_wc_status_kind status)
-{
-  	switch (status)
-  	{
-	  	case svn_wc_status_none:        return ' ';
-		case svn_wc_status_normal:      return ' ';
-		case svn_wc_status_added:       return 'A';
-		case svn_wc_status_missing:     return '!';
-		case svn_wc_status_incomplete:  return '!';
-		case svn_wc_status_deleted:     return 'D';
-		case svn_wc_status_replaced:    return 'R';
-		case svn_wc_status_modified:    return 'M';
-		case svn_wc_status_merged:      return 'G';
-		case svn_wc_status_conflicted:  return 'C';
-		case svn_wc_status_obstructed:  return '~';
-		case svn_wc_status_ignored:     return 'I';
-		case svn_wc_status_external:    return 'X';
-		case svn_wc_status_unversioned: return '?';
-		default:                        return '?';
+		apr_hash_this (hi, NULL, NULL, &val);
+		if (((watch_dir_t *) val)->unwatched) {
+			((watch_dir_t *) val)->dirty = TRUE;
+		}
 	}
-}
 
+	/* scanning a directory may find new ones */
+	do {
+		svn_pool_clear (passpool);
+		dirty->nelts = 0;
 
-/* Print STATUS and PATH in a format determined by DETAILED and
-   SHOW_LAST_COMMITTED. */
-static svn_error_t *
-print_status(const char *path,
-             svn_boolean_t detailed,
-             svn_boolean_t show_last_committed,
-             svn_boolean_t repos_locks,
-             svn_wc_status2_t *status,
-             lua_State *L,
-			 apr_pool_t *pool)
-{	
-	const char *info;
-	
-	if (detailed)
-	{
-		char ood_status, lock_status;
-		const char *working_rev;
+		for (hi = apr_hash_first (passpool, w->dirs); hi; hi = apr_hash_next (hi)) {
+			void *val;
 
-		if (! status->entry)
-			working_rev = "";
-		else if (! SVN_IS_VALID_REVNUM(status->entry->revision))
-			working_rev = " ? ";
-		else if (status->copied)
-			working_rev = "-";
-		else
-			working_rev = apr_psprintf(pool, "%ld", status->entry->revision);
+			apr_hash_this (hi, NULL, NULL, &val);
+			if (((watch_dir_t *) val)->dirty) {
+				APR_ARRAY_PUSH (dirty, const char *) =
+					apr_pstrdup (passpool, ((watch_dir_t *) val)->path);
+			}
+		}
 
-		if (status->repos_text_status != svn_wc_status_none
-				|| status->repos_prop_status != svn_wc_status_none)
-			ood_status = '*';
-		else
-			ood_status = ' ';
+		for (i = 0; i < dirty->nelts; i++) {
+			/* a scan removes the directories that left the working copy,
+			   which may be found later in the array */
+			watch_dir_t *dir = apr_hash_get (w->dirs,
+					APR_ARRAY_IDX (dirty, i, const char *), APR_HASH_KEY_STRING);
 
-		if (repos_locks)
-		{
-		   	if (status->repos_lock)
-		   	{
-			 	if (status->entry && status->entry->lock_token)
-			 	{
-			   		if (strcmp(status->repos_lock->token, status->entry->lock_token)
-					 		== 0)
-						lock_status = 'K';
-					else
-						lock_status = 'T';
-				}
-				else
-					lock_status = 'O';
+			if (dir == NULL || !dir->dirty) {
+				continue;
 			}
-			else if (status->entry && status->entry->lock_token)
-				lock_status = 'B';
-			else
-				lock_status = ' ';
-		}
-		else
-			lock_status = (status->entry && status->entry->lock_token) ? 'K' : ' ';
 
+			svn_pool_clear (subpool);
+			SVN_ERR (watcher_scan (L, w, dir, ienv, subpool));
+			(*count)++;
+		}
+	} while (dirty->nelts > 0);
 
-		if (show_last_committed)
-		{
-		   	const char *commit_rev;
-			const char *commit_author;
+	svn_pool_destroy (subpool);
+	svn_pool_destroy (passpool);
 
-			if (status->entry && SVN_IS_VALID_REVNUM(status->entry->cmt_rev))
-				commit_rev = apr_psprintf(pool, "%ld", status->entry->cmt_rev);
-			else if (status->entry) 
-				commit_rev = " ? ";
-			else 
-				commit_rev = "";
+	return SVN_NO_ERROR;
+}
 
 
-			if (status->entry && status->entry->cmt_author)
-				commit_author = status->entry->cmt_author;
-			else if (status->entry)
-				commit_author = " ? ";
-			else
-				commit_author = "";
+/* Stops watching and releases everything but the userdata */
+static void
+watcher_close (watcher_t *w) {
+	apr_hash_index_t *hi;
 
+	if (w->pool == NULL) {
+		return;
+	}
 
-			info = apr_psprintf(pool, 			
-					"%c%c%c%c%c%c %c   %6s   %6s %-12s %s",
-					generate_status_code(status->text_status),
-					generate_status_code(status->prop_status),
-					status->locked ? 'L' : ' ',
-					status->copied ? '+' : ' ',
-					status->switched ? 'S' : ' ',
-					lock_status,
-					ood_status,
-					working_rev,
-					commit_rev,
-					commit_author,
-					path);
+	/* the watches go with the descriptor */
+	if (w->fd >= 0) {
+		close (w->fd);
+		w->fd = -1;
+	}
 
-		}
-		else {
-			info = apr_psprintf(pool, 
-					"%c%c%c%c%c%c %c   %6s   %s\n",
-					generate_status_code(status->text_status),
-					generate_status_code(status->prop_status),
-					status->locked ? 'L' : ' ',
-					status->copied ? '+' : ' ',
-					status->switched ? 'S' : ' ',
-					lock_status,
-					ood_status,
-					working_rev,
-					path);
-		}
+	for (hi = apr_hash_first (NULL, w->dirs); hi; hi = apr_hash_next (hi)) {
+		void *val;
+		apr_hash_this (hi, NULL, NULL, &val);
+		free (((watch_dir_t *) val)->path);
+		free (val);
 	}
-	else {
-		info = apr_psprintf(pool,
-			   	"%c%c%c%c%c%c %s\n",
-				generate_status_code(status->text_status),
-				generate_status_code(status->prop_status),
-				status->locked ? 'L' : ' ',
-				status->copied ? '+' : ' ',
-				status->switched ? 'S' : ' ',
-				((status->entry && status->entry->lock_token)
-				 ? 'K' : ' '),
-				path);
+
+	svn_pool_destroy (w->pool);
+	w->pool = NULL;
+}
+
+
+static int
+watcher_gc (lua_State *L) {
+	watcher_close (luaL_checkudata (L, 1, WATCHER_MT));
+	return 0;
+}
+
+
+/* Returns the status of the working copy, like status, and the number of
+   directories that were read again. The table is the snapshot kept by the
+   watcher, so only the changes cost anything */
+static int
+watcher_status (lua_State *L) {
+	watcher_t *w = luaL_checkudata (L, 1, WATCHER_MT);
+	apr_pool_t *pool;
+	svn_error_t *err;
+	int ienv;
+	int count;
+
+	if (w->pool == NULL) {
+		return send_error (L, "Status watcher is closed\n");
 	}
 
-	lua_pushstring (L, info);
-	lua_setfield (L, -2, path);
+	lua_getfenv (L, 1);
+	ienv = lua_gettop (L);
 
-	return SVN_NO_ERROR;
+	pool = svn_pool_create (w->pool);
+
+	err = watcher_refresh (L, w, ienv, &count, pool);
+	IF_ERROR_RETURN (err, pool, L);
+
+	svn_pool_destroy (pool);
+
+	lua_rawgeti (L, ienv, 1);
+	lua_pushinteger (L, count);
+
+	return 2;
 }
 
 
-static void
-status_func (void *baton, const char *path, svn_wc_status2_t *status) {
-	struct status_bt *sb = baton;
-	apr_pool_t *pool = ((status_bt *)baton)->pool;
-	
-	print_status (svn_path_local_style (path, pool), 
-			      sb->detailed, sb->show_last_committed, sb->repos_locks,
-				  status, ((status_bt *) baton)->L, pool);			
+static int
+watcher_close_method (lua_State *L) {
+	watcher_close (luaL_checkudata (L, 1, WATCHER_MT));
+	return 0;
 }
 
 
 static int
-l_status (lua_State *L) {
+l_status_watcher (lua_State *L) {
+	apr_allocator_t *allocator;
 	apr_pool_t *pool;
 	svn_error_t *err;
-	svn_client_ctx_t *ctx;
-	
-	svn_revnum_t rev;	
-	status_bt baton;
-	svn_opt_revision_t revision;
-	
+	session_t *session;
+	session_t options;
+	watcher_t *w;
+	svn_node_kind_t kind;
+	int count;
+
 	const char *path = (lua_gettop (L) < 1 || lua_isnil (L, 1)) ? "" : luaL_checkstring (L, 1);
-	int itable = 3;
-	svn_boolean_t recursive = TRUE;
-	svn_boolean_t verbose = FALSE;
-	svn_boolean_t show_updates = FALSE;
-	svn_boolean_t no_ignore = FALSE;
-	svn_boolean_t ignore_externals = FALSE;
+	int itable = 2;
 
-	if (lua_gettop (L) < 2 || lua_isnil (L, 2)) {
-		revision.kind = svn_opt_revision_head;
-	} else {
-		revision.kind = svn_opt_revision_number;
-		revision.value.number = lua_tointeger (L, 2);
-	}
+	session = get_session (L);
+
+	w = lua_newuserdata (L, sizeof (watcher_t));
+	memset (w, 0, sizeof (watcher_t));
+	w->fd = -1;
+	luaL_getmetatable (L, WATCHER_MT);
+	lua_setmetatable (L, -2);
+	lua_newtable (L);
+	lua_newtable (L);
+	lua_rawseti (L, -2, 1);
+	lua_setfenv (L, -2);
 
 	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
-		lua_getfield (L, itable, "recursive");
-		if (lua_isboolean (L, -1)) {
-			recursive = lua_toboolean (L, -1);
-		}
-		
 		lua_getfield (L, itable, "verbose");
 		if (lua_isboolean (L, -1)) {
-			verbose = lua_toboolean (L, -1);
-		}
-		
-		lua_getfield (L, itable, "show_updates");
-		if (lua_isboolean (L, -1)) {
-			show_updates = lua_toboolean (L, -1);
+			w->verbose = lua_toboolean (L, -1);
 		}
 
 		lua_getfield (L, itable, "no_ignore");
 		if (lua_isboolean (L, -1)) {
-			no_ignore = lua_toboolean (L, -1);
+			w->no_ignore = lua_toboolean (L, -1);
 		}
-		
-		lua_getfield (L, itable, "ignore_externals");
+
+		lua_getfield (L, itable, "structured");
 		if (lua_isboolean (L, -1)) {
-			ignore_externals = lua_toboolean (L, -1);
+			w->structured = lua_toboolean (L, -1);
 		}
-	} 
 
-	init_function (&ctx, &pool, L);
+		lua_pop (L, 3);
 
-	path = svn_path_canonicalize (path, pool);
+		w->filter = get_status_filter (L, itable);
+	}
 
-	baton.L = L;
-	baton.detailed = (verbose || show_updates);
-	baton.show_last_committed = verbose;
-	baton.repos_locks = show_updates;
-	baton.pool = pool;
+	if (apr_allocator_create (&allocator)) {
+		return send_error (L, "Error creating allocator\n");
+	}
 
-	lua_newtable (L);
+	/* not derived from the root pool, see cat_chunks */
+	w->pool = svn_pool_create_ex (NULL, allocator);
+	apr_allocator_owner_set (allocator, w->pool);
 
-	err = svn_client_status2 (&rev, path, &revision, status_func, &baton, 
-			                  recursive, verbose, show_updates, no_ignore, ignore_externals, ctx, pool);
+	w->dirs = apr_hash_make (w->pool);
+	w->wds = apr_hash_make (w->pool);
+	w->root = svn_path_canonicalize (apr_pstrdup (w->pool, path), w->pool);
+
+	memset (&options, 0, sizeof (options));
+	session_copy_options (&options, session, w->pool);
+
+	pool = svn_pool_create (w->pool);
+
+	err = create_context (&w->ctx, &options, w->pool);
+	IF_ERROR_RETURN (err, pool, L);
+
+	err = svn_io_check_path (svn_path_join (w->root, svn_wc_get_adm_dir (pool), pool), &kind, pool);
+	if (!err && kind != svn_node_dir) {
+		err = svn_error_createf (SVN_ERR_WC_NOT_DIRECTORY, NULL,
+				"'%s' is not a working copy directory", svn_path_local_style (w->root, pool));
+	}
+	IF_ERROR_RETURN (err, pool, L);
+
+	w->fd = inotify_init ();
+	if (w->fd < 0 || fcntl (w->fd, F_SETFL, O_NONBLOCK) < 0) {
+		svn_pool_destroy (pool);
+		return send_error (L, "Error initializing inotify\n");
+	}
+
+	err = watcher_add_dir (w, w->root, pool);
+
+	if (!err) {
+		lua_getfenv (L, -1);
+		err = watcher_refresh (L, w, lua_gettop (L), &count, pool);
+		lua_pop (L, 1);
+	}
 	IF_ERROR_RETURN (err, pool, L);
 
 	svn_pool_destroy (pool);
@@ -1684,6 +8472,15 @@ l_status (lua_State *L) {
 	return 1;
 }
 
+#else
+
+static int
+l_status_watcher (lua_State *L) {
+	return send_error (L, "status_watcher needs Linux inotify\n");
+}
+
+#endif
+
 
 static int
 l_update (lua_State *L) {
@@ -1742,18 +8539,376 @@ l_update (lua_State *L) {
 }
 
 
+#if APR_HAS_THREADS
+
+#define WC_ALL_THREADS 4
+
+
+/* The status of an item, copied by a status_all thread */
+typedef struct wc_status_item_t {
+	const char *path;
+	svn_wc_status2_t *status;
+} wc_status_item_t;
+
+
+/* A working copy of update_all or status_all, and its result. The result
+   is allocated in the pool of the thread that ran it */
+typedef struct wc_job_t {
+	const char *path;
+	apr_pool_t *pool;
+	svn_revnum_t rev;
+	apr_array_header_t *statuses; /* of wc_status_item_t */
+	const char *error;
+} wc_job_t;
+
+
+/* The jobs of an update_all or status_all call, taken in order by its
+   threads, and the options of the operation */
+typedef struct wc_all_t {
+	apr_thread_mutex_t *mutex;
+	wc_job_t *jobs;
+	int count;
+	int next; /* first job not taken yet */
+	svn_boolean_t update;
+	svn_opt_revision_t revision;
+	svn_boolean_t recursive;
+	svn_boolean_t ignore_externals;
+	svn_boolean_t verbose;
+	svn_boolean_t show_updates;
+	svn_boolean_t no_ignore;
+} wc_all_t;
+
+
+typedef struct wc_worker_t {
+	wc_all_t *all;
+	session_t *session; /* worker session used by this thread */
+	apr_thread_t *thread;
+	apr_pool_t *pool; /* only used by this thread until it is joined */
+} wc_worker_t;
+
+
+static void
+wc_all_status_func (void *baton, const char *path, svn_wc_status2_t *status) {
+	wc_job_t *job = baton;
+	wc_status_item_t *item = apr_array_push (job->statuses);
+
+	item->path = apr_pstrdup (job->pool, path);
+	item->status = svn_wc_dup_status2 (status, job->pool);
+}
+
+
+static svn_error_t *
+wc_all_run (wc_all_t *all, wc_job_t *job, svn_client_ctx_t *ctx, apr_pool_t *pool) {
+	apr_array_header_t *paths;
+	apr_array_header_t *result_revs = NULL;
+
+	if (!all->update) {
+		job->statuses = apr_array_make (job->pool, 16, sizeof (wc_status_item_t));
+
+		return svn_client_status2 (&job->rev, job->path, &all->revision,
+				wc_all_status_func, job, all->recursive, all->verbose,
+				all->show_updates, all->no_ignore, all->ignore_externals, ctx, pool);
+	}
+
+	paths = apr_array_make (pool, 1, sizeof (const char *));
+	APR_ARRAY_PUSH (paths, const char *) = job->path;
+
+	SVN_ERR (svn_client_update2 (&result_revs, paths, &all->revision,
+				all->recursive, all->ignore_externals, ctx, pool));
+
+	if (result_revs != NULL && result_revs->nelts > 0) {
+		job->rev = APR_ARRAY_IDX (result_revs, 0, svn_revnum_t);
+	}
+
+	return SVN_NO_ERROR;
+}
+
+
+static void * APR_THREAD_FUNC
+wc_all_thread (apr_thread_t *thread, void *data) {
+	wc_worker_t *worker = data;
+	wc_all_t *all = worker->all;
+	apr_pool_t *iterpool;
+	char buf[256];
+
+	iterpool = svn_pool_create (worker->pool);
+
+	for (;;) {
+		wc_job_t *job = NULL;
+		svn_error_t *err;
+
+		apr_thread_mutex_lock (all->mutex);
+		if (all->next < all->count) {
+			job = &all->jobs[all->next++];
+		}
+		apr_thread_mutex_unlock (all->mutex);
+
+		if (job == NULL) {
+			break;
+		}
+
+		svn_pool_clear (iterpool);
+		job->pool = worker->pool;
+
+		err = wc_all_run (all, job, worker->session->ctx, iterpool);
+
+		if (err) {
+			job->error = apr_pstrdup (worker->pool,
+					svn_err_best_message (err, buf, sizeof (buf)));
+			svn_error_clear (err);
+		}
+	}
+
+	apr_thread_exit (thread, APR_SUCCESS);
+
+	return NULL;
+}
+
+
+/* Runs update or status, according to UPDATE, on each working copy of
+   the list at index 1, on a bounded number of threads. Returns a table
+   with the result of each working copy, and another one with the
+   message of the ones that failed */
+static int
+wc_all (lua_State *L, svn_boolean_t update) {
+	apr_allocator_t *allocator;
+	apr_thread_mutex_t *mutex;
+	apr_status_t status;
+	apr_pool_t *pool;
+	svn_error_t *err = SVN_NO_ERROR;
+	session_t *session;
+	wc_all_t all;
+	wc_worker_t *workers;
+	status_bt baton;
+	int i, j, started = 0;
+
+	int itable = 3;
+	int threads = WC_ALL_THREADS;
+	svn_boolean_t structured = FALSE;
+	apr_uint32_t filter = 0;
+
+	luaL_checktype (L, 1, LUA_TTABLE);
+
+	memset (&all, 0, sizeof (all));
+	all.update = update;
+	all.recursive = TRUE;
+	all.count = lua_objlen (L, 1);
+
+	if (lua_gettop (L) < 2 || lua_isnil (L, 2)) {
+		all.revision.kind = svn_opt_revision_head;
+	} else {
+		all.revision.kind = svn_opt_revision_number;
+		all.revision.value.number = lua_tointeger (L, 2);
+	}
+
+	if (lua_gettop (L) >= itable && lua_istable (L, itable)) {
+		lua_getfield (L, itable, "threads");
+		if (lua_isnumber (L, -1)) {
+			threads = lua_tointeger (L, -1);
+		}
+
+		lua_getfield (L, itable, "recursive");
+		if (lua_isboolean (L, -1)) {
+			all.recursive = lua_toboolean (L, -1);
+		}
+
+		lua_getfield (L, itable, "ignore_externals");
+		if (lua_isboolean (L, -1)) {
+			all.ignore_externals = lua_toboolean (L, -1);
+		}
+
+		lua_getfield (L, itable, "verbose");
+		if (lua_isboolean (L, -1)) {
+			all.verbose = lua_toboolean (L, -1);
+		}
+
+		lua_getfield (L, itable, "show_updates");
+		if (lua_isboolean (L, -1)) {
+			all.show_updates = lua_toboolean (L, -1);
+		}
+
+		lua_getfield (L, itable, "no_ignore");
+		if (lua_isboolean (L, -1)) {
+			all.no_ignore = lua_toboolean (L, -1);
+		}
+
+		lua_getfield (L, itable, "structured");
+		if (lua_isboolean (L, -1)) {
+			structured = lua_toboolean (L, -1);
+		}
+
+		lua_pop (L, 7);
+
+		filter = get_status_filter (L, itable);
+	}
+
+	luaL_argcheck (L, threads > 0, itable, "the number of threads must be positive");
+
+	if (threads > all.count) {
+		threads = all.count;
+	}
+
+	session = get_session (L);
+
+	if (apr_allocator_create (&allocator)) {
+		return send_error (L, "Error creating allocator\n");
+	}
+
+	/* the pools of the threads are created from it, so its allocator
+	   needs a mutex */
+	pool = svn_pool_create_ex (NULL, allocator);
+	apr_allocator_owner_set (allocator, pool);
+
+	status = apr_thread_mutex_create (&mutex, APR_THREAD_MUTEX_DEFAULT, pool);
+	if (status == APR_SUCCESS) {
+		apr_allocator_mutex_set (allocator, mutex);
+		status = apr_thread_mutex_create (&all.mutex, APR_THREAD_MUTEX_DEFAULT, pool);
+	}
+
+	if (status != APR_SUCCESS) {
+		svn_pool_destroy (pool);
+		return send_error (L, "Error creating mutex\n");
+	}
+
+	all.jobs = apr_pcalloc (pool, (all.count + 1) * sizeof (wc_job_t));
+
+	for (i = 0; i < all.count; i++) {
+		lua_rawgeti (L, 1, i + 1);
+		if (!lua_isstring (L, -1)) {
+			svn_pool_destroy (pool);
+			return luaL_argerror (L, 1, "paths must be strings");
+		}
+		all.jobs[i].path = svn_path_canonicalize (lua_tostring (L, -1), pool);
+		all.jobs[i].rev = SVN_INVALID_REVNUM;
+		lua_pop (L, 1);
+	}
+
+	workers = apr_pcalloc (pool, (threads + 1) * sizeof (wc_worker_t));
+
+	for (i = 0; i < threads; i++) {
+		workers[i].all = &all;
+		workers[i].pool = svn_pool_create (pool);
+
+		err = session_take_worker (&workers[i].session, session);
+		if (err) {
+			break;
+		}
+
+		if (apr_thread_create (&workers[i].thread, NULL, wc_all_thread,
+					&workers[i], pool) != APR_SUCCESS) {
+			session_give_worker (session, workers[i].session);
+			break;
+		}
+		started++;
+	}
+
+	/* the threads that started run every job anyway */
+	for (i = 0; i < started; i++) {
+		apr_thread_join (&status, workers[i].thread);
+		session_give_worker (session, workers[i].session);
+	}
+
+	if (started == 0 && all.count > 0) {
+		IF_ERROR_RETURN (err, pool, L);
+		svn_pool_destroy (pool);
+		return send_error (L, "Error starting the threads\n");
+	}
+
+	svn_error_clear (err);
+
+	lua_newtable (L);
+	lua_newtable (L);
+
+	memset (&baton, 0, sizeof (baton));
+	baton.L = L;
+	baton.detailed = all.verbose || all.show_updates;
+	baton.show_last_committed = all.verbose;
+	baton.repos_locks = all.show_updates;
+	baton.structured = structured;
+	baton.filter = filter;
+	baton.pool = svn_pool_create (pool);
+
+	for (i = 0; i < all.count; i++) {
+		wc_job_t *job = &all.jobs[i];
+
+		lua_rawgeti (L, 1, i + 1);
+
+		if (job->error != NULL) {
+			lua_pushstring (L, job->error);
+			lua_settable (L, -3);
+		} else if (update) {
+			if (SVN_IS_VALID_REVNUM (job->rev)) {
+				lua_pushinteger (L, job->rev);
+			} else {
+				lua_pushboolean (L, TRUE);
+			}
+			lua_settable (L, -4);
+		} else {
+			lua_newtable (L);
+			for (j = 0; j < job->statuses->nelts; j++) {
+				wc_status_item_t *item = &APR_ARRAY_IDX (job->statuses, j, wc_status_item_t);
+				status_func (&baton, item->path, item->status);
+			}
+			lua_settable (L, -4);
+		}
+	}
+
+	svn_pool_destroy (pool);
+
+	return 2;
+}
+
+
+static int
+l_status_all (lua_State *L) {
+	return wc_all (L, FALSE);
+}
+
+
+static int
+l_update_all (lua_State *L) {
+	return wc_all (L, TRUE);
+}
+
+#else
+
+static int
+l_status_all (lua_State *L) {
+	return send_error (L, "status_all needs APR with thread support\n");
+}
+
+
+static int
+l_update_all (lua_State *L) {
+	return send_error (L, "update_all needs APR with thread support\n");
+}
+
+#endif
+
+
 static const struct luaL_Reg svn [] = {
 	{"add", l_add},
 	{"cat", l_cat},
+	{"cat_cache", l_cat_cache},
+	{"cat_chunks", l_cat_chunks},
+	{"cat_many", l_cat_many},
+	{"cat_stream", l_cat_stream},
 	{"checkout", l_checkout},
 	{"commit", l_commit},
 	{"cleanup", l_cleanup},
 	{"copy", l_copy},
 	{"delete", l_delete},
 	{"diff", l_diff},
+	{"diff_summary", l_diff_summary},
+	{"file_revisions", l_file_revisions},
 	{"import", l_import},
 	{"list", l_list},
+	{"list_cache", l_list_cache},
+	{"list_iter", l_list_iter},
 	{"log", l_log},
+	{"log_cache", l_log_cache},
+	{"log_iter", l_log_iter},
+	{"log_refresh", l_log_refresh},
 	{"merge", l_merge},
 	{"mkdir", l_mkdir},
 	{"move", l_move},
@@ -1765,14 +8920,143 @@ static const struct luaL_Reg svn [] = {
 	{"revprop_get", l_revprop_get},
 	{"revprop_list", l_revprop_list},
 	{"revprop_set", l_revprop_set},
+	{"session", l_session},
 	{"status", l_status},
+	{"status_all", l_status_all},
+	{"status_watcher", l_status_watcher},
 	{"update", l_update},
+	{"update_all", l_update_all},
+	{"walk", l_walk},
 	{NULL, NULL}
 };
 
+/* Releases the pool of a session, and so its context */
+static int
+session_close (lua_State *L) {
+	session_t *session = luaL_checkudata (L, 1, SESSION_MT);
+
+	/* the pool is already gone if the root pool was destroyed first */
+	if (session->pool != NULL && root_pool != NULL) {
+		svn_pool_destroy (session->pool);
+	}
+	session->pool = NULL;
+
+	/* the worker sessions have their own pools, which need the RA layer
+	   of the root pool to be closed */
+	while (session->workers != NULL) {
+		session_t *worker = session->workers;
+		session->workers = worker->next;
+		if (root_pool != NULL) {
+			svn_pool_destroy (worker->pool);
+		}
+	}
+	session->idle_workers = 0;
+
+	return 0;
+}
+
+
+/* Calls the module function in the upvalue on behalf of the session at
+   index 1, which stays on the stack, so it is not collected during the call */
+static int
+session_call (lua_State *L) {
+	int status;
+
+	session_t *session = luaL_checkudata (L, 1, SESSION_MT);
+
+	if (session->pool == NULL) {
+		return send_error (L, "Session is closed\n");
+	}
+
+	lua_pushvalue (L, lua_upvalueindex (1));
+	lua_insert (L, 2);
+
+	lua_pushvalue (L, 1);
+	lua_setfield (L, LUA_REGISTRYINDEX, SESSION_CURRENT);
+
+	status = lua_pcall (L, lua_gettop (L) - 2, LUA_MULTRET, 0);
+
+	lua_pushnil (L);
+	lua_setfield (L, LUA_REGISTRYINDEX, SESSION_CURRENT);
+
+	if (status != 0) {
+		return lua_error (L);
+	}
+
+	return lua_gettop (L) - 1;
+}
+
+
 LUASVN_API
 luaopen_svn (lua_State *L) {
+	const luaL_Reg *reg;
+
+	init_library (L);
+
+	/* the library is released when this userdata is collected, at lua_close */
+	lua_newuserdata (L, 1);
+	luaL_newmetatable (L, LIBRARY_MT);
+	lua_pushcfunction (L, library_gc);
+	lua_setfield (L, -2, "__gc");
+	lua_setmetatable (L, -2);
+	lua_setfield (L, LUA_REGISTRYINDEX, LIBRARY_MT);
+
+#if APR_HAS_THREADS
+	luaL_newmetatable (L, CHUNK_QUEUE_MT);
+	lua_pushcfunction (L, chunk_queue_gc);
+	lua_setfield (L, -2, "__gc");
+	lua_pop (L, 1);
+
+	luaL_newmetatable (L, WALK_MT);
+	lua_pushcfunction (L, walk_gc);
+	lua_setfield (L, -2, "__gc");
+	lua_pop (L, 1);
+#endif
+
+#ifdef HAVE_INOTIFY
+	luaL_newmetatable (L, WATCHER_MT);
+	lua_pushcfunction (L, watcher_gc);
+	lua_setfield (L, -2, "__gc");
+	lua_newtable (L);
+	lua_pushcfunction (L, watcher_status);
+	lua_setfield (L, -2, "status");
+	lua_pushcfunction (L, watcher_close_method);
+	lua_setfield (L, -2, "close");
+	lua_setfield (L, -2, "__index");
+	lua_pop (L, 1);
+#endif
+
 	luaL_register (L, "svn", svn);
+
+	/* sessions by address, without keeping them alive, see push_session */
+	lua_newtable (L);
+	lua_newtable (L);
+	lua_pushliteral (L, "v");
+	lua_setfield (L, -2, "__mode");
+	lua_setmetatable (L, -2);
+	lua_setfield (L, LUA_REGISTRYINDEX, SESSION_ALL);
+
+	luaL_newmetatable (L, SESSION_MT);
+
+	lua_pushcfunction (L, session_close);
+	lua_setfield (L, -2, "__gc");
+
+	lua_newtable (L);
+
+	for (reg = svn; reg->name != NULL; reg++) {
+		if (reg->func != l_session) {
+			lua_pushcfunction (L, reg->func);
+			lua_pushcclosure (L, session_call, 1);
+			lua_setfield (L, -2, reg->name);
+		}
+	}
+
+	lua_pushcfunction (L, session_close);
+	lua_setfield (L, -2, "close");
+
+	lua_setfield (L, -2, "__index");
+
+	lua_pop (L, 1);
+
 	return 1;
 }
-
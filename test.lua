@@ -27,8 +27,28 @@ f:write(contents[2])
 f:close()
 t = svn.status(file)
 assert(string.sub(t[file],1,1) == "M", "file not listed as modified")
+t = svn.status(file, nil, {structured = true, verbose = true})
+assert(t[file].text_status == "M" and t[file].prop_status == " " and not t[file].copied)
+assert(t[file].kind == "file" and t[file].revision == r1 and t[file].commit_revision == r1)
+t = {}
+assert(svn.status(test_path, nil, {filter = {"modified"}, verbose = true}, function (path, status)
+	t[path] = status
+end) == 1 and string.sub(t[file], 1, 1) == "M")
+assert(svn.status(test_path, nil, {verbose = true}, function (path, status) return false end) == 1)
+n = 0
+assert(svn.status(test_path, nil, {verbose = true}, function (path, status)
+	assert(svn.status(test_path, nil, {verbose = true}, function () return false end) == 1)
+	n = n + 1
+end) == n and n > 1)
+watcher = svn.status_watcher(test_path)
+t, n = watcher:status()
+assert(string.sub(t[file], 1, 1) == "M" and n == 0)
 r2 = svn.commit(file)
 rev2content[r2]=contents[2]
+t, n = watcher:status()
+assert(not t[file] and n > 0)
+assert(watcher:status() == t)
+watcher:close()
 t = svn.list(repo_url)
 for k in pairs(t) do
 	print(k)
@@ -41,5 +61,225 @@ for rev, v in pairs(h) do
 		print(k,v)
 	end
 end
+t = svn.log(file, nil, nil, nil, {discover_changed_paths = true})
+assert(t[r1].actions:sub(1, 1) == "A" and t[r2].actions == "M")
+assert(t[r2].paths[1] == "/"..dir_name.."/"..file_name)
+t = svn.log(file, nil, nil, nil, {revprops = {"svn:author"}})
+assert(t[r1] and not t[r1].message and not t[r1].date)
+assert(not pcall(svn.log, file, nil, nil, nil, {revprops = {true}}))
+t = svn.log(file, nil, nil, nil, {columnar = true})
+assert(#t.revs == 2 and t.messages[1] == h[t.revs[1]].message and t.authors[2] == h[t.revs[2]].author)
+t = svn.list(dir, nil, {columnar = true})
+for i, name in ipairs(t.names) do
+	if name == file_name then
+		assert(t.sizes[i] == #contents[2] and t.revisions[i] == r2)
+	end
+end
+t = svn.list(repo_url, 0, {columnar = true, fields = {"kind", "size"}})
+assert(#t.names == 0 and #t.kinds == 0 and #t.sizes == 0)
+t = svn.log(file, nil, nil, nil, {date_format = "seconds"})
+assert(type(t[r1].date) == "number" and t[r1].date <= t[r2].date and t[r2].date <= os.time() + 1)
+t = svn.list(dir, nil, {date_format = "microseconds"})
+assert(math.floor(t[file_name].date / 1e6) == math.floor(svn.log(file, nil, nil, nil, {date_format = "seconds"})[r2].date))
+t = svn.list(repo_url.."/"..dir_name, nil, {fields = {"kind", "size"}})
+assert(t[file_name].kind == "file" and t[file_name].size == #contents[2] and not t[file_name].author)
+t = {}
+for name, entry in svn.list_iter(repo_url, nil, {recursive = true}) do
+	t[name] = entry
+end
+assert(t[dir_name.."/"] and t[dir_name.."/"..file_name].size == #contents[2])
+h = svn.list(dir)
+for name, entry in svn.list_iter(dir) do
+	assert(h[name] and h[name].size == entry.size and h[name].revision == entry.revision)
+end
+assert(svn.list(repo_url, nil, {recursive = true}, function (name, entry) return false end) == 1)
+for _, threads in ipairs{1, 3} do
+	n = 0
+	for name, entry in svn.walk(repo_url, nil, {threads = threads}) do
+		assert(t[name] and t[name].revision == entry.revision)
+		n = n + 1
+	end
+	for name in pairs(t) do
+		n = n - 1
+	end
+	assert(n == 0)
+end
+for name, entry in svn.walk(repo_url.."/"..dir_name.."/"..file_name) do
+	assert(name == file_name and entry.size == #contents[2])
+end
+it = svn.walk(repo_url, nil, {threads = 3})
+assert(it())
+it = nil
+collectgarbage()
+n = 0
+for name in svn.walk(repo_url, nil, {threads = 3}) do
+	n = n + 1
+end
+for name in pairs(t) do
+	n = n - 1
+end
+assert(n == 0)
+revs = {}
+for rev, entry in svn.log_iter(file) do
+	assert(h[rev].message == entry.message)
+	revs[#revs+1] = rev
+end
+assert(#revs == 2 and revs[1] > revs[2])
+assert(svn.log(file, nil, nil, nil, nil, function (rev, entry) return false end) == 1)
+n = 0
+assert(svn.file_revisions(file, nil, nil, function (rev, author, date, content)
+	assert(content == rev2content[rev] and h[rev].date == date)
+	n = n + 1
+end) == n and n == 2)
+assert(svn.file_revisions(file, nil, nil, function () return false end) == 1)
+assert(svn.file_revisions(file, nil, nil, function (rev, author, date)
+	assert(type(date) == "number")
+end, {date_format = "seconds"}) == 2)
+s = svn.session {non_interactive = true}
+for rev in pairs(h) do
+	assert(s:cat(file, rev) == rev2content[rev])
+end
+s:close()
+s = svn.session {ra_pool_max = 1}
+for rev in pairs(h) do
+	assert(s:cat(repo_url.."/"..dir_name.."/"..file_name, rev) == rev2content[rev])
+	assert(s:revprop_get(repo_url, "svn:date", rev))
+end
+assert(s:list(repo_url.."/"..dir_name, nil, {recursive = true})[file_name])
+s:close()
+for rev in pairs(h) do
+	local t = {}
+	assert(svn.cat_stream(file, rev, function (chunk) t[#t+1] = chunk end, 3) == #rev2content[rev])
+	assert(table.concat(t) == rev2content[rev])
+	t = {}
+	for chunk in svn.cat_chunks(file, rev, 3) do
+		t[#t+1] = chunk
+	end
+	assert(table.concat(t) == rev2content[rev])
+end
+assert(svn.cat_stream(file, r1, function () return false end, 1) == 1)
+d = svn.diff(file, r1, file, r2, nil, nil, {as_string = true})
+assert(not pcall(svn.diff, file, r1, file, r2, "diff.out", nil, {as_string = true}))
+assert(d:find("-"..contents[1], 1, true) and d:find("+"..contents[2], 1, true))
+t = {}
+assert(svn.diff(file, r1, file, r2, function (chunk) t[#t+1] = chunk end) == #d)
+assert(table.concat(t) == d)
+t = svn.diff_summary(repo_url, r1, repo_url, r2)
+assert(#t == 1 and t[1].path == dir_name.."/"..file_name and t[1].kind == "modified")
+assert(t[1].node_kind == "file" and not t[1].props_changed)
+size, md5 = svn.cat(file, r1, "test_output.txt")
+-- md5 of contents[1]
+assert(size == #contents[1] and md5 == "7e55db001d319a94b0b713529a756623")
+assert(not pcall(svn.cat, file, r1, true))
+f = io.open("test_output.txt", "rb")
+assert(f:read("*a") == contents[1])
+f:close()
+f = io.open("test_output.txt", "wb")
+assert(svn.cat(file, r2, f) == #contents[2])
+f:close()
+f = io.open("test_output.txt", "rb")
+assert(f:read("*a") == contents[2])
+f:close()
+os.remove("test_output.txt")
+assert(not pcall(s.cat, s, file), "closed session still usable")
+bin_file = dir .. "/test.bin"
+bin_content = "a\0b\0\255\0"
+f = io.open(bin_file, "wb")
+f:write(bin_content)
+f:close()
+svn.add(bin_file)
+r3 = svn.commit(test_path)
+assert(svn.cat(bin_file, r3) == bin_content, "binary file truncated")
+assert(svn.cat(repo_url.."/"..dir_name.."/test.bin", r3) == bin_content, "binary file truncated")
+file_url = repo_url.."/"..dir_name.."/"..file_name
+t, e = svn.cat_many({file_url, file, repo_url.."/missing"}, r2)
+assert(t[file_url] == contents[2] and t[file] == contents[2])
+assert(e[repo_url.."/missing"] and not t[repo_url.."/missing"])
+svn.cat_cache({max_bytes = 1024 * 1024})
+assert(svn.cat(file_url, r2) == contents[2])
+assert(svn.cat(file_url, r2) == contents[2])
+stats = svn.cat_cache()
+assert(stats.hits == 1 and stats.misses == 1 and stats.entries == 1)
+t = {}
+assert(svn.cat_stream(file_url, r2, function (chunk) t[#t+1] = chunk end) == #contents[2])
+assert(table.concat(t) == contents[2])
+assert(svn.cat_many({file_url}, r2)[file_url] == contents[2])
+out_file = os.tmpname()
+assert(svn.cat(file_url, r1, out_file) == #contents[1])
+os.remove(out_file)
+assert(svn.cat(file_url, r1) == contents[1])
+stats = svn.cat_cache()
+assert(stats.hits == 4 and stats.misses == 2 and stats.entries == 2)
+t = {}
+for chunk in svn.cat_chunks(file_url, r2, 3) do
+	t[#t+1] = chunk
+end
+assert(table.concat(t) == contents[2])
+t = {}
+for chunk in svn.cat_chunks(file_url, r3, 3) do
+	t[#t+1] = chunk
+end
+assert(svn.cat(file_url, r3) == table.concat(t))
+stats = svn.cat_cache()
+assert(stats.hits == 6 and stats.misses == 3 and stats.entries == 3)
+stats = svn.cat_cache({reset = true, max_bytes = 0})
+assert(stats.hits == 0 and stats.entries == 0)
+svn.list_cache({max_bytes = 1024 * 1024, head_ttl = 60})
+t = svn.list(repo_url, r2, {recursive = true})
+assert(svn.list(repo_url, r2, {recursive = true})[dir_name.."/"..file_name].author == t[dir_name.."/"..file_name].author)
+assert(svn.list(repo_url.."/"..dir_name, r2)[file_name].size == #contents[2])
+stats = svn.list_cache()
+assert(stats.misses == stats.entries and stats.hits == stats.entries + 1 and stats.head_ttl == 60)
+stats = svn.list_cache({reset = true, max_bytes = 0, head_ttl = 0})
+assert(stats.hits == 0 and stats.entries == 0)
+t, e = svn.update_all({test_path}, nil, {threads = 2})
+assert(t[test_path] == r3 and not next(e))
+t, e = svn.status_all({test_path, "missing_wc"}, nil, {verbose = true, structured = true})
+assert(t[test_path][file].revision == r3 and e["missing_wc"] and not t["missing_wc"])
+s = svn.session()
+s:log_cache({dir = "test_log_cache"})
+t = s:log(repo_url)
+n = 0
+for rev in pairs(t) do n = n + 1 end
+assert(s:log_cache().fetched == n)
+h = s:log(repo_url, r1, r2)
+assert(h[r1].message == t[r1].message and h[r2].date == t[r2].date and not h[r3])
+stats = s:log_cache()
+assert(stats.fetched == n and stats.hits == n + 2)
+assert(s:log_refresh(repo_url, r2) == 2)
+s:close()
+os.execute("rm -rf test_log_cache")
+s = svn.session()
+s:log_cache({dir = "test_log_cache"})
+assert(next(s:log(repo_url, nil, nil, 1)) and s:log_cache().fetched == 1)
+t = s:log(repo_url)
+assert(s:log_cache().fetched == n)
+s:close()
+os.execute("rm -rf test_log_cache")
+moved_url = repo_url.."/"..dir_name.."/moved.txt"
+r4 = svn.move(file_url, moved_url, "rename")
+assert(svn.cat(moved_url, r2) == contents[2])
+assert(not pcall(svn.cat, file_url, r2), "URL deleted in HEAD still readable")
+assert(svn.cat_many({moved_url}, r1)[moved_url] == contents[1])
+assert(svn.list(repo_url.."/"..dir_name, r2)[file_name])
+h = svn.log(moved_url, r1, r2)
+assert(h[r1] and h[r2])
+revs = {}
+for rev in svn.log_iter(moved_url, nil, nil, nil, {page = 1}) do
+	revs[#revs+1] = rev
+end
+assert(#revs == 3 and revs[1] == r4 and revs[2] == r2 and revs[3] == r1)
+svn.update(test_path)
+kw_file = dir.."/keywords.txt"
+f = io.open(kw_file, "wb")
+f:write("$Revision$\nline\n")
+f:close()
+svn.add(kw_file)
+svn.propset(kw_file, "svn:keywords", "Revision")
+svn.propset(kw_file, "svn:eol-style", "CRLF")
+r5 = svn.commit(test_path)
+t = "$Revision: "..r5.." $\r\nline\r\n"
+assert(svn.cat(repo_url.."/"..dir_name.."/keywords.txt", r5) == t)
+assert(svn.cat(repo_url.."/"..dir_name.."/keywords.txt") == t and svn.cat(kw_file) == t)
 svn.cleanup(test_path)
 svn.repos_delete(repo_path)